@@ -42,7 +42,10 @@ end
 function setup()
     player = scene:loadActor("knight.mdl");
     player:addToScene(vec3(4,0,0), 0);
+    scene:setPlayer(player);
 
+    -- Decoration can appear after the scene is shown
+    scene:setLoadPriority("deferred");
     local dude = scene:loadActor("knight.mdl");
     dude:addToScene(vec3(5.7,0,0), 270);
 
@@ -51,6 +54,8 @@ function setup()
 
     scene:loadLayer("scenes/space_test/front.png", vec4(0, 1, 0, 1), -5, {vec4(0, 1, 0.25, 1)});
     scene:loadLayer("scenes/space_test/front-sides.png", vec4(0, 1, 0, 1), -3.75, {vec4(0, 1, 0.25, 1)});
+    scene:setLoadPriority("critical");
+
     scene:loadLayer("scenes/space_test/middle.png", vec4(0, 1, 0, 1), -1.25, {vec4(0, 1, 0.25, 1)});
     scene:loadLayer("scenes/space_test/background.png", vec4(0, 1, 0, 1), 5, {vec4(0, 1, 0.25, 1)});
     scene:loadLayer("scenes/space_test/space_background.png", vec4(0, 1, 0, 1), 9, {vec4(0, 1, 0.25, 1)});
@@ -64,6 +69,12 @@ function setup()
     scene:addTrigger(vec3(0,-3,0), trigger, onTrigger);
 end
 
+-- Called when returning to the scene after leaving through the trigger
+function resume()
+    player:setPosition(vec3(4,0,0));
+    player:setVelocity(vec2(0,0));
+end
+
 function tick(dt)
 	local input = engine:getInput();
 	tickDebugCamera(input);
@@ -29,6 +29,7 @@ function setup()
     player = scene:loadActor("knight.mdl");
     print(player);
     player:addToScene(vec3(3, 1.25, 0), 180);
+    scene:setPlayer(player);
 
     scene:loadLayer("scenes/street/background.png", vec4(0, 1, 0, 1), 4, {vec4(0, 1, 0.25, 1)});
 
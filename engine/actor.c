@@ -21,6 +21,7 @@
 #include <string.h>
 #include <math.h>
 
+#include "engine.h"
 #include "renderer.h"
 #include "matrix.h"
 #include "modelview.h"
@@ -34,11 +35,20 @@
  */
 struct actor
 {
-    GLfloat facing;
     GLfloat collision_radius;
-    GLfloat cached_position[3];
     walkmap_actordata_ptr walkmap_data;
+
+    // Simulation state
+    struct actor_state state;
+
+    // State at the end of the previous simulation step
+    // for interpolating between steps when rendering
+    struct actor_state prev_state;
+
+    // Render state (only accessed by the main thread)
     model_ptr model;
+    model_instance_ptr model_instance;
+    GLfloat model_frac;
 };
 
 /*
@@ -53,17 +63,20 @@ void actor_movement_callback(actor_ptr a, GLfloat new_pos[3], GLfloat old_pos[3]
     if (moved > 0.01)
     {
         // Set facing based on actual movement vector
-        a->facing = atan2f(dy, dx)*180/M_PI + 90;
-        model_step_animation_frac(a->model, 0.5*moved);
+        a->state.facing = atan2f(dy, dx)*180/M_PI + 90;
+
+        // The model itself is only updated when drawn
+        GLfloat frac = fmodf(a->state.animation_frac + 0.5*moved, 1);
+        a->state.animation_frac = frac < 0 ? frac + 1 : frac;
     }
 
-    a->cached_position[0] = new_pos[0];
-    a->cached_position[1] = new_pos[1];
-    a->cached_position[2] = new_pos[2];
+    memcpy(a->state.position, new_pos, 3*sizeof(GLfloat));
 }
 
 /*
  * Create a new actor from the given definition
+ * The model is loaded on the worker pool: use
+ * actor_wait_loaded to wait for it to complete
  *
  * Call Context: Worker thread
  */
@@ -74,32 +87,82 @@ actor_ptr actor_create(const char *model, GLfloat collision_radius, walkmap_ptr
         return NULL;
 
     a->collision_radius = collision_radius;
-    a->model = model_create(model, e);
+    a->model = engine_retain_model(e, model);
+    a->model_instance = model_instance_create(a->model, e);
+
+    // Select the keyframes when first drawn, once the model has loaded
+    a->model_frac = -1;
     return a;
 }
 
 /*
  * Destroy actor
  *
- * Call Context: Main thread
+ * Call Context: Main thread, or worker thread for scenes that are not displayed
  */
 void actor_destroy(actor_ptr a, walkmap_ptr w, engine_ptr e)
 {
-    model_destroy(a->model, e);
+    model_instance_destroy(a->model_instance, e);
+    engine_release_model(e, a->model);
     if (a->walkmap_data)
         actor_remove_from_walkmap(a, w);
 
     free(a);
 }
 
+/*
+ * Wait for the actor resources to finish loading
+ *
+ * Call Context: Worker thread
+ */
+void actor_wait_loaded(actor_ptr a, engine_ptr e)
+{
+    model_wait_loaded(a->model, e);
+}
+
+/*
+ * Check whether the actor model has loaded and can be drawn
+ *
+ * Call Context: Main thread
+ */
+bool actor_is_ready(actor_ptr a)
+{
+    return model_is_ready(a->model);
+}
+
 void actor_add_to_walkmap(actor_ptr a, GLfloat pos[3], GLfloat facing, walkmap_ptr w)
 {
-    a->facing = facing;
+    a->state.facing = facing;
     a->walkmap_data = walkmap_register_actor(w, a, pos, a->collision_radius);
     walkmap_set_movement_callback(w, a->walkmap_data, actor_movement_callback);
 
     // Update stored position
-    walkmap_actor_position(w, a->walkmap_data, a->cached_position);
+    walkmap_actor_position(w, a->walkmap_data, a->state.position);
+    actor_store_state(a);
+}
+
+/*
+ * Save the current state as the start point for
+ * interpolation. Called before each simulation step
+ *
+ * Call Context: Simulation thread
+ */
+void actor_store_state(actor_ptr a)
+{
+    a->prev_state = a->state;
+}
+
+/*
+ * Copy the state before and after the latest simulation step
+ * Returns false if the actor is not in the walkmap (and shouldn't be drawn)
+ *
+ * Call Context: Simulation thread
+ */
+bool actor_get_states(actor_ptr a, struct actor_state *prev, struct actor_state *cur)
+{
+    *prev = a->prev_state;
+    *cur = a->state;
+    return a->walkmap_data != NULL;
 }
 
 void actor_remove_from_walkmap(actor_ptr a, walkmap_ptr w)
@@ -109,34 +172,66 @@ void actor_remove_from_walkmap(actor_ptr a, walkmap_ptr w)
 }
 
 /*
- * Render an actor into the current gl context
+ * Set the model animation alpha of the way from prev to cur,
+ * and return the model instance that will be drawn
  *
  * Call Context: Main thread
  */
-void actor_draw(actor_ptr a, modelview_ptr mv, renderer_ptr r)
+model_instance_ptr actor_update_animation(actor_ptr a, const struct actor_state *prev, const struct actor_state *cur,
+                                          GLfloat alpha)
 {
-    // Actor is not in the walkmap
-    if (!a->walkmap_data)
-        return;
+    // Animation loops, so interpolate forwards across the wrap
+    GLfloat step = cur->animation_frac - prev->animation_frac;
+    if (step < 0)
+        step += 1;
+    GLfloat frac = fmodf(prev->animation_frac + alpha*step, 1);
+    if (frac != a->model_frac)
+    {
+        model_instance_set_animation_frac(a->model_instance, frac);
+        a->model_frac = frac;
+    }
+
+    return a->model_instance;
+}
+
+/*
+ * Render an actor into the current gl context,
+ * interpolating alpha of the way from prev to cur
+ *
+ * Call Context: Main thread
+ */
+void actor_draw(actor_ptr a, const struct actor_state *prev, const struct actor_state *cur,
+                GLfloat alpha, modelview_ptr mv, renderer_ptr r)
+{
+    GLfloat position[3];
+    for (uint8_t i = 0; i < 3; i++)
+        position[i] = prev->position[i] + alpha*(cur->position[i] - prev->position[i]);
+
+    // Interpolate facing in the shortest direction
+    GLfloat turn = fmodf(cur->facing - prev->facing, 360);
+    if (turn > 180)
+        turn -= 360;
+    else if (turn < -180)
+        turn += 360;
+    GLfloat facing = prev->facing + alpha*turn;
+    model_instance_ptr mi = actor_update_animation(a, prev, cur, alpha);
 
     GLfloat mvp[16];
     GLfloat *modelview = modelview_push(mv);
 
     // Swap y and z axes for model
     // Move to new origin
-    mtxTranslateApply(modelview, a->cached_position[0], a->cached_position[1], a->cached_position[2]);
+    mtxTranslateApply(modelview, position[0], position[1], position[2]);
 
     // Rotate facing
-    mtxRotateZApply(modelview, a->facing);
+    mtxRotateZApply(modelview, facing);
 
     // Temporary: Translate test model to appear correctly
     mtxScaleApply(modelview, 0.1, 0.1, 0.1);
     mtxRotateXApply(modelview, 90);
     mtxTranslateApply(modelview, 0, 10, 0);
     modelview_calculate_mvp(mv, mvp);
-    renderer_enable_model_shader(r, mvp);
-
-    model_draw(a->model, r);
+    model_instance_draw(mi, mvp, r);
     modelview_pop(mv);
 }
 
@@ -184,5 +279,8 @@ void actor_set_position(actor_ptr a, GLfloat p[3], walkmap_ptr w)
     }
 
     walkmap_set_actor_position(w, a->walkmap_data, p);
-    walkmap_actor_position(w, a->walkmap_data, a->cached_position);
+    walkmap_actor_position(w, a->walkmap_data, a->state.position);
+
+    // Don't interpolate across teleports
+    memcpy(a->prev_state.position, a->state.position, 3*sizeof(GLfloat));
 }
@@ -21,9 +21,24 @@
 
 #include "typedefs.h"
 
+// Renderable actor state at the end of a simulation step
+struct actor_state
+{
+    GLfloat position[3];
+    GLfloat facing;
+    GLfloat animation_frac;
+};
+
 actor_ptr actor_create(const char *model, GLfloat collision_radius, walkmap_ptr w, engine_ptr e);
 void actor_destroy(actor_ptr a, walkmap_ptr w, engine_ptr e);
-void actor_draw(actor_ptr a, modelview_ptr mv, renderer_ptr r);
+void actor_wait_loaded(actor_ptr a, engine_ptr e);
+bool actor_is_ready(actor_ptr a);
+model_instance_ptr actor_update_animation(actor_ptr a, const struct actor_state *prev, const struct actor_state *cur,
+                                          GLfloat alpha);
+void actor_draw(actor_ptr a, const struct actor_state *prev, const struct actor_state *cur,
+                GLfloat alpha, modelview_ptr mv, renderer_ptr r);
+void actor_store_state(actor_ptr a);
+bool actor_get_states(actor_ptr a, struct actor_state *prev, struct actor_state *cur);
 
 void actor_velocity(actor_ptr a, GLfloat v[2], walkmap_ptr w);
 void actor_set_velocity(actor_ptr a, GLfloat v[2], walkmap_ptr w);
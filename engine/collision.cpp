@@ -88,33 +88,6 @@ collision_object_t collision_object_create_polygon(collision_world_t world, GLfl
     return fixture;
 }
 
-collision_object_t collision_object_create_triangle(collision_world_t world, GLfloat a[2], GLfloat b[2], GLfloat c[2], uint16_t group, uint16_t mask_flags, void *userdata)
-{
-    collision_object_t fixture = (collision_object_t)malloc(sizeof(struct collision_object));
-    assert(fixture);
-
-    b2BodyDef body_def;
-    body_def.position.Set(0.0f, 0.0f);
-    body_def.userData = userdata;
-    b2Body *body = world->world->CreateBody(&body_def);
-
-    b2Vec2 v[3];
-    v[0].Set(a[0], a[1]);
-    v[1].Set(b[0], b[1]);
-    v[2].Set(c[0], c[1]);
-
-    b2PolygonShape shape;
-    shape.Set(v, 3);
-
-    b2FixtureDef fixture_def;
-    fixture_def.shape = &shape;
-    fixture_def.filter.categoryBits = 1 << group;
-    fixture_def.filter.maskBits = mask_flags;
-    fixture->fixture = body->CreateFixture(&fixture_def);
-
-    return fixture;
-}
-
 collision_object_t collision_object_create_chain(collision_world_t world, GLfloat *vertices_3d, uint32_t vertex_count, uint16_t group, uint16_t mask_flags, void *userdata)
 {
     collision_object_t fixture = (collision_object_t)malloc(sizeof(struct collision_object));
@@ -148,9 +121,12 @@ void collision_object_free(collision_object_t co, collision_world_t world)
     world->world->DestroyBody(co->fixture->GetBody());
 }
 
-void collision_object_copy_collisiondata(collision_object_t to, collision_object_t from)
+void collision_object_set_collisiondata(collision_object_t co, uint16_t group, uint16_t mask_flags)
 {
-    to->fixture->SetFilterData(from->fixture->GetFilterData());
+    b2Filter filter = co->fixture->GetFilterData();
+    filter.categoryBits = 1 << group;
+    filter.maskBits = mask_flags;
+    co->fixture->SetFilterData(filter);
 }
 
 void collision_object_position(collision_object_t co, GLfloat p[2])
@@ -243,56 +219,6 @@ bool collision_iterator_finished(collision_iterator_t it)
     return it->body == NULL;
 }
 
-/*
- * Callback class for storing AABB hitest results
- */
-
-class box2dQueryWorldCallback : public b2QueryCallback
-{
-    b2Vec2 p;
-    void *(*callback)(void *, void *, void *);
-    void *callbackdata;
-public:
-    void *match;
-
-    box2dQueryWorldCallback(b2Vec2 p, void *(*callback)(void *, void *, void *), void *callbackdata)
-        : p(p), callback(callback), callbackdata(callbackdata)
-    {
-        match = NULL;
-    }
-
-    bool ReportFixture(b2Fixture *f)
-    {
-        // Check that the point is inside the triangle
-        // and not just the aabb
-        if (!f->TestPoint(p))
-            return true;
-
-        void *test = f->GetBody()->GetUserData();
-        // This is the first body that passed the hittest
-        // Accept it by default
-        if (!match)
-            match = test;
-        else // Callback returns the match to keep
-            match = callback(match, test, callbackdata);
-
-        return true;
-    }
-};
-
-void *collision_world_hittest(collision_world_t world, GLfloat pos[2], void *(*callback)(void *, void *, void *), void *callbackdata)
-{
-    b2AABB aabb;
-    b2Vec2 d(0.001f, 0.001f), p(pos[0], pos[1]);
-	aabb.lowerBound = p - d;
-	aabb.upperBound = p + d;
-
-    box2dQueryWorldCallback filter(p, callback, callbackdata);
-    world->world->QueryAABB(&filter, aabb);
-
-    return filter.match;
-}
-
 bool collision_object_hittest(collision_object_t co, GLfloat p[2], uint16_t collision_flags)
 {
     b2Filter cf = co->fixture->GetFilterData();
@@ -28,6 +28,9 @@
 #include <unistd.h>
 #include <math.h>
 #include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 #include "engine.h"
 #include "renderer.h"
@@ -40,16 +43,33 @@
 #include "scene.h"
 #include "walkmap.h"
 #include "actor.h"
+#include "model.h"
+#include "task_queue.h"
+#include "worker_pool.h"
+#include "vfs.h"
+#include "timer.h"
+#include "trace.h"
+
+// Number of task types (function and size class) to track costs for
+#define TASK_COST_TABLE_SIZE 128
+
+// Weight given to the most recent timing in a task's cost estimate
+#define TASK_COST_SMOOTHING 0.25
+
+// Number of hash chains in the texture registry
+#define TEXTURE_HASH_BUCKETS 256
 
 /*
  * Private implementation details
  */
 
-struct engine_task
+// Running estimate of the time taken by a task function
+// for tasks within a range of sizes
+struct task_cost
 {
     void (*func)(void *);
-    void *data;
-    struct engine_task *next;
+    uint8_t size_class;
+    double estimate;
 };
 
 struct engine_synchronization_info
@@ -59,21 +79,69 @@ struct engine_synchronization_info
     pthread_cond_t condition;
 };
 
+// GL work run on the upload thread, followed by a main thread
+// completion once the upload thread's commands have been fenced
+struct engine_upload_job
+{
+    void (*upload)(void *);
+    void (*complete)(void *);
+    void *data;
+#if !PLATFORM_GLES
+    GLsync fence;
+#endif
+};
+
+typedef enum
+{
+    UPLOAD_THREAD_STOPPED = 0,
+    UPLOAD_THREAD_STARTING,
+    UPLOAD_THREAD_RUNNING,
+} upload_thread_state;
+
 struct texture_instance_list
 {
+    char *path;
+    uint32_t hash;
+
+    // NULL until the texture has been created
     texture_ptr texture;
     uint32_t refcount;
 
-    struct texture_instance_list *prev;
+    // Set while the creating thread is loading the texture
+    // Other threads retaining the texture wait for it to clear
+    bool loading;
+
+    // Unreferenced textures are kept in a least-recently-used list
+    size_t memory_size;
+    struct texture_instance_list *lru_prev;
+    struct texture_instance_list *lru_next;
+
     struct texture_instance_list *next;
 };
 
+struct model_instance_list
+{
+    char *path;
+    model_ptr model;
+    uint32_t refcount;
+
+    struct model_instance_list *next;
+};
+
 struct font_instance_list
 {
     char *id;
     font_ptr font;
     uint32_t refcount;
 
+    // Font rasterization job
+    job_batch_ptr load;
+    char *file;
+    GLuint size;
+    GLsizei texture_size;
+    GLfloat scale;
+    engine_ptr e;
+
     struct font_instance_list *next;
 };
 
@@ -90,15 +158,46 @@ struct engine
     input_flags input;
     GPpolar analog_input[2];
 
-    // Task queue (as a linked list) for workers
-    // to call a function from the main thread
-    struct engine_task *tasks;
-    struct engine_task **tasks_tail;
-    pthread_mutex_t task_mutex;
+    // Lock-free task queues (one per priority class)
+    // for workers to call a function from the main thread
+    task_queue_ptr tasks[TASK_PRIORITY_COUNT];
+
+    // Learned task costs, keyed by task function and size class
+    // Only accessed from the main thread
+    struct task_cost task_costs[TASK_COST_TABLE_SIZE];
+
+    // Persistent worker threads for loading jobs
+    worker_pool_ptr workers;
+
+    // Optional thread that uploads shareable GL objects
+    // (textures) using a context shared with the main thread
+    volatile upload_thread_state upload_state;
+    pthread_t upload_thread;
+    task_queue_ptr upload_tasks;
+    uint32_t upload_pending;
+    bool upload_shutdown;
+    pthread_mutex_t upload_mutex;
+    pthread_cond_t upload_cond;
+    bool (*upload_set_context)(void *, bool);
+    void *upload_context;
 
     // Texture management
-    struct texture_instance_list *textures;
+    // The mutex is only held for registry lookups, not while loading
+    struct texture_instance_list *textures[TEXTURE_HASH_BUCKETS];
     pthread_mutex_t texture_mutex;
+    pthread_cond_t texture_loaded;
+
+    // Unreferenced textures, most recently released first
+    struct texture_instance_list *texture_lru_head;
+    struct texture_instance_list *texture_lru_tail;
+    size_t texture_lru_size;
+
+    // Model management
+    struct model_instance_list *models;
+    pthread_mutex_t model_mutex;
+
+    // Asset files, read through any mounted scene packs
+    vfs_ptr vfs;
 
     // Font management
     struct font_instance_list *fonts;
@@ -113,20 +212,37 @@ struct engine
     time_t fps_time;
 };
 
+void engine_process_tasks(engine_ptr e, double time_budget);
+
 /*
  * Create an engine
+ * start_scene overrides the configured first scene if non-NULL
  */
-engine_ptr engine_create(const char *resource_path, GLuint window_width, GLuint window_height)
+engine_ptr engine_create(const char *resource_path, const char *start_scene, GLuint window_width, GLuint window_height)
 {
     engine_ptr e = calloc(1, sizeof(struct engine));
     if (!e)
         return NULL;
 
-    e->tasks_tail = &e->tasks;
+    for (size_t i = 0; i < TASK_PRIORITY_COUNT; i++)
+        e->tasks[i] = task_queue_create();
+
+    e->upload_tasks = task_queue_create();
+    pthread_mutex_init(&e->upload_mutex, NULL);
+    pthread_cond_init(&e->upload_cond, NULL);
+
+    // Scene loads spend much of their time blocked waiting for the
+    // main thread, so keep at least two workers even on single-core
+    // devices so that one blocked load can't stall every other job
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    e->workers = worker_pool_create(cores > 3 ? cores - 1 : 2);
+
     e->resource_path = strdup(resource_path);
     chdir(e->resource_path);
+    e->vfs = vfs_create();
 
     e->renderer = renderer_create();
+    texture_detect_formats();
 
     // TODO: Load from file
     e->config = (struct engine_config){
@@ -138,11 +254,50 @@ engine_ptr engine_create(const char *resource_path, GLuint window_width, GLuint
         .scene_aspect = 4.0f/3,
         .min_aspect = 1,
         .max_aspect = 1.5,
-        .start_scene = strdup("space_test")
+        .task_budget = 0.01,
+        .texture_cache_budget = 64*1024*1024,
+        .prefetch_budget = 192*1024*1024,
+        .suspended_scene_limit = 2,
+        .suspended_scene_budget = 128*1024*1024,
+        .sim_timestep = 1.0f/60,
+        .sim_max_substeps = 4,
+        .threaded_simulation = true,
+        .cpu_model_animation = false,
+        .trace_dump = false,
+        .trace_seconds = 5,
+        .start_scene = strdup(start_scene ? start_scene : "space_test")
     };
 
+    // Write traces and cached scripts to the per-user temporary
+    // directory, as the resource directory may be read-only
+    const char *trace_dir = getenv("TMPDIR");
+    if (!trace_dir)
+        trace_dir = "/tmp";
+
+    e->config.trace_path = calloc(strlen(trace_dir) + 24, sizeof(char));
+    assert(e->config.trace_path);
+    sprintf(e->config.trace_path, "%s/sceneflip-trace.json", trace_dir);
+
+    e->config.script_cache_path = calloc(strlen(trace_dir) + 20, sizeof(char));
+    assert(e->config.script_cache_path);
+    sprintf(e->config.script_cache_path, "%s/sceneflip-scripts", trace_dir);
+
+    // Cached bytecode is loaded without verification, so only use
+    // a directory that is private to this user (not a symlink)
+    struct stat cache_stat;
+    if ((mkdir(e->config.script_cache_path, 0700) && errno != EEXIST) ||
+        lstat(e->config.script_cache_path, &cache_stat) || !S_ISDIR(cache_stat.st_mode) ||
+        cache_stat.st_uid != getuid() || (cache_stat.st_mode & 077))
+    {
+        printf("Unable to use script cache %s\n", e->config.script_cache_path);
+        free(e->config.script_cache_path);
+        e->config.script_cache_path = NULL;
+    }
+
     pthread_mutex_init(&e->texture_mutex, NULL);
-    pthread_mutex_init(&e->task_mutex, NULL);
+    pthread_cond_init(&e->texture_loaded, NULL);
+
+    pthread_mutex_init(&e->model_mutex, NULL);
 
     e->fonts_tail = &e->fonts;
     pthread_mutex_init(&e->font_mutex, NULL);
@@ -167,22 +322,62 @@ engine_ptr engine_create(const char *resource_path, GLuint window_width, GLuint
 void engine_destroy(engine_ptr e)
 {
     assert(e);
+
+    // In-flight jobs may be waiting for main thread tasks
+    while (worker_pool_busy(e->workers))
+    {
+        engine_process_tasks(e, 0.01);
+        usleep(1000);
+    }
+
+    // Workers are idle and can no longer queue uploads, so
+    // the upload thread can finish its queue and exit
+    if (e->upload_state == UPLOAD_THREAD_RUNNING)
+    {
+        pthread_mutex_lock(&e->upload_mutex);
+        e->upload_shutdown = true;
+        pthread_cond_signal(&e->upload_cond);
+        pthread_mutex_unlock(&e->upload_mutex);
+
+        pthread_join(e->upload_thread, NULL);
+        e->upload_state = UPLOAD_THREAD_STOPPED;
+
+        // Run the completions for the final uploads
+        engine_process_tasks(e, INFINITY);
+    }
+    task_queue_destroy(e->upload_tasks);
+    pthread_cond_destroy(&e->upload_cond);
+    pthread_mutex_destroy(&e->upload_mutex);
+
     free(e->resource_path);
     renderer_destroy(e->renderer);
     frame_destroy(e->current_frame, e);
 
+    // Scenes wait on their finished job batches as they are
+    // destroyed, so the idle pool is kept until the frame is gone
+    worker_pool_destroy(e->workers);
+
     // TODO: Clean up task queue without breaking
     // worker threads
-    pthread_mutex_destroy(&e->task_mutex);
+    for (size_t i = 0; i < TASK_PRIORITY_COUNT; i++)
+        task_queue_destroy(e->tasks[i]);
 
-    for (struct texture_instance_list *tl = e->textures, *next; tl; tl = next)
-    {
-        assert(tl->refcount == 0);
-        texture_destroy(tl->texture, e);
-        next = tl->next;
-        free(tl);
-    }
+    // Models hold texture references, and are destroyed
+    // as soon as their last reference is released
+    assert(e->models == NULL);
+    pthread_mutex_destroy(&e->model_mutex);
+
+    for (size_t i = 0; i < TEXTURE_HASH_BUCKETS; i++)
+        for (struct texture_instance_list *tl = e->textures[i], *next; tl; tl = next)
+        {
+            assert(tl->refcount == 0);
+            texture_destroy(tl->texture, e);
+            next = tl->next;
+            free(tl->path);
+            free(tl);
+        }
 
+    pthread_cond_destroy(&e->texture_loaded);
     pthread_mutex_destroy(&e->texture_mutex);
 
     pthread_mutex_lock(&e->font_mutex);
@@ -190,13 +385,18 @@ void engine_destroy(engine_ptr e)
     {
         assert(fil->refcount == 0);
         font_destroy(fil->font, e);
+        job_batch_destroy(fil->load);
         free(fil->id);
+        free(fil->file);
         next = fil->next;
         free(fil);
     }
     pthread_mutex_unlock(&e->font_mutex);
 
+    vfs_destroy(e->vfs);
     free(e->config.start_scene);
+    free(e->config.trace_path);
+    free(e->config.script_cache_path);
     free(e);
 }
 
@@ -232,21 +432,16 @@ void engine_update_overlay_display(engine_ptr e)
 
 /*
  * Queue a task to be run on the main thread
+ * Tasks within a priority class are run in the order they were queued
+ * Normally called through the engine_queue_task macro
  *
  * Call Context: Worker thread
  */
-void engine_queue_task(engine_ptr e, void (*func)(void *), void *data)
+void engine_queue_named_task(engine_ptr e, task_priority p, void (*func)(void *), void *data, size_t size, const char *name)
 {
-    struct engine_task *t = calloc(1, sizeof(struct engine_task));
-    assert(t);
-    t->func = func;
-    t->data = data;
-
-    // Append to list tail
-    pthread_mutex_lock(&e->task_mutex);
-    *e->tasks_tail = t;
-    e->tasks_tail = &t->next;
-    pthread_mutex_unlock(&e->task_mutex);
+    assert(p >= TASK_PRIORITY_CHEAP && p < TASK_PRIORITY_COUNT);
+    struct task t = {.func = func, .data = data, .name = name, .size = size};
+    task_queue_push(e->tasks[p], &t);
 }
 
 /*
@@ -266,6 +461,13 @@ static void engine_task_synchronizer(void *_esi)
     pthread_mutex_unlock(&esi->mutex);
 }
 
+/*
+ * Placeholder upload used to synchronize the upload thread queue
+ *
+ * Call Context: Upload thread
+ */
+static void engine_upload_synchronizer(void *data) {}
+
 /*
  * Block until the current task queue has completed
  *
@@ -278,9 +480,22 @@ void engine_synchronize_tasks(engine_ptr e)
     pthread_mutex_init(&esi.mutex, NULL);
     pthread_cond_init(&esi.condition, NULL);
 
-    // Block until complete
     pthread_mutex_lock(&esi.mutex);
-    engine_queue_task(e, engine_task_synchronizer, &esi);
+
+    // Uploads complete through main thread tasks, so
+    // wait for these before synchronizing the main thread
+    if (engine_has_upload_thread(e))
+    {
+        engine_queue_upload(e, engine_upload_synchronizer, engine_task_synchronizer, &esi);
+        while (!esi.complete)
+            pthread_cond_wait(&esi.condition, &esi.mutex);
+        esi.complete = false;
+    }
+
+    // Block until complete
+    // Queued as an upload so that it runs after all previously queued
+    // cheap and upload tasks, but does not wait for mipmap generation
+    engine_queue_task(e, TASK_PRIORITY_UPLOAD, engine_task_synchronizer, &esi);
 
     while(!esi.complete)
         pthread_cond_wait(&esi.condition, &esi.mutex);
@@ -290,111 +505,516 @@ void engine_synchronize_tasks(engine_ptr e)
     pthread_mutex_destroy(&esi.mutex);
 }
 
+/*
+ * Find (or create) the cost estimate for a task.
+ * The cost of a task that uploads a large texture says little about
+ * one that uploads a small texture, so tasks are grouped into size
+ * classes a factor of four apart. Tasks of unknown size share class 0
+ * Returns NULL if the table is full
+ *
+ * Call Context: Main thread
+ */
+static struct task_cost *engine_task_cost(engine_ptr e, const struct task *t)
+{
+    uint8_t size_class = 0;
+    for (size_t size = t->size; size; size >>= 2)
+        size_class++;
+
+    size_t start = (((uintptr_t)t->func >> 4) + 31*size_class) % TASK_COST_TABLE_SIZE;
+    for (size_t i = 0; i < TASK_COST_TABLE_SIZE; i++)
+    {
+        struct task_cost *tc = &e->task_costs[(start + i) % TASK_COST_TABLE_SIZE];
+        if (tc->func == t->func && tc->size_class == size_class)
+            return tc;
+
+        if (!tc->func)
+        {
+            tc->func = t->func;
+            tc->size_class = size_class;
+            tc->estimate = 0;
+            return tc;
+        }
+    }
+
+    return NULL;
+}
+
 /*
  * Process tasks that were queued by worker threads
- * Run as many tasks as possible within time_threshold seconds
+ *
+ * Tasks are run in priority order until the next task is expected
+ * to exceed the time budget, in which case it is deferred to a later
+ * tick. At least one task is run each call so that tasks that take
+ * longer than the entire budget still make progress.
  *
  * Call Context: Main thread
  */
-void engine_process_tasks(engine_ptr e, double time_threshold)
+void engine_process_tasks(engine_ptr e, double time_budget)
+{
+    TRACE_ZONE("engine_process_tasks");
+    struct task t;
+
+    double start = timer_now();
+    bool ran_task = false;
+    for (size_t p = 0; p < TASK_PRIORITY_COUNT; p++)
+        while (task_queue_peek(e->tasks[p], &t))
+        {
+            struct task_cost *tc = engine_task_cost(e, &t);
+            double task_start = timer_now();
+            if (ran_task && tc && task_start - start + tc->estimate > time_budget)
+                return;
+
+            task_queue_pop(e->tasks[p], &t);
+            {
+                TRACE_ZONE(t.name);
+                t.func(t.data);
+            }
+            ran_task = true;
+
+            if (tc)
+            {
+                double cost = timer_now() - task_start;
+                if (tc->estimate == 0)
+                    tc->estimate = cost;
+                else
+                    tc->estimate += TASK_COST_SMOOTHING*(cost - tc->estimate);
+            }
+        }
+}
+
+/*
+ * Submit a job to run on the worker pool.
+ * b is an optional batch that can be passed to engine_wait_jobs
+ *
+ * Call Context: Any thread
+ */
+void engine_queue_job(engine_ptr e, job_batch_ptr b, void (*func)(void *), void *data)
+{
+    worker_pool_submit(e->workers, b, func, data);
+}
+
+/*
+ * Block until all jobs in the batch have completed
+ *
+ * Call Context: Any thread
+ */
+void engine_wait_jobs(engine_ptr e, job_batch_ptr b)
+{
+    job_batch_wait(e->workers, b);
+}
+
+#pragma mark Upload Thread
+#if !PLATFORM_GLES
+/*
+ * Make the upload's results visible to the main thread context
+ * and then run its completion function
+ *
+ * Call Context: Main thread (via engine_process_tasks)
+ */
+static void engine_upload_complete(void *_u)
+{
+    struct engine_upload_job *u = _u;
+
+    // Later commands in this context wait for the GPU to finish the upload,
+    // without blocking the CPU
+    glWaitSync(u->fence, 0, GL_TIMEOUT_IGNORED); checkGLError();
+    glDeleteSync(u->fence); checkGLError();
+
+    if (u->complete)
+        u->complete(u->data);
+    free(u);
+}
+
+/*
+ * Run queued uploads until the engine is destroyed
+ *
+ * Call Context: Upload thread
+ */
+static void *engine_upload_thread(void *_e)
 {
-    // No tasks
-    if (!e->tasks)
-        return;
+    engine_ptr e = _e;
+    bool current = e->upload_set_context(e->upload_context, true);
 
-    pthread_mutex_lock(&e->task_mutex);
-    clock_t start = clock();
-    double elapsed;
-    do
+    pthread_mutex_lock(&e->upload_mutex);
+    e->upload_state = current ? UPLOAD_THREAD_RUNNING : UPLOAD_THREAD_STOPPED;
+    pthread_cond_broadcast(&e->upload_cond);
+    pthread_mutex_unlock(&e->upload_mutex);
+
+    if (!current)
+        return NULL;
+
+    for (;;)
     {
-        // Pop the first task from the queue
-        struct engine_task *t = e->tasks;
-        e->tasks = t->next;
-        if (!e->tasks)
-            e->tasks_tail = &e->tasks;
-
-        t->func(t->data);
-        free(t);
-        elapsed = (clock() - start)*1.0f/CLOCKS_PER_SEC;
+        pthread_mutex_lock(&e->upload_mutex);
+        while (!e->upload_pending && !e->upload_shutdown)
+            pthread_cond_wait(&e->upload_cond, &e->upload_mutex);
+
+        if (!e->upload_pending)
+        {
+            pthread_mutex_unlock(&e->upload_mutex);
+            break;
+        }
+
+        e->upload_pending--;
+        pthread_mutex_unlock(&e->upload_mutex);
+
+        // An earlier push may still be linking its node into the queue
+        struct task t;
+        while (!task_queue_pop(e->upload_tasks, &t))
+            sched_yield();
+
+        struct engine_upload_job *u = t.data;
+        {
+            TRACE_ZONE(t.name);
+            u->upload(u->data);
+        }
+
+        // The fence must be flushed before another context can wait on it
+        u->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0); checkGLError();
+        glFlush();
+        engine_queue_task(e, TASK_PRIORITY_CHEAP, engine_upload_complete, u);
     }
-    while (e->tasks && elapsed < time_threshold);
-    pthread_mutex_unlock(&e->task_mutex);
+
+    e->upload_set_context(e->upload_context, false);
+    return NULL;
+}
+#endif
+
+/*
+ * Start a thread for uploading textures using a separate GL context
+ * set_context is called from the upload thread with current = true to
+ * make a context that shares objects with the main context current, and
+ * with current = false before the thread exits. The context must remain
+ * valid until engine_destroy returns.
+ *
+ * Returns false if the thread could not be started; all GL work then
+ * continues to run on the main thread.
+ *
+ * Call Context: Main thread
+ */
+bool engine_start_upload_thread(engine_ptr e, bool (*set_context)(void *context, bool current), void *context)
+{
+    // OpenGL ES 2 doesn't have fence syncs
+#if PLATFORM_GLES
+    return false;
+#else
+    if (e->upload_state != UPLOAD_THREAD_STOPPED)
+        return false;
+
+    e->upload_set_context = set_context;
+    e->upload_context = context;
+    e->upload_state = UPLOAD_THREAD_STARTING;
+    if (pthread_create(&e->upload_thread, NULL, engine_upload_thread, e))
+    {
+        e->upload_state = UPLOAD_THREAD_STOPPED;
+        return false;
+    }
+
+    // Wait for the thread to report whether it could use the context
+    pthread_mutex_lock(&e->upload_mutex);
+    while (e->upload_state == UPLOAD_THREAD_STARTING)
+        pthread_cond_wait(&e->upload_cond, &e->upload_mutex);
+    pthread_mutex_unlock(&e->upload_mutex);
+
+    if (e->upload_state != UPLOAD_THREAD_RUNNING)
+    {
+        pthread_join(e->upload_thread, NULL);
+        printf("Unable to use shared context: uploading on the main thread\n");
+        return false;
+    }
+
+    return true;
+#endif
+}
+
+/*
+ * Returns true if uploads can be queued with engine_queue_upload
+ *
+ * Call Context: Any thread
+ */
+bool engine_has_upload_thread(engine_ptr e)
+{
+    return e->upload_state == UPLOAD_THREAD_RUNNING;
+}
+
+/*
+ * Queue GL work to run on the upload thread.
+ * upload may only create or modify objects that are shared
+ * between contexts (textures and buffers, but not vertex arrays
+ * or framebuffers). complete (which may be NULL) is then run on
+ * the main thread once the results are usable there.
+ * Normally called through the engine_queue_upload macro
+ *
+ * Call Context: Any thread, when engine_has_upload_thread is true
+ */
+void engine_queue_named_upload(engine_ptr e, void (*upload)(void *), void (*complete)(void *), void *data, const char *name)
+{
+    assert(engine_has_upload_thread(e));
+
+    struct engine_upload_job *u = calloc(1, sizeof(struct engine_upload_job));
+    assert(u);
+    u->upload = upload;
+    u->complete = complete;
+    u->data = data;
+
+    struct task t = {.func = upload, .data = u, .name = name};
+    task_queue_push(e->upload_tasks, &t);
+
+    pthread_mutex_lock(&e->upload_mutex);
+    e->upload_pending++;
+    pthread_cond_signal(&e->upload_cond);
+    pthread_mutex_unlock(&e->upload_mutex);
 }
 
 #pragma mark Worker Texture Management
+/*
+ * FNV-1a hash of a texture path
+ */
+static uint32_t texture_path_hash(const char *path)
+{
+    uint32_t hash = 2166136261u;
+    for (const char *c = path; *c; c++)
+        hash = (hash ^ (uint8_t)*c)*16777619u;
+
+    return hash;
+}
+
+/*
+ * Remove an unreferenced texture from the LRU list
+ * Must be called with texture_mutex held
+ */
+static void texture_lru_remove(engine_ptr e, struct texture_instance_list *tl)
+{
+    if (tl->lru_prev)
+        tl->lru_prev->lru_next = tl->lru_next;
+    else
+        e->texture_lru_head = tl->lru_next;
+
+    if (tl->lru_next)
+        tl->lru_next->lru_prev = tl->lru_prev;
+    else
+        e->texture_lru_tail = tl->lru_prev;
+
+    tl->lru_prev = tl->lru_next = NULL;
+    e->texture_lru_size -= tl->memory_size;
+}
+
+/*
+ * Destroy least recently used textures until
+ * the unreferenced textures fit within the budget
+ * Must be called with texture_mutex held
+ */
+static void texture_lru_trim(engine_ptr e)
+{
+    while (e->texture_lru_tail && e->texture_lru_size > e->config.texture_cache_budget)
+    {
+        struct texture_instance_list *tl = e->texture_lru_tail;
+        texture_lru_remove(e, tl);
+
+        struct texture_instance_list **ptl = &e->textures[tl->hash % TEXTURE_HASH_BUCKETS];
+        while (*ptl != tl)
+            ptl = &(*ptl)->next;
+        *ptl = tl->next;
+
+        engine_queue_task(e, TASK_PRIORITY_CHEAP, (void (*)(void *))texture_destroy_internal, tl->texture);
+        free(tl->path);
+        free(tl);
+    }
+}
+
 /*
  * Load a texture, or increase the refcount if it is already loaded
+ * If another thread is creating the same texture then this
+ * waits for it rather than loading the file twice.
+ * Unreferenced textures that are still cached are revived immediately.
+ *
+ * The image is decoded asynchronously, so callers must
+ * use texture_wait_decoded before the texture is drawn
  *
  * Call Context: Worker thread
  */
 texture_instance_ptr engine_retain_texture(engine_ptr e, const char *path)
 {
+    uint32_t hash = texture_path_hash(path);
+    struct texture_instance_list **bucket = &e->textures[hash % TEXTURE_HASH_BUCKETS];
+
     pthread_mutex_lock(&e->texture_mutex);
 
     // Search for existing texture
-    struct texture_instance_list **end = &e->textures;
-    for (; *end; end = &(*end)->next)
-        if (texture_has_path((*end)->texture, path))
+    for (struct texture_instance_list *tl = *bucket; tl; tl = tl->next)
+        if (tl->hash == hash && !strcmp(tl->path, path))
         {
-            (*end)->refcount++;
+            if (tl->refcount++ == 0 && !tl->loading)
+                texture_lru_remove(e, tl);
+
+            while (tl->loading)
+                pthread_cond_wait(&e->texture_loaded, &e->texture_mutex);
+
             pthread_mutex_unlock(&e->texture_mutex);
-            return (*end)->texture;
+            return tl->texture;
         }
 
-    // Create new texture
+    // Register the texture as loading so that other
+    // threads can find it while the lock is released
     struct texture_instance_list *tl = calloc(1, sizeof(struct texture_instance_list));
     assert(tl);
+    tl->path = strdup(path);
+    tl->hash = hash;
     tl->refcount = 1;
-    tl->texture = texture_create(path, e);
-    assert(tl->texture);
+    tl->loading = true;
+    tl->next = *bucket;
+    *bucket = tl;
+
+    pthread_mutex_unlock(&e->texture_mutex);
 
-    tl->prev = *end;
-    *end = tl;
+    texture_ptr t = texture_create(path, e);
+    assert(t);
 
+    pthread_mutex_lock(&e->texture_mutex);
+    tl->texture = t;
+    tl->loading = false;
+    pthread_cond_broadcast(&e->texture_loaded);
     pthread_mutex_unlock(&e->texture_mutex);
-    return tl->texture;
+
+    return t;
 }
 
 /*
- * Decrease the refcount on a texture. Free it if it hits zero
+ * Decrease the refcount on a texture. Once it hits zero the
+ * texture is cached until it is evicted by newer textures
  *
  * Call Context: Worker thread
  */
 void engine_release_texture(engine_ptr e, texture_instance_ptr t)
 {
+    // The decode job may still be queueing the upload, and sets the
+    // size used for the cache budget. Wait without holding the
+    // mutex, as this thread may run other jobs in the meantime
+    texture_wait_decoded(t, e);
+
+    uint32_t hash = texture_path_hash(texture_path(t));
     pthread_mutex_lock(&e->texture_mutex);
 
-    // Find instance in the textures array
-    struct texture_instance_list *tl = NULL;
-    for (tl = e->textures; tl; tl = tl->next)
-        if (tl->texture == t)
+    // Find instance in the registry
+    struct texture_instance_list **ptl = &e->textures[hash % TEXTURE_HASH_BUCKETS];
+    for (; *ptl; ptl = &(*ptl)->next)
+        if ((*ptl)->texture == t)
+            break;
+
+    struct texture_instance_list *tl = *ptl;
+    if (tl == NULL)
+    {
+        printf("Attempting to release a non-retained texture\n");
+        assert(FATAL_ERROR);
+    }
+
+    // Cache texture once the last reference is released
+    if (--tl->refcount == 0)
+    {
+        tl->memory_size = texture_memory_size(t);
+        tl->lru_next = e->texture_lru_head;
+        if (tl->lru_next)
+            tl->lru_next->lru_prev = tl;
+        else
+            e->texture_lru_tail = tl;
+
+        e->texture_lru_head = tl;
+        e->texture_lru_size += tl->memory_size;
+        texture_lru_trim(e);
+    }
+
+    pthread_mutex_unlock(&e->texture_mutex);
+}
+
+#pragma mark Worker Model Management
+/*
+ * Increase the refcount on a model, loading it if necessary
+ * Every actor using the same model file shares its keyframes,
+ * texcoords, texture and static GL buffers
+ *
+ * Call Context: Worker thread
+ */
+model_ptr engine_retain_model(engine_ptr e, const char *path)
+{
+    pthread_mutex_lock(&e->model_mutex);
+
+    for (struct model_instance_list *ml = e->models; ml; ml = ml->next)
+        if (!strcmp(ml->path, path))
         {
-            // Decrement refcount. If nonzero, we're done
-            if (--tl->refcount)
-                break;
+            ml->refcount++;
+            pthread_mutex_unlock(&e->model_mutex);
+            return ml->model;
+        }
 
-            // Free texture
-            engine_queue_task(e, (void (*)(void *))texture_destroy_internal, tl->texture);
+    struct model_instance_list *ml = calloc(1, sizeof(struct model_instance_list));
+    assert(ml);
+    ml->path = strdup(path);
+    ml->model = model_create(path, e);
+    ml->refcount = 1;
+    ml->next = e->models;
+    e->models = ml;
 
-            if (tl->prev)
-                tl->prev->next = tl->next;
+    pthread_mutex_unlock(&e->model_mutex);
+    return ml->model;
+}
 
-            if (tl->next)
-                tl->next->prev = tl->prev;
+/*
+ * Decrease the refcount on a model, and destroy
+ * it once there are no remaining references
+ *
+ * Call Context: Any thread
+ */
+void engine_release_model(engine_ptr e, model_ptr m)
+{
+    pthread_mutex_lock(&e->model_mutex);
 
-            free(tl);
+    struct model_instance_list **pml = &e->models;
+    for (; *pml; pml = &(*pml)->next)
+        if ((*pml)->model == m)
             break;
-        }
 
-    if (tl == NULL)
+    struct model_instance_list *ml = *pml;
+    if (ml == NULL)
     {
-        printf("Attempting to release a non-retained texture\n");
+        printf("Attempting to release a non-retained model\n");
         assert(FATAL_ERROR);
     }
 
-    pthread_mutex_unlock(&e->texture_mutex);
+    bool destroy = --ml->refcount == 0;
+    if (destroy)
+        *pml = ml->next;
+
+    pthread_mutex_unlock(&e->model_mutex);
+
+    // Destroying waits for the model's load jobs without holding the
+    // mutex, as this thread may run other jobs (that retain models)
+    // in the meantime
+    if (destroy)
+    {
+        model_destroy(ml->model, e);
+        free(ml->path);
+        free(ml);
+    }
+}
+
+#pragma mark Worker Font Management
+/*
+ * Rasterize a font on the worker pool
+ *
+ * Call Context: Worker thread
+ */
+static void engine_load_font_job(void *_fi)
+{
+    struct font_instance_list *fi = _fi;
+    fi->font = font_create(fi->file, fi->size, fi->texture_size, fi->scale, fi->e);
 }
 
+/*
+ * Start loading a font. Rasterization runs on the worker pool, and
+ * the first engine_retain_font call will block until it completes
+ *
+ * Call Context: Main thread
+ */
 void engine_load_font(engine_ptr e, const char *id, const char *file, GLuint size)
 {
     GLsizei font_tex_size = 512;
@@ -404,12 +1024,20 @@ void engine_load_font(engine_ptr e, const char *id, const char *file, GLuint siz
     assert(fi);
 
     fi->id = strdup(id);
-    assert(fi->id);
+    fi->file = strdup(file);
+    assert(fi->id && fi->file);
 
-    fi->font = font_create("Inconsolata.otf", size, font_tex_size, font_tex_size*4.0f/width, e);
+    fi->size = size;
+    fi->texture_size = font_tex_size;
+    fi->scale = font_tex_size*4.0f/width;
+    fi->e = e;
+    fi->load = job_batch_create();
+    engine_queue_job(e, fi->load, engine_load_font_job, fi);
 
+    pthread_mutex_lock(&e->font_mutex);
     *e->fonts_tail = fi;
     e->fonts_tail = &fi->next;
+    pthread_mutex_unlock(&e->font_mutex);
 }
 
 font_instance_ptr engine_retain_font(engine_ptr e, const char *id)
@@ -420,6 +1048,8 @@ font_instance_ptr engine_retain_font(engine_ptr e, const char *id)
         {
             fi->refcount++;
             pthread_mutex_unlock(&e->font_mutex);
+
+            engine_wait_jobs(e, fi->load);
             return fi->font;
         }
 
@@ -435,6 +1065,7 @@ void engine_release_font(engine_ptr e, font_instance_ptr fi)
         if (fi == fil->font)
         {
             fil->refcount--;
+            pthread_mutex_unlock(&e->font_mutex);
             return;
         }
     pthread_mutex_unlock(&e->font_mutex);
@@ -451,6 +1082,14 @@ void engine_release_font(engine_ptr e, font_instance_ptr fi)
  */
 void engine_tick(engine_ptr e, double dt)
 {
+    if (e->config.trace_dump)
+    {
+        trace_dump(e->config.trace_path, e->config.trace_seconds);
+        e->config.trace_dump = false;
+    }
+
+    TRACE_ZONE("engine_tick");
+    renderer_set_cpu_animation(e->renderer, e->config.cpu_model_animation);
     time_t t = time(NULL);
     if (t != e->fps_time)
     {
@@ -461,32 +1100,53 @@ void engine_tick(engine_ptr e, double dt)
     else
         e->fps_count++;
 
-    // Place a limit of 10ms each tick for tasks
-    // Leaves ~20ms for tick/render if we want to
-    // keep to 30fps
-    clock_t start = clock();
-    engine_process_tasks(e, 0.01);
-    clock_t after_tasks = clock();
-
-    if (dt > 0.5)
-    {
-        printf("Long tick (%f). Ignoring\n", dt);
-        return;
-    }
+    // Place a limit on the time spent on tasks each tick.
+    // The default 10ms leaves ~20ms for tick/render
+    // if we want to keep to 30fps
+    double start = timer_now();
+    engine_process_tasks(e, e->config.task_budget);
+    double after_tasks = timer_now();
 
+    // Long ticks are clamped by the scene simulation step limit
     frame_tick(e->current_frame, dt, e, e->renderer);
-    clock_t after_tick = clock();
+    double after_tick = timer_now();
 
-    e->task_time = (after_tasks - start)*1.0f/CLOCKS_PER_SEC;
-    e->tick_time = (after_tick - after_tasks)*1.0f/CLOCKS_PER_SEC;
+    e->task_time = after_tasks - start;
+    e->tick_time = after_tick - after_tasks;
+}
+
+struct engine_transition_info
+{
+    engine_ptr e;
+    char *path;
+    char *transition_type;
+};
+
+static void engine_transition_task(void *_ti)
+{
+    struct engine_transition_info *ti = _ti;
+    frame_load_scene(ti->e->current_frame, ti->path, ti->transition_type, ti->e, ti->e->renderer);
+
+    free(ti->path);
+    free(ti->transition_type);
+    free(ti);
 }
 
 /*
  * Start a transition to a new scene
+ * The transition begins on the main thread
+ * before the start of the next tick
+ *
+ * Call Context: Any thread
  */
 void engine_transition_to_scene(engine_ptr e, const char *path, const char *transition_type)
 {
-    frame_load_scene(e->current_frame, path, transition_type, e, e->renderer);
+    struct engine_transition_info *ti = calloc(1, sizeof(struct engine_transition_info));
+    assert(ti);
+    ti->e = e;
+    ti->path = strdup(path);
+    ti->transition_type = strdup(transition_type);
+    engine_queue_task(e, TASK_PRIORITY_CHEAP, engine_transition_task, ti);
 }
 
 /*
@@ -543,3 +1203,31 @@ engine_config_ptr engine_get_config_ref(engine_ptr e)
 {
     return &e->config;
 }
+
+vfs_ptr engine_get_vfs(engine_ptr e)
+{
+    return e->vfs;
+}
+
+uint32_t engine_worker_count(engine_ptr e)
+{
+    return worker_pool_thread_count(e->workers);
+}
+
+/*
+ * Time spent (in seconds) on the scene tick and on
+ * main thread tasks during the most recent engine_tick
+ */
+void engine_get_frame_times(engine_ptr e, GLfloat *tick_time, GLfloat *task_time)
+{
+    *tick_time = e->tick_time;
+    *task_time = e->task_time;
+}
+
+/*
+ * Returns true while a scene transition (or load) is in progress
+ */
+bool engine_in_transition(engine_ptr e)
+{
+    return frame_in_transition(e->current_frame);
+}
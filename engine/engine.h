@@ -37,6 +37,46 @@ struct engine_config
     GLfloat min_aspect;
     GLfloat max_aspect;
 
+    // Time allotted to main thread tasks each tick (in seconds)
+    GLfloat task_budget;
+
+    // Memory (in bytes) that unreferenced textures may occupy
+    // so that they can be reused without reloading
+    size_t texture_cache_budget;
+
+    // Memory (in bytes) that neighbouring scenes loaded in
+    // the background may occupy. Zero disables prefetching
+    size_t prefetch_budget;
+
+    // Number of recently visited scenes (and the memory in bytes
+    // that they may occupy) that are kept to be resumed later
+    uint8_t suspended_scene_limit;
+    size_t suspended_scene_budget;
+
+    // Length of a scene simulation step (in seconds), and the
+    // maximum number of steps to run in a single tick.
+    // Rendering interpolates between the last two steps
+    GLfloat sim_timestep;
+    uint8_t sim_max_substeps;
+
+    // Run scene simulation (scripts, physics, triggers)
+    // on a separate thread to rendering
+    bool threaded_simulation;
+
+    // Blend model keyframes on the CPU (split across the worker
+    // pool) instead of in the vertex shader
+    bool cpu_model_animation;
+
+    // Set to write the last trace_seconds of trace zones
+    // to trace_path (as Chrome trace JSON) on the next tick
+    bool trace_dump;
+    GLfloat trace_seconds;
+    char *trace_path;
+
+    // Directory for caching compiled scene scripts,
+    // or NULL to always compile from source
+    char *script_cache_path;
+
     // Flags for enabling debug rendering modes
     bool debug_render_layer_mesh;
     bool debug_render_walkmesh;
@@ -44,7 +84,7 @@ struct engine_config
     bool debug_text_triangles;
 };
 
-engine_ptr engine_create(const char *resource_path, GLuint window_width, GLuint window_height);
+engine_ptr engine_create(const char *resource_path, const char *start_scene, GLuint window_width, GLuint window_height);
 void engine_destroy(engine_ptr e);
 void engine_draw(engine_ptr e);
 void engine_set_viewport(engine_ptr e, GLuint width, GLuint height);
@@ -59,13 +99,36 @@ void engine_tick(engine_ptr e, double dt);
 input_flags engine_discrete_inputs(engine_ptr e);
 GPpolar engine_analog_inputs(engine_ptr e, analog_input_type type);
 engine_config_ptr engine_get_config_ref(engine_ptr e);
+vfs_ptr engine_get_vfs(engine_ptr e);
+uint32_t engine_worker_count(engine_ptr e);
+void engine_get_frame_times(engine_ptr e, GLfloat *tick_time, GLfloat *task_time);
+bool engine_in_transition(engine_ptr e);
 void engine_transition_to_scene(engine_ptr e, const char *path, const char *transition_type);
-void engine_queue_task(engine_ptr e, void (*func)(void *), void *data);
+void engine_queue_named_task(engine_ptr e, task_priority p, void (*func)(void *), void *data, size_t size, const char *name);
 void engine_synchronize_tasks(engine_ptr e);
 
+// Tasks are named after their source file and function in traces.
+// Tasks that process a variable amount of data should pass its size
+#define engine_queue_task(e, p, func, data) \
+    engine_queue_named_task((e), (p), (func), (data), 0, __FILE__ ":" #func)
+#define engine_queue_sized_task(e, p, func, data, size) \
+    engine_queue_named_task((e), (p), (func), (data), (size), __FILE__ ":" #func)
+void engine_queue_job(engine_ptr e, job_batch_ptr b, void (*func)(void *), void *data);
+void engine_wait_jobs(engine_ptr e, job_batch_ptr b);
+
+bool engine_start_upload_thread(engine_ptr e, bool (*set_context)(void *context, bool current), void *context);
+bool engine_has_upload_thread(engine_ptr e);
+void engine_queue_named_upload(engine_ptr e, void (*upload)(void *), void (*complete)(void *), void *data, const char *name);
+
+#define engine_queue_upload(e, upload, complete, data) \
+    engine_queue_named_upload((e), (upload), (complete), (data), __FILE__ ":" #upload)
+
 texture_instance_ptr engine_retain_texture(engine_ptr e, const char *path);
 void engine_release_texture(engine_ptr e, texture_instance_ptr t);
 
+model_ptr engine_retain_model(engine_ptr e, const char *path);
+void engine_release_model(engine_ptr e, model_ptr m);
+
 void engine_load_font(engine_ptr e, const char *id, const char *file, GLuint size);
 font_instance_ptr engine_retain_font(engine_ptr e, const char *id);
 void engine_release_font(engine_ptr e, font_instance_ptr fi);
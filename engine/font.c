@@ -24,6 +24,7 @@
 #include "font.h"
 #include "engine.h"
 #include "renderer.h"
+#include "pending_init.h"
 
 struct font_glyph
 {
@@ -37,6 +38,12 @@ struct font
 {
     GLuint glid;
     bool initialized;
+
+    // Destruction is deferred until the init task has run
+    struct pending_init pending;
+
+    // Set if the texture is uploaded by the engine's upload thread
+    bool upload_async;
     struct font_glyph glyphs[96];
     GLfloat line_height;
     GLfloat scale;
@@ -47,21 +54,14 @@ struct font
 };
 
 /*
- * Initialize the font gl state
+ * Create the font texture
  *
- * Call Context: Main thread (via engine_process_tasks)
+ * Call Context: Main thread or upload thread
  */
-static void init_gl(void *_f)
+static void upload_gl(void *_f)
 {
     font_ptr f = _f;
 
-    if (f->initialized)
-    {
-        // May be called by draw before engine runs the task
-        printf("Attempting to initialize already initialized font.\n");
-        return;
-    }
-
     // Generate texture
     glGenTextures(1, &f->glid);
     glActiveTexture(GL_TEXTURE0); checkGLError();
@@ -71,7 +71,25 @@ static void init_gl(void *_f)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE); checkGLError();
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR); checkGLError();
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR); checkGLError();
+}
+
+/*
+ * Initialize the font gl state
+ *
+ * Call Context: Main thread (via engine_process_tasks)
+ */
+static void init_gl(void *_f)
+{
+    font_ptr f = _f;
+
+    if (f->initialized)
+    {
+        // May be called by draw before engine runs the task
+        printf("Attempting to initialize already initialized font.\n");
+        return;
+    }
 
+    upload_gl(f);
     f->initialized = true;
 }
 
@@ -83,12 +101,44 @@ static void init_gl(void *_f)
 static void uninit_gl(void *_f)
 {
     font_ptr f = _f;
+
+    // Destruction was requested before the font was initialized
+    if (pending_init_defer_destroy(&f->pending))
+        return;
+
     assert(f->initialized);
 
     glDeleteTextures(1, &f->glid);
     free(f);
 }
 
+/*
+ * Run the queued initialization
+ *
+ * Call Context: Main thread (via engine_process_tasks)
+ */
+static void init_task(void *_f)
+{
+    font_ptr f = _f;
+
+    // May have been initialized by draw before the task was run
+    pending_init_run(&f->pending, f->initialized, init_gl, uninit_gl, f);
+}
+
+/*
+ * Mark the font as ready once the upload thread has created its texture
+ *
+ * Call Context: Main thread (via engine_process_tasks)
+ */
+static void upload_complete(void *_f)
+{
+    font_ptr f = _f;
+    f->initialized = true;
+
+    if (pending_init_task_done(&f->pending))
+        uninit_gl(f);
+}
+
 struct font_glyph *glyph_ptr(font_ptr f, uint32_t c)
 {
     // Return <space> for unknown glyphs
@@ -184,7 +234,12 @@ font_ptr font_create(const char *path, GLuint font_size, GLuint texture_size, GL
 
     f->line_height = face->size->metrics.height / 64.0f / f->size;
 
-    engine_queue_task(e, init_gl, f);
+    pending_init_begin(&f->pending, 1);
+    f->upload_async = engine_has_upload_thread(e);
+    if (f->upload_async)
+        engine_queue_upload(e, upload_gl, upload_complete, f);
+    else
+        engine_queue_sized_task(e, TASK_PRIORITY_UPLOAD, init_task, f, (size_t)f->size*f->size);
     return f;
 }
 
@@ -193,13 +248,21 @@ font_ptr font_create(const char *path, GLuint font_size, GLuint texture_size, GL
  */
 void font_destroy(font_ptr f, engine_ptr e)
 {
-    engine_queue_task(e, uninit_gl, f);
+    engine_queue_task(e, TASK_PRIORITY_CHEAP, uninit_gl, f);
 }
 
 void font_bind_texture(font_instance_ptr f)
 {
     if (!f->initialized)
     {
+        // The upload thread owns the texture until it completes
+        if (f->upload_async)
+        {
+            printf("WARNING: Attempting to access font before it has loaded.\n");
+            glBindTexture(GL_TEXTURE_2D, 0); checkGLError();
+            return;
+        }
+
         printf("WARNING: Attempting to access uninitialized font. Initializing on hot path.\n");
         init_gl((void *)f);
     }
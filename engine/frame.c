@@ -19,8 +19,6 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
-#include <pthread.h>
 #include "engine.h"
 #include "frame.h"
 #include "renderer.h"
@@ -28,11 +26,14 @@
 #include "texture.h"
 #include "framebuffer.h"
 #include "scene.h"
+#include "scene_cache.h"
 #include "transition_instance.h"
 #include "vertexarray.h"
 #include "font.h"
 #include "widget.h"
 #include "widget_string.h"
+#include "timer.h"
+#include "trace.h"
 
 /*
  * Private implementation details
@@ -59,7 +60,22 @@ struct frame
     scene_ptr next_scene;
     textureref next_textureref;
 
+    // Set while the next scene has deferred assets that have not yet been drawn
+    bool next_streaming;
+
     transition_instance_ptr transition;
+
+    // Load of the scene being transitioned to, until it completes
+    struct frame_load *load;
+
+    // Load requested after the next scene was shown,
+    // which is started when the transition completes
+    char *pending_path;
+    char *pending_transition;
+
+    // Neighbours of the current scene, loaded in the background,
+    // and recently visited scenes that can be resumed
+    scene_cache_ptr prefetch;
 };
 
 /*
@@ -77,6 +93,12 @@ frame_ptr frame_create(const char *start_scene, GLuint width, GLuint height, eng
     f->height = height;
 
     f->mv = modelview_create();
+    f->prefetch = scene_cache_create(width, height);
+
+    // Debug info display (Frame times, FPS, etc)
+    // Rasterized on a worker while the loadscreen is decoded
+    engine_load_font(e, "debug", "Inconsolata.otf", 18);
+
     f->loadscreen = texture_create("loadscreen.png", e);
     assert(f->loadscreen);
 
@@ -90,9 +112,6 @@ frame_ptr frame_create(const char *start_scene, GLuint width, GLuint height, eng
 
     f->widget_root = widget_create_root();
 
-    // Debug info display (Frame times, FPS, etc)
-    engine_load_font(e, "debug", "Inconsolata.otf", 18);
-
     widget_string_ptr debug_controls = widget_string_create("debug", e);
     widget_add(f->widget_root, "debug_controls", (GLfloat[]){-1.28, -0.8}, WIDGET_STRING, debug_controls);
     widget_string_set_text(debug_controls,
@@ -100,7 +119,8 @@ frame_ptr frame_create(const char *start_scene, GLuint width, GLuint height, eng
                            "\\c[#FFCC00FF]w,a,s,d\\c[#FFFFFFFF]: Move player        \n"
                            "\\c[#FFCC00FF]    j,l\\c[#FFFFFFFF]: Rotate debug camera\n"
                            "\\c[#FFCC00FF]    i,k\\c[#FFFFFFFF]: Zoom debug camera  \n"
-                           "\\c[#FFCC00FF]      u\\c[#FFFFFFFF]: Reset debug camera \n",
+                           "\\c[#FFCC00FF]      u\\c[#FFFFFFFF]: Reset debug camera \n"
+                           "\\c[#FFCC00FF]      t\\c[#FFFFFFFF]: Dump trace to file \n",
                            GL_STATIC_DRAW);
 
     f->debug_metrics = widget_string_create("debug", e);
@@ -156,6 +176,11 @@ void frame_destroy(frame_ptr f, engine_ptr e)
     if (f->next_scene)
         scene_destroy(f->next_scene, e);
 
+    scene_cache_destroy(f->prefetch, e);
+
+    free(f->pending_path);
+    free(f->pending_transition);
+
     widget_destroy(f->widget_root, e);
 
     font_destroy(f->debug_font, e);
@@ -166,17 +191,31 @@ void frame_destroy(frame_ptr f, engine_ptr e)
 static void frame_transition_complete(frame_ptr f, engine_ptr e, renderer_ptr r)
 {
     // current_scene will be null if this is the first scene to load
+    // Otherwise it is kept so that it can be resumed if we return
     if (f->current_scene)
-        scene_destroy(f->current_scene, e);
+        scene_cache_suspend(f->prefetch, f->current_scene, e);
 
     f->current_scene = f->next_scene;
     f->next_scene = NULL;
+    f->next_streaming = false;
 
     transition_instance_destroy(f->transition, e);
     f->transition = NULL;
 
-    engine_config_ptr ec = engine_get_config_ref(e);
-    f->current_textureref = scene_draw(f->current_scene, ec, r);
+    f->current_textureref = scene_draw(f->current_scene, e, r);
+
+    if (f->pending_path)
+    {
+        char *path = f->pending_path;
+        char *transition_type = f->pending_transition;
+        f->pending_path = f->pending_transition = NULL;
+
+        frame_load_scene(f, path, transition_type, e, r);
+        free(path);
+        free(transition_type);
+    }
+    else
+        scene_start_simulation(f->current_scene, e);
 }
 
 /*
@@ -190,14 +229,30 @@ void frame_tick(frame_ptr f, double dt, engine_ptr e, renderer_ptr r)
 {
     if (f->transition)
     {
-        if (f->transition->type->tick(f->transition, dt, e, r))
+        bool complete;
+        {
+            TRACE_ZONE("transition_tick");
+            complete = f->transition->type->tick(f->transition, dt, e, r);
+        }
+
+        if (complete)
             frame_transition_complete(f, e, r);
+        else if (f->next_streaming)
+        {
+            // Show deferred assets as they stream in
+            f->next_streaming = !scene_is_loaded(f->next_scene);
+            f->next_textureref = scene_draw(f->next_scene, e, r);
+        }
     }
     else
     {
         scene_tick(f->current_scene, e, dt);
-        engine_config_ptr ec = engine_get_config_ref(e);
-        f->current_textureref = scene_draw(f->current_scene, ec, r);
+        f->current_textureref = scene_draw(f->current_scene, e, r);
+
+        // Priorities follow the player's distance to each exit
+        size_t neighbour_count;
+        const struct scene_neighbour *neighbours = scene_neighbours(f->current_scene, &neighbour_count);
+        scene_cache_update(f->prefetch, neighbours, neighbour_count, e);
     }
 }
 
@@ -214,6 +269,7 @@ void frame_draw(frame_ptr f, GLuint fps, GLfloat tick_time, GLfloat task_time, e
 
     if (f->transition)
     {
+        TRACE_ZONE("transition_draw");
         f->transition->type->draw(f->transition, f->mv, r);
         glActiveTexture(GL_TEXTURE0);
     }
@@ -248,66 +304,156 @@ void frame_set_projection(frame_ptr f, GLfloat p[16])
     modelview_set_projection(f->mv, p);
 }
 
-struct worker_args
+bool frame_in_transition(frame_ptr f)
+{
+    return f->transition != NULL;
+}
+
+struct frame_load
 {
     char *path;
+    volatile bool cancelled;
+
+    // Set by the load job. NULL if the load was cancelled
+    scene_ptr scene;
+
     engine_ptr e;
     frame_ptr f;
     renderer_ptr r;
 };
 
-void frame_rendernext_task(void *_wa)
+/*
+ * Show a loaded scene, or discard it if the load was superseded
+ *
+ * Call Context: Main thread
+ */
+static void frame_load_complete_task(void *_l)
 {
-    struct worker_args *wa = (struct worker_args *)_wa;
-    engine_config_ptr ec = engine_get_config_ref(wa->e);
+    struct frame_load *l = _l;
+    frame_ptr f = l->f;
 
-    // Check that the transition hasn't already completed
-    if (wa->f->transition && wa->f->next_scene)
-        wa->f->next_textureref = scene_draw(wa->f->next_scene, ec, wa->r);
+    if (f->load == l)
+    {
+        // The load may have taken a scene that was suspended in the
+        // scene cache, and resume() only runs on the main thread
+        scene_resume(l->scene, l->e);
+
+        f->load = NULL;
+        f->next_scene = l->scene;
+        f->next_streaming = !scene_is_loaded(l->scene);
+        f->next_textureref = scene_draw(l->scene, l->e, l->r);
+        f->transition->loaded = true;
+    }
+    else if (l->scene)
+        scene_release(l->scene, l->e);
 
-    free(wa->path);
-    free(wa);
+    free(l->path);
+    free(l);
 }
 
 /*
- * Load and render a new scene
+ * Load a new scene
  *
  * Call Context: Worker thread
  * TODO: Handle errors in worker threads
  */
-void *frame_scene_load_worker(void *arg)
+static void frame_scene_load_job(void *_l)
 {
-    clock_t start = clock();
-    struct worker_args *wa = (struct worker_args *)arg;
-    wa->f->next_scene = scene_create(wa->path, wa->f->width, wa->f->height, wa->e);
-    wa->f->transition->loaded = true;
-    printf("Loaded `%s' in %.1f ms\n", wa->path, (clock() - start)*1000.0f/CLOCKS_PER_SEC);
-
-    // Update the textureref for the next frame after tick
-    engine_queue_task(wa->e, frame_rendernext_task, wa);
+    double start = timer_now();
+    struct frame_load *l = _l;
+
+    // Finish a prefetch that is already in progress instead of starting again
+    scene_ptr s = NULL;
+    if (!l->cancelled)
+        s = scene_cache_take(l->f->prefetch, l->path, true, l->e);
+    if (!s)
+        s = scene_create(l->path, l->f->width, l->f->height, &l->cancelled, l->e);
+
+    if (s && !l->cancelled)
+        printf("Loaded `%s' in %.1f ms (%.2f ms saved by script cache)\n", l->path,
+               (timer_now() - start)*1000, scene_script_saved_time(s)*1000);
+
+    // The frame is only modified on the main thread
+    l->scene = s;
+    engine_queue_task(l->e, TASK_PRIORITY_CHEAP, frame_load_complete_task, l);
+}
 
-    pthread_exit(NULL);
+/*
+ * Start loading a scene for the current transition
+ *
+ * Call Context: Main thread
+ */
+static void frame_start_load(frame_ptr f, const char *path, engine_ptr e, renderer_ptr r)
+{
+    struct frame_load *l = calloc(1, sizeof(struct frame_load));
+    assert(l);
+    l->path = strdup(path);
+    l->e = e;
+    l->f = f;
+    l->r = r;
+
+    f->load = l;
+    engine_queue_job(e, NULL, frame_scene_load_job, l);
 }
 
 /*
- * Load a new scene with the requested path and transition type
+ * Load a new scene with the requested path and transition type.
+ *
+ * Requests made during a transition supersede any earlier request:
+ * a load that is still in progress is cancelled and replaced, keeping
+ * the current transition. If the next scene has already been shown,
+ * the request is deferred until the transition completes.
  *
  * Call Context: Main thread
  */
 void frame_load_scene(frame_ptr f, const char *path, const char *transition_type, engine_ptr e, renderer_ptr r)
 {
+    if (f->transition)
+    {
+        // Scripts may request a load more than once (e.g. from a trigger
+        // that fires on several simulation steps within the same tick)
+        const char *target = f->pending_path ? f->pending_path :
+            f->load ? f->load->path : scene_name(f->next_scene);
+        if (!strcmp(target, path))
+            return;
+
+        if (f->load)
+        {
+            printf("Superseding load of `%s' with `%s'\n", f->load->path, path);
+            f->load->cancelled = true;
+            frame_start_load(f, path, e, r);
+        }
+        else
+        {
+            free(f->pending_path);
+            free(f->pending_transition);
+            f->pending_path = strdup(path);
+            f->pending_transition = strdup(transition_type);
+        }
+
+        return;
+    }
+
+    // The outgoing scene is frozen for the transition
+    if (f->current_scene)
+        scene_stop_simulation(f->current_scene);
+
+    // Prefetched and suspended scenes can be shown immediately
+    scene_ptr prefetched = scene_cache_take(f->prefetch, path, false, e);
+    if (prefetched)
+    {
+        printf("Loaded `%s' from the scene cache\n", path);
+        scene_resume(prefetched, e);
+        f->next_scene = prefetched;
+        f->next_textureref = scene_draw(prefetched, e, r);
+        f->transition = transition_instance_create(transition_type, f->quad, &f->current_textureref, &f->next_textureref, r);
+        f->transition->loaded = true;
+        return;
+    }
+
     // TODO: Dirty hack to show a loadscreen until the scene has loaded
     f->next_textureref = texture_get_textureref(f->loadscreen, f->current_textureref.width, f->current_textureref.height);
 
-    static pthread_t scene_load_worker;
-    struct worker_args *wa = calloc(1, sizeof(struct worker_args));
-    assert(wa);
-    wa->path = strdup(path);
-    wa->e = e;
-    wa->f = f;
-    wa->r = r;
-    pthread_create(&scene_load_worker, NULL, frame_scene_load_worker, (void *)wa);
-
-    assert(f->transition == NULL);
+    frame_start_load(f, path, e, r);
     f->transition = transition_instance_create(transition_type, f->quad, &f->current_textureref, &f->next_textureref, r);
 }
@@ -28,5 +28,6 @@ void frame_draw(frame_ptr f, GLuint fps, GLfloat tick_time, GLfloat task_time, e
 void frame_set_projection(frame_ptr f, GLfloat p[16]);
 void frame_load_scene(frame_ptr f, const char *path, const char *transition_type, engine_ptr e, renderer_ptr r);
 void frame_update_overlay_display(frame_ptr f, engine_config_ptr ec);
+bool frame_in_transition(frame_ptr f);
 
 #endif
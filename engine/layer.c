@@ -26,6 +26,8 @@
 #include <string.h>
 
 #include "engine.h"
+#include "worker_pool.h"
+#include "trace.h"
 #include "renderer.h"
 #include "matrix.h"
 #include "texture.h"
@@ -41,15 +43,24 @@ struct layer
 {
     GLfloat y;
 
+    // The texture is retained on the worker pool, and
+    // is only valid once this batch has completed
+    char *image;
+    job_batch_ptr load;
+    volatile bool loaded;
     texture_instance_ptr texture;
     vertexarray_ptr va;
 
     GLsizei frame_count;
     GLfloat *frame_regions;
-    GLsizei frame;
-    bool texcoords_dirty;
 
+    // Simulation state
+    GLsizei frame;
     bool visible;
+
+    // Frame that the vertex array texcoords were last set for
+    // (only accessed by the main thread)
+    GLsizei drawn_frame;
 };
 
 /*
@@ -91,10 +102,34 @@ static void calculateViewFulstrum(GLfloat screen_region[4], struct camera_state
         mtxMultiplyVec3(&view[3*i], transform, &fulstrum[3*i]);
 }
 
+struct layer_load_job
+{
+    layer_ptr l;
+    engine_ptr e;
+};
+
+/*
+ * Retain the layer texture, which opens the image and starts its decode
+ *
+ * Call Context: Worker thread
+ */
+static void layer_load_job(void *_j)
+{
+    TRACE_ZONE("layer_load");
+    struct layer_load_job *j = _j;
+    j->l->texture = engine_retain_texture(j->e, j->l->image);
+
+    __sync_synchronize();
+    j->l->loaded = true;
+    free(j);
+}
+
 /*
  * Create a layer
  * Layers are positioned with a given screen x,y,width,height
  * with a z-coordinate calculated from the given world y.
+ * The texture is loaded on the worker pool: use
+ * layer_wait_loaded to wait for it to complete
  *
  * Call Context: Worker thread
  */
@@ -108,6 +143,7 @@ layer_ptr layer_create(const char *image, GLfloat *screen_region, GLfloat depth,
 
     l->visible = true;
     l->y = depth;
+    l->drawn_frame = -1;
 
     // Calculate texture coords for each frame
     l->frame_count = frame_count;
@@ -179,7 +215,15 @@ layer_ptr layer_create(const char *image, GLfloat *screen_region, GLfloat depth,
     free(vertices);
 
     layer_set_frame(l, 0);
-    l->texture = engine_retain_texture(e, image);
+
+    struct layer_load_job *j = calloc(1, sizeof(struct layer_load_job));
+    assert(j);
+    j->l = l;
+    j->e = e;
+
+    l->image = strdup(image);
+    l->load = job_batch_create();
+    engine_queue_job(e, l->load, layer_load_job, j);
 
     return l;
 }
@@ -189,25 +233,57 @@ layer_ptr layer_create(const char *image, GLfloat *screen_region, GLfloat depth,
  */
 void layer_destroy(layer_ptr l, engine_ptr e)
 {
+    engine_wait_jobs(e, l->load);
+    job_batch_destroy(l->load);
+
     vertexarray_destroy(l->va, e);
     engine_release_texture(e, l->texture);
+    free(l->image);
     free(l);
 }
 
 /*
- * Render layer into the current gl context
+ * Wait for the layer texture to be retained and decoded
+ *
+ * Call Context: Worker thread
+ */
+void layer_wait_loaded(layer_ptr l, engine_ptr e)
+{
+    engine_wait_jobs(e, l->load);
+    texture_wait_decoded(l->texture, e);
+}
+
+/*
+ * Check whether the layer texture has loaded and can be drawn
  *
  * Call Context: Main thread
  */
-void layer_draw(layer_ptr l, modelview_ptr mv, renderer_ptr r)
+bool layer_is_ready(layer_ptr l)
+{
+    return l->loaded && texture_is_ready(l->texture);
+}
+
+/*
+ * Approximate GPU memory used by the layer texture
+ * The texture must have finished decoding
+ */
+size_t layer_memory_size(layer_ptr l)
 {
-    if (!l->visible)
-        return;
+    return texture_memory_size(l->texture);
+}
 
-    if (l->texcoords_dirty)
+/*
+ * Render a frame of the layer into the current gl context
+ * Visibility is checked by the caller
+ *
+ * Call Context: Main thread
+ */
+void layer_draw(layer_ptr l, GLsizei frame, modelview_ptr mv, renderer_ptr r)
+{
+    if (frame != l->drawn_frame)
     {
-        vertexarray_update(l->va, NULL, &l->frame_regions[16*l->frame], 4, GL_DYNAMIC_DRAW);
-        l->texcoords_dirty = false;
+        vertexarray_update(l->va, NULL, &l->frame_regions[16*frame], 4, GL_DYNAMIC_DRAW);
+        l->drawn_frame = frame;
     }
 
     GLfloat mvp[16];
@@ -220,9 +296,6 @@ void layer_draw(layer_ptr l, modelview_ptr mv, renderer_ptr r)
 
 void layer_debug_draw(layer_ptr l, modelview_ptr mv, renderer_ptr r)
 {
-    if (!l->visible)
-        return;
-
     GLfloat mvp[16];
     modelview_calculate_mvp(mv, mvp);
 
@@ -268,5 +341,4 @@ void layer_set_frame(layer_ptr l, GLsizei i)
 {
     assert(i < l->frame_count);
     l->frame = i;
-    l->texcoords_dirty = true;
 }
@@ -26,7 +26,10 @@ layer_ptr layer_create(const char *image, GLfloat *screen_region, GLfloat depth,
                        GLfloat *frame_regions, GLsizei frame_count, GLfloat *normal,
                        struct camera_state *camera, engine_ptr e);
 void layer_destroy(layer_ptr l, engine_ptr e);
-void layer_draw(layer_ptr l, modelview_ptr mv, renderer_ptr r);
+void layer_wait_loaded(layer_ptr l, engine_ptr e);
+bool layer_is_ready(layer_ptr l);
+size_t layer_memory_size(layer_ptr l);
+void layer_draw(layer_ptr l, GLsizei frame, modelview_ptr mv, renderer_ptr r);
 void layer_debug_draw(layer_ptr l, modelview_ptr mv, renderer_ptr r);
 GLfloat layer_render_order(layer_ptr l);
 
@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <stdlib.h>
 #include <lualib.h>
 #include <lauxlib.h>
 #include <setjmp.h>
@@ -29,6 +30,10 @@
 #include "luabridge_actor.h"
 #include "luabridge_layer.h"
 #include "luabridge_vector.h"
+#include "engine.h"
+#include "vfs.h"
+#include "timer.h"
+#include "trace.h"
 
 // Use pointers to unique strings as registry keys
 static char *registry_engine_key = "gp_engine_key";
@@ -99,6 +104,132 @@ size_t luabridge_count_table_elements(lua_State *L, int idx)
     return i;
 }
 
+#pragma mark Bytecode cache
+/*
+ * Compiled scripts are cached in engine_config.script_cache_path as
+ * <hash>.luac, where the hash covers the script path and source.
+ * Changing the script gives a new hash, so stale entries are never loaded.
+ * The bytecode is preceded by this header, which records how long the
+ * source took to compile so that loads can report the time saved
+ */
+#define SCRIPT_CACHE_MAGIC 0x4C435047 // "GPCL"
+#define SCRIPT_CACHE_VERSION 1
+
+struct script_cache_header
+{
+    uint32_t magic;
+    uint32_t version;
+    double compile_seconds;
+};
+
+struct script_cache_buffer
+{
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+};
+
+/*
+ * 64 bit FNV-1a hash
+ */
+static uint64_t fnv1a_hash(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+/*
+ * lua_Writer that appends the dumped bytecode to a script_cache_buffer
+ */
+static int script_cache_writer(lua_State *L, const void *p, size_t size, void *_b)
+{
+    struct script_cache_buffer *b = _b;
+    if (b->size + size > b->capacity)
+    {
+        b->capacity = 2*(b->size + size);
+        b->data = realloc(b->data, b->capacity);
+        assert(b->data);
+    }
+
+    memcpy(b->data + b->size, p, size);
+    b->size += size;
+    return 0;
+}
+
+/*
+ * Load the cached bytecode for a script onto the stack
+ * Returns false if the script is not in the cache, otherwise
+ * sets saved_seconds to the source compile time that was saved
+ */
+static bool script_cache_load(lua_State *L, const char *cache_path, const char *chunk_name, double *saved_seconds)
+{
+    FILE *file = fopen(cache_path, "rb");
+    if (!file)
+        return false;
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    bool loaded = false;
+    struct script_cache_header *h = malloc(size > 0 ? size : 1);
+    assert(h);
+
+    if (size > (long)sizeof(struct script_cache_header) && fread(h, 1, size, file) == (size_t)size &&
+        h->magic == SCRIPT_CACHE_MAGIC && h->version == SCRIPT_CACHE_VERSION)
+    {
+        // Only accept bytecode so that a damaged entry can't be run as source
+        double start = timer_now();
+        loaded = !luaL_loadbufferx(L, (const char *)(h + 1), size - sizeof(struct script_cache_header), chunk_name, "b");
+        if (loaded)
+            *saved_seconds = h->compile_seconds - (timer_now() - start);
+        else
+            lua_pop(L, 1);
+    }
+
+    fclose(file);
+    free(h);
+    return loaded;
+}
+
+/*
+ * Write the bytecode for the function on the top of the stack to the cache
+ * The file is written under a temporary name and renamed into place so that
+ * concurrent loads of the same script never see a partial entry
+ */
+static void script_cache_store(lua_State *L, const char *cache_path, double compile_seconds)
+{
+    struct script_cache_buffer b = {NULL, 0, 0};
+    struct script_cache_header h = {SCRIPT_CACHE_MAGIC, SCRIPT_CACHE_VERSION, compile_seconds};
+    script_cache_writer(L, &h, sizeof(struct script_cache_header), &b);
+    if (lua_dump(L, script_cache_writer, &b))
+    {
+        free(b.data);
+        return;
+    }
+
+    char *temp_path = calloc(strlen(cache_path) + 32, sizeof(char));
+    assert(temp_path);
+    sprintf(temp_path, "%s.%p.tmp", cache_path, (void *)L);
+
+    FILE *file = fopen(temp_path, "wb");
+    if (file)
+    {
+        bool written = fwrite(b.data, 1, b.size, file) == b.size;
+        if (fclose(file) || !written || rename(temp_path, cache_path))
+            remove(temp_path);
+    }
+
+    free(temp_path);
+    free(b.data);
+}
+
 #pragma mark C Interface
 
 void luabridge_set_globals(lua_State *L, scene_ptr s, walkmap_ptr w, engine_ptr e, bool in_setup)
@@ -157,11 +288,36 @@ void luabridge_run_setup(lua_State *L, scene_ptr s)
     }
 }
 
+/*
+ * Check whether the script defines a global function
+ */
+bool luabridge_has_function(lua_State *L, const char *name)
+{
+    lua_getglobal(L, name);
+    bool defined = lua_isfunction(L, -1);
+    lua_pop(L, 1);
+    return defined;
+}
+
+/*
+ * Call the lua 'resume()' function when returning to a suspended scene
+ */
+void luabridge_run_resume(lua_State *L, scene_ptr s)
+{
+    lua_getglobal(L, "resume");
+    if (lua_pcall(L, 0, 0, 0))
+    {
+        fprintf(stderr, "Scene resume failed.\n%s\n", lua_tostring(L, -1));
+        assert(FATAL_ERROR);
+    }
+}
+
 /*
  * Call the lua 'tick(sceneref)' function
  */
 void luabridge_run_tick(lua_State *L, scene_ptr s, engine_ptr e, double dt)
 {
+    TRACE_ZONE("luabridge_run_tick");
     lua_getglobal(L, "tick");
     lua_pushnumber(L, dt);
 
@@ -185,9 +341,13 @@ static int load_parse_error(lua_State *L)
 
 /*
  * Load a lua file into memory
+ * The compiled bytecode is cached (when a cache path is configured), and
+ * saved_seconds is set to the compile time that the cache saved, if any.
  * Dies if there is a syntax error
+ *
+ * Call Context: Worker thread
  */
-lua_State *luabridge_load(const char *path)
+lua_State *luabridge_load(const char *path, engine_ptr e, double *saved_seconds)
 {
     lua_State *L = luaL_newstate();
     luaL_openlibs(L);
@@ -198,7 +358,45 @@ lua_State *luabridge_load(const char *path)
     luabridge_register_layerref(L);
     luabridge_register_vectors(L);
 
-    if (luaL_dofile(L, path))
+    vfs_file_ptr f = vfs_open(engine_get_vfs(e), path);
+    if (!f)
+    {
+        fprintf(stderr, "Unable to open %s\n", path);
+        assert(FATAL_ERROR);
+    }
+
+    // Prefix the chunk name with @ so that errors report the path
+    char *chunk_name = calloc(strlen(path) + 2, sizeof(char));
+    assert(chunk_name);
+    sprintf(chunk_name, "@%s", path);
+
+    char *cache_path = NULL;
+    const char *cache_dir = engine_get_config_ref(e)->script_cache_path;
+    if (cache_dir)
+    {
+        uint64_t hash = fnv1a_hash(0xCBF29CE484222325ULL, path, strlen(path) + 1);
+        hash = fnv1a_hash(hash, vfs_file_data(f), vfs_file_size(f));
+
+        cache_path = calloc(strlen(cache_dir) + 23, sizeof(char));
+        assert(cache_path);
+        sprintf(cache_path, "%s/%016llx.luac", cache_dir, (unsigned long long)hash);
+    }
+
+    int status = 0;
+    *saved_seconds = 0;
+    if (!cache_path || !script_cache_load(L, cache_path, chunk_name, saved_seconds))
+    {
+        double start = timer_now();
+        status = luaL_loadbuffer(L, vfs_file_data(f), vfs_file_size(f), chunk_name);
+        if (!status && cache_path)
+            script_cache_store(L, cache_path, timer_now() - start);
+    }
+
+    vfs_close(f);
+    free(cache_path);
+    free(chunk_name);
+
+    if (status || lua_pcall(L, 0, LUA_MULTRET, 0))
     {
         fprintf(stderr, "Error parsing %s: %s\n", path, lua_tostring(L, -1));
         assert(FATAL_ERROR);
@@ -254,6 +452,30 @@ void luabridge_parse_scene_camera(lua_State *L, struct camera_state *camera)
     }
 }
 
+/*
+ * Add the scenes listed in the optional `neighbours' table
+ * to the scene's neighbours, for prefetching
+ */
+void luabridge_parse_scene_neighbours(lua_State *L, scene_ptr s)
+{
+    lua_getglobal(L, "neighbours");
+    if (lua_istable(L, -1))
+    {
+        size_t count = luabridge_count_table_elements(L, -1);
+        for (size_t i = 1; i <= count; i++)
+        {
+            lua_rawgeti(L, -1, i);
+            if (lua_isstring(L, -1))
+                scene_add_neighbour(s, lua_tostring(L, -1));
+            else
+                fprintf(stderr, "Ignoring invalid entry %zu in `neighbours'\n", i);
+            lua_pop(L, 1);
+        }
+    }
+
+    lua_pop(L, 1);
+}
+
 /*
  * Remove a reference in the lua registry created with luaL_ref
  */
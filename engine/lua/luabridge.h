@@ -35,9 +35,12 @@ void luabridge_clear_globals(lua_State *L);
 
 void luabridge_run_setup(lua_State *L, scene_ptr s);
 void luabridge_run_tick(lua_State *L, scene_ptr s, engine_ptr e, double dt);
+bool luabridge_has_function(lua_State *L, const char *name);
+void luabridge_run_resume(lua_State *L, scene_ptr s);
 
-lua_State *luabridge_load(const char *path);
+lua_State *luabridge_load(const char *path, engine_ptr e, double *saved_seconds);
 void luabridge_parse_scene_camera(lua_State *L, struct camera_state *camera);
+void luabridge_parse_scene_neighbours(lua_State *L, scene_ptr s);
 void luabridge_destroy_ref(lua_State *L, int ref);
 
 #endif
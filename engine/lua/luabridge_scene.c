@@ -157,15 +157,52 @@ static int add_trigger(lua_State *L)
     }
 
     luaL_checktype(L, 4, LUA_TFUNCTION);
+
+    // The callback's lines identify the scenes it loads, for prefetching
+    lua_Debug ar;
+    lua_pushvalue(L, 4);
+    lua_getinfo(L, ">S", &ar);
+    int callback_lines[2] = {ar.linedefined, ar.lastlinedefined};
+
     lua_pushvalue(L, 4);
     int callback = luaL_ref(L, LUA_REGISTRYINDEX);
 
     engine_ptr e = luabridge_registry_get_engine(L);
-    scene_add_trigger_region(sr->scene, pos, vertices, vertex_count, callback, e);
+    scene_add_trigger_region(sr->scene, pos, vertices, vertex_count, callback, callback_lines, e);
     free(vertices);
     return 0;
 }
 
+/*
+ *  (void) scene:setPlayer(actorref actor)
+ */
+static int set_player(lua_State *L)
+{
+    luabridge_assert_setup(L);
+
+    luabridge_sceneref *sr = luaL_checkudata(L, 1, LUABRIDGE_SCENE_TYPENAME);
+    luabridge_actorref *ar = luaL_checkudata(L, 2, LUABRIDGE_ACTOR_TYPENAME);
+    scene_set_player(sr->scene, ar->actor);
+    return 0;
+}
+
+/*
+ *  (void) scene:setLoadPriority(string priority)
+ *  Sets the priority of the actors and layers loaded next:
+ *  "critical" (the default) assets are loaded before the scene
+ *  is shown, and "deferred" assets appear once they have loaded
+ */
+static int set_load_priority(lua_State *L)
+{
+    luabridge_assert_setup(L);
+
+    static const char *priorities[] = {"critical", "deferred", NULL};
+    luabridge_sceneref *sr = luaL_checkudata(L, 1, LUABRIDGE_SCENE_TYPENAME);
+    int priority = luaL_checkoption(L, 2, NULL, priorities);
+    scene_set_load_deferred(sr->scene, priority == 1);
+    return 0;
+}
+
 /*
  *  (void) scene:addTimeout(function callback, number timeout)
  */
@@ -200,6 +237,8 @@ void luabridge_register_sceneref(lua_State *L)
         {"loadLayer", load_layer},
         {"addTrigger", add_trigger},
         {"addTimeout", add_timeout},
+        {"setPlayer", set_player},
+        {"setLoadPriority", set_load_priority},
         {"__tostring", description},
         {NULL, NULL}
     };
@@ -0,0 +1,92 @@
+/*
+ * This file is part of SceneFlipEngine.
+ * Copyright 2012, 2017 Paul Chote
+ *
+ * SceneFlipEngine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SceneFlipEngine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SceneFlipEngine.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Deferred destruction for objects whose GL state is created by
+ * queued main thread tasks. Destroy tasks are cheap, so may run
+ * before the init (upload) tasks. Destruction is then deferred
+ * until the last of them has run.
+ */
+
+#ifndef GPEngine_pending_init_h
+#define GPEngine_pending_init_h
+
+#include "typedefs.h"
+
+struct pending_init
+{
+    // Init tasks that have been queued but not yet run
+    uint8_t tasks;
+    bool destroy_pending;
+};
+
+/*
+ * Record the number of init tasks that will be queued for an object.
+ * Must be called before the first of them is queued
+ *
+ * Call Context: Any thread
+ */
+static inline void pending_init_begin(struct pending_init *p, uint8_t tasks)
+{
+    p->tasks = tasks;
+}
+
+/*
+ * Record that an init task has run.
+ * Returns true if the object was destroyed while its tasks were
+ * queued, in which case the caller must now finish destroying it
+ *
+ * Call Context: Main thread (via engine_process_tasks)
+ */
+static inline bool pending_init_task_done(struct pending_init *p)
+{
+    p->tasks--;
+    return p->destroy_pending && !p->tasks;
+}
+
+/*
+ * Check whether destruction must wait for queued init tasks,
+ * marking the object to be destroyed once they have run
+ *
+ * Call Context: Main thread (via engine_process_tasks)
+ */
+static inline bool pending_init_defer_destroy(struct pending_init *p)
+{
+    if (p->tasks)
+        p->destroy_pending = true;
+    return p->tasks > 0;
+}
+
+/*
+ * Run a queued init task. init is skipped if the object was
+ * already initialized by a draw before the task ran
+ *
+ * Call Context: Main thread (via engine_process_tasks)
+ */
+static inline void pending_init_run(struct pending_init *p, bool initialized,
+                                    void (*init)(void *), void (*uninit)(void *), void *object)
+{
+    if (!initialized)
+        init(object);
+
+    if (pending_init_task_done(p))
+        uninit(object);
+}
+
+#endif
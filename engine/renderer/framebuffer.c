@@ -22,6 +22,7 @@
 #include "engine.h"
 #include "renderer.h"
 #include "framebuffer.h"
+#include "pending_init.h"
 
 /*
  * Private implementation details
@@ -44,6 +45,9 @@ struct framebuffer
     GLint previous_fbo;
 
     bool initialized;
+
+    // Destruction is deferred until the init task has run
+    struct pending_init pending;
 };
 
 #define MAX(a,b) (((a)>(b))?(a):(b))
@@ -124,6 +128,11 @@ static void init_gl(void *_fb)
 static void uninit_gl(void *_fb)
 {
     framebuffer_ptr fb = _fb;
+
+    // Destruction was requested before the framebuffer was initialized
+    if (pending_init_defer_destroy(&fb->pending))
+        return;
+
     assert(fb->initialized);
 
     glDeleteTextures(1, &fb->texture);
@@ -132,6 +141,19 @@ static void uninit_gl(void *_fb)
     free(fb);
 }
 
+/*
+ * Run the queued initialization
+ *
+ * Call Context: Main thread (via engine_process_tasks)
+ */
+static void init_task(void *_fb)
+{
+    framebuffer_ptr fb = _fb;
+
+    // May have been initialized by draw before the task was run
+    pending_init_run(&fb->pending, fb->initialized, init_gl, uninit_gl, fb);
+}
+
 /*
  * Create a framebuffer object, with a square texture of the given size
  */
@@ -145,7 +167,8 @@ framebuffer_ptr framebuffer_create(GLuint width, GLuint height, engine_ptr e)
     fb->height = height;
     fb->size = framebuffer_size(width, height);
 
-    engine_queue_task(e, init_gl, fb);
+    pending_init_begin(&fb->pending, 1);
+    engine_queue_sized_task(e, TASK_PRIORITY_UPLOAD, init_task, fb, (size_t)fb->size*fb->size*4);
     return fb;
 }
 
@@ -154,7 +177,7 @@ framebuffer_ptr framebuffer_create(GLuint width, GLuint height, engine_ptr e)
  */
 void framebuffer_destroy(framebuffer_ptr fb, engine_ptr e)
 {
-    engine_queue_task(e, uninit_gl, fb);
+    engine_queue_task(e, TASK_PRIORITY_CHEAP, uninit_gl, fb);
 }
 
 /*
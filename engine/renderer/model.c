@@ -28,8 +28,20 @@
 #include "texture.h"
 #include "model.h"
 #include "vertexarray.h"
+#include "worker_pool.h"
+#include "trace.h"
+#include "vfs.h"
 
-#define LERP(x,y,t) ((x)+(t)*(y - x))
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Minimum number of vertex floats blended by each job in model_instances_blend
+#define MODEL_BLEND_JOB_FLOATS 32768
 
 /*
  * Private implementation details
@@ -42,127 +54,502 @@ struct model_header
     uint32_t texture_name_length;
 };
 
+/*
+ * Version 2 files extend the header with the offsets of each array.
+ * The arrays are 16 byte aligned, so they can be used in place
+ * from the (read-only) file data.
+ * The texture name is NUL terminated
+ */
+struct model_header_v2
+{
+    struct model_header base;
+    uint32_t vertex_offset;
+    uint32_t texcoord_offset;
+    uint32_t texture_name_offset;
+    uint32_t reserved;
+};
+
+/*
+ * Model data shared between every instance using the same file
+ * Managed by the engine (see engine_retain_model)
+ */
 struct model
 {
-    GLfloat *vertex_data;
-    GLfloat *texcoord_data;
+    char *path;
+
+    // The file is read on the worker pool. The fields
+    // below are only valid once this batch has completed
+    job_batch_ptr load;
+    volatile bool loaded;
+
+    const GLfloat *vertex_data;
+    const GLfloat *texcoord_data;
     GLsizei vertex_count;
     GLsizei frame_count;
 
-    GLfloat *current_vertex_data;
-    GLfloat current_animation_fraction;
+    // Version 2 files are kept open and used in place.
+    // vertex_data and texcoord_data are owned by the model otherwise
+    vfs_file_ptr file;
+
     texture_instance_ptr texture;
 
+    // Static GL buffers holding every keyframe and the texcoords
+    // Instances are interpolated between keyframes by the vertex shader
     vertexarray_ptr va;
-    bool gl_dirty;
 };
 
 /*
- * Load a model from a binary .mdl file
+ * Per-actor animation state
+ */
+struct model_instance
+{
+    model_ptr model;
+
+    GLfloat current_animation_fraction;
+
+    // Keyframes to blend between, and the blend factor
+    GLsizei frame;
+    GLsizei next_frame;
+    GLfloat blend;
+
+    // Vertices blended on the CPU, for renderers that don't blend
+    // keyframes in the shader. Allocated when first blended
+    GLfloat *blended_vertices;
+    bool blended_dirty;
+};
+
+/*
+ * Point the model arrays into the contents of a version 2 file
+ * Returns the texture name, or NULL if the file is invalid
  *
  * Call Context: Worker thread
  */
-model_ptr model_create(const char *path, engine_ptr e)
+static const char *model_map_v2(model_ptr m, const void *data, size_t size)
 {
-    model_ptr m = calloc(1, sizeof(struct model));
-    assert(m);
+    const struct model_header_v2 *h = data;
+    if (size < sizeof(struct model_header_v2))
+        return NULL;
 
-    // Open file
-    FILE *mdl = fopen(path, "rb");
-    assert(mdl);
+    size_t vertex_size = 9*sizeof(GLfloat)*(size_t)h->base.frame_count*h->base.triangle_count;
+    size_t texcoord_size = 6*sizeof(GLfloat)*(size_t)h->base.triangle_count;
+    if (h->vertex_offset % 16 || h->texcoord_offset % 16 ||
+        h->vertex_offset > size || vertex_size > size - h->vertex_offset ||
+        h->texcoord_offset > size || texcoord_size > size - h->texcoord_offset ||
+        h->texture_name_offset > size || h->base.texture_name_length >= size - h->texture_name_offset)
+        return NULL;
 
-    // Load header
-    struct model_header h;
-    fread(&h, sizeof(struct model_header), 1, mdl);
-    assert(h.version == 1);
+    const char *texture_name = (const char *)data + h->texture_name_offset;
+    if (texture_name[h->base.texture_name_length] != '\0')
+        return NULL;
 
-    m->frame_count = h.frame_count;
-    m->vertex_count = 3*h.triangle_count;
+    m->vertex_data = (const GLfloat *)((const uint8_t *)data + h->vertex_offset);
+    m->texcoord_data = (const GLfloat *)((const uint8_t *)data + h->texcoord_offset);
+    return texture_name;
+}
 
-    // Allocate arrays
-    m->vertex_data = calloc(3*m->frame_count*m->vertex_count, sizeof(GLfloat));
-    assert(m->vertex_data);
+/*
+ * Copy the arrays from the contents of a version 1 file
+ * Returns the (allocated) texture name, or NULL if the file is invalid
+ *
+ * Call Context: Worker thread
+ */
+static char *model_read_v1(model_ptr m, const void *data, size_t size)
+{
+    const struct model_header *h = data;
+    size_t vertex_size = 9*sizeof(GLfloat)*(size_t)h->frame_count*h->triangle_count;
+    size_t texcoord_size = 6*sizeof(GLfloat)*(size_t)h->triangle_count;
+    size_t offset = sizeof(struct model_header);
+    if (vertex_size > size - offset || texcoord_size > size - offset - vertex_size ||
+        h->texture_name_length > size - offset - vertex_size - texcoord_size)
+        return NULL;
 
-    m->texcoord_data = calloc(2*m->vertex_count, sizeof(GLfloat));
-    assert(m->texcoord_data);
+    GLfloat *vertex_data = malloc(vertex_size);
+    GLfloat *texcoord_data = malloc(texcoord_size);
+    char *texture_name = calloc(h->texture_name_length + 1, sizeof(char));
+    assert(vertex_data && texcoord_data && texture_name);
 
-    char *texture_name = calloc(h.texture_name_length+1, sizeof(char));
-    assert(texture_name);
+    const uint8_t *bytes = data;
+    memcpy(vertex_data, bytes + offset, vertex_size);
+    memcpy(texcoord_data, bytes + offset + vertex_size, texcoord_size);
+    memcpy(texture_name, bytes + offset + vertex_size + texcoord_size, h->texture_name_length);
 
-    // Load Data
-    fread(m->vertex_data, sizeof(GLfloat), 3*m->frame_count*m->vertex_count, mdl);
-    fread(m->texcoord_data, sizeof(GLfloat), 2*m->vertex_count, mdl);
-    fread(texture_name, sizeof(char), h.texture_name_length, mdl);
-    texture_name[h.texture_name_length] = '\0';
-    fclose(mdl);
+    m->vertex_data = vertex_data;
+    m->texcoord_data = texcoord_data;
+    return texture_name;
+}
 
-    // Working set for the current animation state
-    m->current_vertex_data = calloc(3*m->vertex_count, sizeof(GLfloat));
-    assert(m->current_vertex_data);
+struct model_load_job
+{
+    model_ptr m;
+    engine_ptr e;
+};
 
-    model_set_animation_frac(m, 0);
+/*
+ * Read the model file and retain its texture
+ *
+ * Call Context: Worker thread
+ * TODO: Handle errors in worker threads
+ */
+static void model_load_job(void *_j)
+{
+    TRACE_ZONE("model_load");
+    struct model_load_job *j = _j;
+    model_ptr m = j->m;
+    engine_ptr e = j->e;
+    const char *path = m->path;
+    free(j);
+
+    vfs_file_ptr file = vfs_open(engine_get_vfs(e), path);
+    assert(file);
+
+    const void *data = vfs_file_data(file);
+    size_t size = vfs_file_size(file);
+    if (size < sizeof(struct model_header))
+    {
+        printf("Unable to read model header from %s\n", path);
+        assert(FATAL_ERROR);
+    }
+
+    const struct model_header *h = data;
+    m->frame_count = h->frame_count;
+    m->vertex_count = 3*h->triangle_count;
+
+    const char *texture_name = NULL;
+    char *allocated_name = NULL;
+    if (h->version == 2)
+        texture_name = model_map_v2(m, data, size);
+    else if (h->version == 1)
+        texture_name = allocated_name = model_read_v1(m, data, size);
+
+    if (!texture_name)
+    {
+        printf("Invalid or unsupported model file %s\n", path);
+        assert(FATAL_ERROR);
+    }
 
-    m->va = vertexarray_create(NULL, m->texcoord_data, m->vertex_count, 2, GL_TRIANGLES, e);
+    m->va = vertexarray_create_keyframes(m->vertex_data, m->texcoord_data, m->vertex_count, m->frame_count, GL_TRIANGLES, e);
     m->texture = engine_retain_texture(e, texture_name);
-    free(texture_name);
+
+    // Version 1 data has been copied out of the file
+    if (allocated_name)
+        vfs_close(file);
+    else
+        m->file = file;
+
+    free(allocated_name);
+
+    __sync_synchronize();
+    m->loaded = true;
+}
+
+/*
+ * Load a model from a binary .mdl file
+ * Version 2 files are used in place from the mapped file (or pack),
+ * so the page cache is shared between every model using the file.
+ * The file is read on the worker pool: use model_wait_loaded
+ * to wait for it (and its texture) to complete
+ *
+ * Call Context: Any thread
+ */
+model_ptr model_create(const char *path, engine_ptr e)
+{
+    model_ptr m = calloc(1, sizeof(struct model));
+    assert(m);
+    m->path = strdup(path);
+
+    struct model_load_job *j = calloc(1, sizeof(struct model_load_job));
+    assert(j);
+    j->m = m;
+    j->e = e;
+
+    m->load = job_batch_create();
+    engine_queue_job(e, m->load, model_load_job, j);
     return m;
 }
 
 /*
  * Destroy model
+ * All instances of the model must have been destroyed first
+ *
+ * Call Context: Any thread
  */
 void model_destroy(model_ptr m, engine_ptr e)
 {
+    engine_wait_jobs(e, m->load);
+    job_batch_destroy(m->load);
+
     vertexarray_destroy(m->va, e);
     engine_release_texture(e, m->texture);
 
-    free(m->current_vertex_data);
-    free(m->texcoord_data);
-    free(m->vertex_data);
+    if (m->file)
+        vfs_close(m->file);
+    else
+    {
+        free((GLfloat *)m->texcoord_data);
+        free((GLfloat *)m->vertex_data);
+    }
+    free(m->path);
     free(m);
 }
 
 /*
- * Render a model in the current GL context
+ * Wait for the model file to be read and its texture decoded
+ *
+ * Call Context: Worker thread
+ */
+void model_wait_loaded(model_ptr m, engine_ptr e)
+{
+    engine_wait_jobs(e, m->load);
+    texture_wait_decoded(m->texture, e);
+}
+
+/*
+ * Check whether the model has loaded and its texture can be drawn
  *
  * Call Context: Main thread
  */
-void model_draw(model_ptr m, renderer_ptr r)
+bool model_is_ready(model_ptr m)
 {
-    if (m->gl_dirty)
+    return m->loaded && texture_is_ready(m->texture);
+}
+
+/*
+ * Create an animated instance of a model
+ * The caller must keep the model retained while the instance exists
+ *
+ * Call Context: Any thread
+ */
+model_instance_ptr model_instance_create(model_ptr m, engine_ptr e)
+{
+    model_instance_ptr mi = calloc(1, sizeof(struct model_instance));
+    assert(mi);
+    mi->model = m;
+
+    // The model may still be loading, so the keyframes
+    // are selected when the animation is first set
+    mi->current_animation_fraction = 0;
+    return mi;
+}
+
+/*
+ * Destroy a model instance
+ *
+ * Call Context: Any thread
+ */
+void model_instance_destroy(model_instance_ptr mi, engine_ptr e)
+{
+    free(mi->blended_vertices);
+    free(mi);
+}
+
+/*
+ * Set out = a + t*(b - a) for count floats, using the widest
+ * vector unit that the engine is compiled for.
+ * The remainder (or everything, on other targets) is blended one at a time
+ */
+static void blend_floats(GLfloat *out, const GLfloat *a, const GLfloat *b, GLfloat t, size_t count)
+{
+    size_t i = 0;
+#if defined(__AVX__)
+    __m256 vt = _mm256_set1_ps(t);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 va = _mm256_loadu_ps(a + i);
+        __m256 vd = _mm256_sub_ps(_mm256_loadu_ps(b + i), va);
+#if defined(__FMA__)
+        _mm256_storeu_ps(out + i, _mm256_fmadd_ps(vd, vt, va));
+#else
+        _mm256_storeu_ps(out + i, _mm256_add_ps(va, _mm256_mul_ps(vd, vt)));
+#endif
+    }
+#elif defined(__SSE__)
+    __m128 vt = _mm_set1_ps(t);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 va = _mm_loadu_ps(a + i);
+        __m128 vd = _mm_sub_ps(_mm_loadu_ps(b + i), va);
+        _mm_storeu_ps(out + i, _mm_add_ps(va, _mm_mul_ps(vd, vt)));
+    }
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+    float32x4_t vt = vdupq_n_f32(t);
+    for (; i + 4 <= count; i += 4)
+    {
+        float32x4_t va = vld1q_f32(a + i);
+        float32x4_t vd = vsubq_f32(vld1q_f32(b + i), va);
+        vst1q_f32(out + i, vmlaq_f32(va, vd, vt));
+    }
+#endif
+
+    for (; i < count; i++)
+        out[i] = a[i] + t*(b[i] - a[i]);
+}
+
+/*
+ * Name of the vector unit used by blend_floats, for benchmarks
+ */
+const char *model_blend_kernel_name()
+{
+#if defined(__AVX__) && defined(__FMA__)
+    return "avx+fma";
+#elif defined(__AVX__)
+    return "avx";
+#elif defined(__SSE__)
+    return "sse";
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+/*
+ * Blend the instance vertices between its current keyframes
+ *
+ * Call Context: Any thread
+ */
+static void model_instance_blend(model_instance_ptr mi)
+{
+    model_ptr m = mi->model;
+    size_t frame_size = 3*(size_t)m->vertex_count;
+    if (!mi->blended_vertices)
+    {
+        mi->blended_vertices = malloc(frame_size*sizeof(GLfloat));
+        assert(mi->blended_vertices);
+    }
+
+    blend_floats(mi->blended_vertices,
+                 m->vertex_data + mi->frame*frame_size,
+                 m->vertex_data + mi->next_frame*frame_size,
+                 mi->blend, frame_size);
+}
+
+struct model_blend_job
+{
+    model_instance_ptr *instances;
+    size_t count;
+};
+
+static void model_blend_job(void *_j)
+{
+    TRACE_ZONE("model_blend");
+    struct model_blend_job *j = _j;
+    for (size_t i = 0; i < j->count; i++)
+        model_instance_blend(j->instances[i]);
+}
+
+/*
+ * Blend the vertices of every instance whose animation has changed
+ * since it was last blended, for renderers that blend keyframes on
+ * the CPU. The instances are split into jobs for the worker pool,
+ * with the last job run on the calling thread.
+ * The models must have loaded
+ *
+ * Call Context: Main thread
+ */
+void model_instances_blend(model_instance_ptr *instances, size_t count, engine_ptr e)
+{
+    TRACE_ZONE("model_instances_blend");
+    model_instance_ptr *pending = calloc(count, sizeof(model_instance_ptr));
+    struct model_blend_job *jobs = calloc(count, sizeof(struct model_blend_job));
+    assert(pending && jobs);
+
+    size_t pending_count = 0, job_count = 0, job_floats = 0;
+    for (size_t i = 0; i < count; i++)
     {
-        vertexarray_update(m->va, m->current_vertex_data, NULL, m->vertex_count, GL_STREAM_DRAW);
-        m->gl_dirty = false;
+        model_instance_ptr mi = instances[i];
+        if (!mi->blended_dirty)
+            continue;
+
+        mi->blended_dirty = false;
+
+        // Start a new job once the current one has enough work
+        if (job_count == 0 || job_floats >= MODEL_BLEND_JOB_FLOATS)
+        {
+            jobs[job_count++].instances = &pending[pending_count];
+            job_floats = 0;
+        }
+
+        pending[pending_count++] = mi;
+        jobs[job_count - 1].count++;
+        job_floats += 3*(size_t)mi->model->vertex_count;
     }
 
-    texture_bind(m->texture, GL_TEXTURE0);
-    vertexarray_draw(m->va);
+    if (job_count > 0)
+    {
+        job_batch_ptr batch = job_batch_create();
+        for (size_t i = 0; i + 1 < job_count; i++)
+            engine_queue_job(e, batch, model_blend_job, &jobs[i]);
+
+        model_blend_job(&jobs[job_count - 1]);
+        engine_wait_jobs(e, batch);
+        job_batch_destroy(batch);
+    }
+
+    free(jobs);
+    free(pending);
+}
+
+/*
+ * Render a model instance in the current GL context
+ * using the given modelview-projection matrix
+ *
+ * Call Context: Main thread
+ */
+void model_instance_draw(model_instance_ptr mi, GLfloat mvp[16], renderer_ptr r)
+{
+    if (renderer_cpu_animation(r))
+    {
+        // Instances that weren't included in model_instances_blend
+        // are blended on this thread
+        if (mi->blended_dirty || !mi->blended_vertices)
+        {
+            model_instance_blend(mi);
+            mi->blended_dirty = false;
+        }
+
+        renderer_enable_model_shader(r, mvp);
+        texture_bind(mi->model->texture, GL_TEXTURE0);
+        vertexarray_draw_vertices(mi->model->va, mi->blended_vertices);
+        return;
+    }
+
+    renderer_enable_model_anim_shader(r, mvp, mi->blend);
+    texture_bind(mi->model->texture, GL_TEXTURE0);
+    vertexarray_draw_keyframes(mi->model->va, mi->frame, mi->next_frame);
 }
 
 /*
- * Fill the currently bound vbo with vertex data
- * given by the current animation fraction
+ * Select the keyframes and blend factor for the given animation fraction
+ * The vertices themselves are interpolated when drawn, on the GPU or
+ * by model_instances_blend
  *
  * Call Context: Main thread / Worker thread
  */
-void model_set_animation_frac(model_ptr m, GLfloat frac)
+void model_instance_set_animation_frac(model_instance_ptr mi, GLfloat frac)
 {
     assert(frac >= 0);
     assert(frac <= 1);
-    m->current_animation_fraction = frac;
+    mi->current_animation_fraction = frac;
+    mi->blended_dirty = true;
 
-    GLfloat frame_progress = frac*(m->frame_count-1);
-    size_t prev_frame = floor(frame_progress);
-    GLfloat t = frame_progress - prev_frame;
+    model_ptr m = mi->model;
+    if (m->frame_count < 2)
+    {
+        mi->frame = mi->next_frame = 0;
+        mi->blend = 0;
+        return;
+    }
 
-    // Lerp between frames
-    size_t prev_index = prev_frame*3*m->vertex_count;
-    size_t next_index = prev_index + 3*m->vertex_count;
+    GLfloat frame_progress = frac*(m->frame_count-1);
+    GLsizei frame = floor(frame_progress);
 
-    for (size_t i = 0; i < 3*m->vertex_count; i++)
-        m->current_vertex_data[i] = LERP(m->vertex_data[prev_index + i], m->vertex_data[next_index + i], t);
+    // frac = 1 ends exactly on the last frame
+    if (frame > m->frame_count - 2)
+        frame = m->frame_count - 2;
 
-    m->gl_dirty = true;
+    mi->frame = frame;
+    mi->next_frame = frame + 1;
+    mi->blend = frame_progress - frame;
 }
 
 /*
@@ -170,11 +557,11 @@ void model_set_animation_frac(model_ptr m, GLfloat frac)
  *
  * Call Context: Main thread / Worker thread
  */
-void model_step_animation_frac(model_ptr m, GLfloat frac)
+void model_instance_step_animation_frac(model_instance_ptr mi, GLfloat frac)
 {
-    GLfloat new = m->current_animation_fraction + frac;
+    GLfloat new = mi->current_animation_fraction + frac;
     new = fmod(new, 1.0);
     if (new < 0)
         new += 1.0;
-    model_set_animation_frac(m, new);
+    model_instance_set_animation_frac(mi, new);
 }
@@ -23,11 +23,17 @@
 
 model_ptr model_create(const char *path, engine_ptr e);
 void model_destroy(model_ptr m, engine_ptr e);
-void model_set_animation_frac(model_ptr m, GLfloat frac);
-void model_draw(model_ptr m, renderer_ptr r);
+void model_wait_loaded(model_ptr m, engine_ptr e);
+bool model_is_ready(model_ptr m);
+
+model_instance_ptr model_instance_create(model_ptr m, engine_ptr e);
+void model_instance_destroy(model_instance_ptr mi, engine_ptr e);
+void model_instance_set_animation_frac(model_instance_ptr mi, GLfloat frac);
+void model_instance_step_animation_frac(model_instance_ptr mi, GLfloat frac);
+void model_instance_draw(model_instance_ptr mi, GLfloat mvp[16], renderer_ptr r);
+void model_instances_blend(model_instance_ptr *instances, size_t count, engine_ptr e);
+const char *model_blend_kernel_name();
 
 void model_convert_obj(const char **input, size_t input_count, const char *output);
-void model_set_animation_frac(model_ptr m, GLfloat frac);
-void model_step_animation_frac(model_ptr m, GLfloat frac);
 
 #endif
@@ -33,6 +33,10 @@ struct renderer
     GLuint model_shader;
     GLuint model_mvp_matrix_uniform;
 
+    GLuint model_anim_shader;
+    GLuint model_anim_mvp_matrix_uniform;
+    GLuint model_anim_blend_uniform;
+
     GLuint text_shader;
     GLuint text_mvp_matrix_uniform;
 
@@ -46,6 +50,9 @@ struct renderer
     GLuint transition_shader;
     GLuint transition_mvp_matrix_uniform;
     GLuint transition_dt_uniform;
+
+    // Blend model keyframes on the CPU instead of in model_anim_shader
+    bool cpu_animation;
 };
 
 
@@ -207,6 +214,25 @@ static void init_model_shader(renderer_ptr r)
     glUniform1i(ts_uniform, 0); checkGLError();
 }
 
+static void bind_model_anim_attributes(GLuint shader)
+{
+    glBindAttribLocation(shader, VERTEX_POS_ATTRIB_IDX, "aVertexPosition");
+    glBindAttribLocation(shader, NEXT_VERTEX_POS_ATTRIB_IDX, "aNextVertexPosition");
+    glBindAttribLocation(shader, TEXTURE_COORDS_ATTRIB_IDX, "aVertexTexcoord");
+}
+
+static void init_model_anim_shader(renderer_ptr r)
+{
+    r->model_anim_shader = shader_init("shaders/model-anim.vsh", "shaders/model.fsh", bind_model_anim_attributes);
+    r->model_anim_mvp_matrix_uniform = glGetUniformLocation(r->model_anim_shader, "modelViewProjectionMatrix"); checkGLError();
+    r->model_anim_blend_uniform = glGetUniformLocation(r->model_anim_shader, "blend"); checkGLError();
+
+    // Bind texture unit 0 to textureSampler then forget about it
+    GLuint ts_uniform = glGetUniformLocation(r->model_anim_shader, "textureSampler"); checkGLError();
+    glUseProgram(r->model_anim_shader);
+    glUniform1i(ts_uniform, 0); checkGLError();
+}
+
 static void bind_text_attributes(GLuint shader)
 {
     glBindAttribLocation(shader, VERTEX_POS_ATTRIB_IDX, "aVertexPosition");
@@ -279,6 +305,7 @@ renderer_ptr renderer_create()
 
     init_layer_shader(r);
     init_model_shader(r);
+    init_model_anim_shader(r);
     init_text_shader(r);
     init_line_shader(r);
     init_line_color_shader(r);
@@ -290,9 +317,24 @@ renderer_ptr renderer_create()
 void renderer_destroy(renderer_ptr r)
 {
     shader_destroy(r->model_shader);
+    shader_destroy(r->model_anim_shader);
     shader_destroy(r->line_shader);
 }
 
+/*
+ * Select whether model keyframes are blended on the CPU
+ * (see model_instances_blend) or in the vertex shader
+ */
+void renderer_set_cpu_animation(renderer_ptr r, bool enabled)
+{
+    r->cpu_animation = enabled;
+}
+
+bool renderer_cpu_animation(renderer_ptr r)
+{
+    return r->cpu_animation;
+}
+
 /*
  * Enable the requested shader and set the mvp shader param
  */
@@ -308,6 +350,13 @@ void renderer_enable_model_shader(renderer_ptr r, GLfloat mvp[16])
     glUniformMatrix4fv(r->model_mvp_matrix_uniform, 1, GL_FALSE, mvp); checkGLError();
 }
 
+void renderer_enable_model_anim_shader(renderer_ptr r, GLfloat mvp[16], GLfloat blend)
+{
+    glUseProgram(r->model_anim_shader); checkGLError();
+    glUniformMatrix4fv(r->model_anim_mvp_matrix_uniform, 1, GL_FALSE, mvp); checkGLError();
+    glUniform1f(r->model_anim_blend_uniform, blend); checkGLError();
+}
+
 void renderer_enable_text_shader(renderer_ptr r, GLfloat mvp[16])
 {
     glUseProgram(r->text_shader); checkGLError();
@@ -85,13 +85,17 @@ enum
 {
 	VERTEX_POS_ATTRIB_IDX,
 	TEXTURE_COORDS_ATTRIB_IDX,
-    COLOR_ATTRIB_IDX
+    COLOR_ATTRIB_IDX,
+    NEXT_VERTEX_POS_ATTRIB_IDX
 };
 
 renderer_ptr renderer_create();
 void renderer_destroy(renderer_ptr r);
+void renderer_set_cpu_animation(renderer_ptr r, bool enabled);
+bool renderer_cpu_animation(renderer_ptr r);
 void renderer_enable_layer_shader(renderer_ptr r, GLfloat mvp[16]);
 void renderer_enable_model_shader(renderer_ptr r, GLfloat mvp[16]);
+void renderer_enable_model_anim_shader(renderer_ptr r, GLfloat mvp[16], GLfloat blend);
 void renderer_enable_text_shader(renderer_ptr r, GLfloat mvp[16]);
 void renderer_enable_line_shader(renderer_ptr r, GLfloat mvp[16], GLfloat color[4]);
 void renderer_enable_line_color_shader(renderer_ptr r, GLfloat mvp[16]);
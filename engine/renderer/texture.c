@@ -18,11 +18,56 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <png.h>
 
 #include "renderer.h"
 #include "texture.h"
 #include "engine.h"
+#include "pending_init.h"
+#include "worker_pool.h"
+#include "trace.h"
+#include "vfs.h"
+
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+    #define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+
+/*
+ * Cooked texture files (written by GPModelConverter texture)
+ * contain the full mip chain ready for upload:
+ *   header
+ *   level_count level entries
+ *   level data, each starting on a 16 byte boundary
+ * Rows are stored bottom to top, matching GL
+ */
+#define TEXTURE_FILE_MAGIC 0x58545047 // "GPTX"
+#define TEXTURE_FILE_VERSION 1
+
+typedef enum
+{
+    TEXTURE_FORMAT_RGBA8 = 0,
+    TEXTURE_FORMAT_DXT5  = 1,
+} texture_format;
+
+struct texture_file_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t level_count;
+};
+
+struct texture_file_level
+{
+    uint32_t offset;
+    uint32_t size;
+};
+
+// Set by texture_detect_formats on the main thread
+static bool dxt5_supported = false;
 
 struct texture
 {
@@ -34,14 +79,84 @@ struct texture
     png_uint_32 height;
     png_byte *image_data;
     bool initialized;
+
+    // Image decoding job, and whether it has completed
+    job_batch_ptr decode;
+    volatile bool decoded;
+
+    // Cooked texture file, kept open until it is uploaded,
+    // and the total size of its levels
+    vfs_file_ptr file;
+    size_t file_level_size;
+
+    // Set if the texture is uploaded by the engine's upload thread,
+    // in which case the main thread must never initialize it itself
+    bool upload_async;
+
+    // Destruction is deferred until the upload (and mipmap) tasks have run
+    struct pending_init pending;
 };
 
+static void uninit_gl(void *_t);
+
+/*
+ * Create the GL texture object and upload the image data
+ *
+ * Call Context: Main thread or upload thread
+ */
+static void upload_gl(texture_ptr t)
+{
+    // Now generate the OpenGL texture object
+    glGenTextures(1, &t->glid); checkGLError();
+    glActiveTexture(GL_TEXTURE0); checkGLError();
+    glBindTexture(GL_TEXTURE_2D, t->glid); checkGLError();
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE); checkGLError();
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE); checkGLError();
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR); checkGLError();
+
+    if (t->file)
+    {
+        // Upload every level straight from the file data
+        const struct texture_file_header *h = vfs_file_data(t->file);
+        const struct texture_file_level *levels = (const struct texture_file_level *)(h + 1);
+        for (GLint i = 0; i < h->level_count; i++)
+        {
+            GLsizei w = h->width >> i ? h->width >> i : 1;
+            GLsizei ht = h->height >> i ? h->height >> i : 1;
+            const GLvoid *data = (const uint8_t *)h + levels[i].offset;
+
+            if (h->format == TEXTURE_FORMAT_DXT5)
+                glCompressedTexImage2D(GL_TEXTURE_2D, i, GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, w, ht, 0, levels[i].size, data);
+            else
+                glTexImage2D(GL_TEXTURE_2D, i, GL_RGBA, w, ht, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+            checkGLError();
+        }
+
+#if !PLATFORM_GLES
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, h->level_count - 1); checkGLError();
+#endif
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, h->level_count > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR); checkGLError();
+
+        vfs_close(t->file);
+        t->file = NULL;
+    }
+    else
+    {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, t->width, t->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, (GLvoid *)t->image_data); checkGLError();
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR); checkGLError();
+    }
+
+    free(t->image_data);
+    t->image_data = NULL;
+}
+
 /*
  * Initialize the texture gl state
+ * Mipmaps are generated separately by generate_mipmaps
  *
  * Call Context: Main thread (via engine_process_tasks)
  */
-void init_gl(void *_t)
+static void init_gl(void *_t)
 {
     texture_ptr t = _t;
     if (t->initialized)
@@ -51,20 +166,104 @@ void init_gl(void *_t)
         return;
     }
 
-    // Now generate the OpenGL texture object
-    glGenTextures(1, &t->glid); checkGLError();
+    upload_gl(t);
+    t->initialized = true;
+}
+
+/*
+ * Generate the texture mipmaps and enable mipmapped filtering
+ *
+ * Call Context: Main thread or upload thread
+ */
+static void generate_mipmaps(texture_ptr t)
+{
     glActiveTexture(GL_TEXTURE0); checkGLError();
     glBindTexture(GL_TEXTURE_2D, t->glid); checkGLError();
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, t->width, t->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, (GLvoid *)t->image_data); checkGLError();
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE); checkGLError();
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE); checkGLError();
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR); checkGLError();
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR); checkGLError();
 	glGenerateMipmap(GL_TEXTURE_2D); checkGLError();
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR); checkGLError();
+}
 
-    free(t->image_data);
-    t->image_data = NULL;
+/*
+ * Upload the texture data
+ *
+ * Call Context: Main thread (via engine_process_tasks)
+ */
+static void upload_task(void *_t)
+{
+    texture_ptr t = _t;
+
+    // May have been initialized by draw before the task was run
+    pending_init_run(&t->pending, t->initialized, init_gl, uninit_gl, t);
+}
+
+/*
+ * Generate the texture mipmaps
+ *
+ * Call Context: Main thread (via engine_process_tasks)
+ */
+static void mipmap_task(void *_t)
+{
+    texture_ptr t = _t;
+
+    // The upload task is queued first, but may not yet have been
+    // visible when the engine checked the upload queue
+    if (!t->initialized)
+        init_gl(t);
+
+    generate_mipmaps(t);
+
+    if (pending_init_task_done(&t->pending))
+        uninit_gl(t);
+}
+
+/*
+ * Upload the texture data and generate mipmaps (unless they are
+ * included in a cooked texture) in a single pass
+ *
+ * Call Context: Upload thread
+ */
+static void async_upload_task(void *_t)
+{
+    texture_ptr t = _t;
+    bool mipmaps = !t->file;
+    upload_gl(t);
+    if (mipmaps)
+        generate_mipmaps(t);
+}
+
+/*
+ * Mark the texture as ready once the upload thread has finished with it
+ *
+ * Call Context: Main thread (via engine_process_tasks)
+ */
+static void async_upload_complete(void *_t)
+{
+    texture_ptr t = _t;
     t->initialized = true;
+
+    if (pending_init_task_done(&t->pending))
+        uninit_gl(t);
+}
+
+/*
+ * Queue the GL work for a texture that is ready to upload
+ *
+ * Call Context: Any thread
+ */
+static void queue_upload(texture_ptr t, engine_ptr e)
+{
+    if (t->upload_async)
+        engine_queue_upload(e, async_upload_task, async_upload_complete, t);
+    else
+    {
+        // Cooked textures already include their mipmaps
+        // The file is released by the upload, so check it first
+        bool mipmaps = !t->file;
+        size_t size = (size_t)t->width*t->height*4;
+        engine_queue_sized_task(e, TASK_PRIORITY_UPLOAD, upload_task, t, mipmaps ? size : t->file_level_size);
+        if (mipmaps)
+            engine_queue_sized_task(e, TASK_PRIORITY_MIPMAP, mipmap_task, t, size);
+    }
 }
 
 /*
@@ -75,52 +274,67 @@ void init_gl(void *_t)
 static void uninit_gl(void *_t)
 {
     texture_ptr t = _t;
+
+    // Destruction was requested before the texture was initialized
+    if (pending_init_defer_destroy(&t->pending))
+        return;
+
     assert(t->initialized);
 
+    // Released textures have finished decoding, as
+    // engine_release_texture waits for the decode batch
     glDeleteTextures(1, &t->glid);
+    if (t->decode)
+        job_batch_destroy(t->decode);
+    if (t->file)
+        vfs_close(t->file);
     free(t->path);
     free(t->image_data);
     free(t);
 }
 
+struct texture_decode_job
+{
+    texture_ptr t;
+    vfs_file_ptr file;
+    size_t offset;
+    engine_ptr e;
+};
+
 /*
- * Create a texture object
+ * libpng read callback that reads from the file data in memory
+ *
+ * Call Context: Worker thread
  */
-texture_ptr texture_create(const char *path, engine_ptr e)
+static void read_png_data(png_structp png_t, png_bytep data, png_size_t length)
 {
-    FILE *fp = fopen(path, "rb");
-    if (!fp)
-        return NULL;
+    struct texture_decode_job *j = png_get_io_ptr(png_t);
+    if (length > vfs_file_size(j->file) - j->offset)
+        png_error(png_t, "Read past end of file");
 
-    // Test that this is actually a png
-    png_byte header[8];
-    fread(header, 1, 8, fp);
-    if (png_sig_cmp(header, 0, 8))
-    {
-        fclose(fp);
-        return NULL;
-    }
+    memcpy(data, (const png_byte *)vfs_file_data(j->file) + j->offset, length);
+    j->offset += length;
+}
+
+/*
+ * Decode the png image data and queue the GL upload
+ *
+ * Call Context: Worker thread
+ * TODO: Handle errors in worker threads
+ */
+static void texture_decode_job(void *_j)
+{
+    TRACE_ZONE("texture_decode");
+    struct texture_decode_job *j = _j;
+    texture_ptr t = j->t;
 
     // Initialize metadata storage
     png_structp png_t = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png_t)
-    {
-        fclose(fp);
-        return NULL;
-    }
+    assert(png_t);
 
     png_infop info_t = png_create_info_struct(png_t);
     png_infop end_info = png_create_info_struct(png_t);
-    if (!info_t || !end_info)
-    {
-        png_destroy_read_struct(&png_t, &info_t, &end_info);
-        fclose(fp);
-        return NULL;
-    }
-
-    texture_ptr t = calloc(1, sizeof(struct texture));
-    assert(t);
-    t->path = strdup(path);
+    assert(info_t && end_info);
 
     // Set libpng jumpbuf for catching internal errors
     if (!setjmp(png_jmpbuf(png_t)))
@@ -128,7 +342,8 @@ texture_ptr texture_create(const char *path, engine_ptr e)
         int bit_depth, color_type;
 
         // Skip fileheader
-        png_init_io(png_t, fp);
+        j->offset = 8;
+        png_set_read_fn(png_t, j, read_png_data);
         png_set_sig_bytes(png_t, 8);
 
         // Read metadata
@@ -155,20 +370,170 @@ texture_ptr texture_create(const char *path, engine_ptr e)
     }
     else
     {
-        // png error
-        if (t->image_data)
-            free(t->image_data);
-        free(t);
-        t = NULL;
+        printf("Error decoding texture %s\n", t->path);
+        assert(FATAL_ERROR);
     }
 
     png_destroy_read_struct(&png_t, &info_t, &end_info);
-    fclose(fp);
+    vfs_close(j->file);
+
+    __sync_synchronize();
+    t->decoded = true;
+
+    queue_upload(t, j->e);
+    free(j);
+}
+
+/*
+ * Open a cooked texture file and validate its contents
+ * Returns false if the file is missing, invalid, or
+ * uses a format that the GL implementation doesn't support
+ *
+ * Call Context: Any thread
+ */
+static bool map_cooked_texture(texture_ptr t, const char *path, engine_ptr e)
+{
+    vfs_file_ptr file = vfs_open(engine_get_vfs(e), path);
+    if (!file)
+        return false;
+
+    size_t size = vfs_file_size(file);
+    if (size < sizeof(struct texture_file_header))
+    {
+        vfs_close(file);
+        return false;
+    }
+
+    const struct texture_file_header *h = vfs_file_data(file);
+    const struct texture_file_level *levels = (const struct texture_file_level *)(h + 1);
+    bool valid = h->magic == TEXTURE_FILE_MAGIC && h->version == TEXTURE_FILE_VERSION &&
+        (h->format == TEXTURE_FORMAT_RGBA8 || (h->format == TEXTURE_FORMAT_DXT5 && dxt5_supported)) &&
+        h->width > 0 && h->height > 0 && h->level_count > 0 && h->level_count <= 16 &&
+        sizeof(struct texture_file_header) + h->level_count*sizeof(struct texture_file_level) <= size;
 
-    engine_queue_task(e, init_gl, t);
+    // The uploads read the full size of each level from the file data
+    size_t level_size = 0;
+    for (uint32_t i = 0; valid && i < h->level_count; i++)
+    {
+        size_t w = h->width >> i ? h->width >> i : 1;
+        size_t ht = h->height >> i ? h->height >> i : 1;
+        size_t expected = h->format == TEXTURE_FORMAT_DXT5 ? ((w + 3)/4)*((ht + 3)/4)*16 : w*ht*4;
+        valid = levels[i].size == expected && levels[i].offset <= size && levels[i].size <= size - levels[i].offset;
+        level_size += levels[i].size;
+    }
+
+    if (!valid)
+    {
+        printf("Ignoring invalid or unsupported cooked texture %s\n", path);
+        vfs_close(file);
+        return false;
+    }
+
+    t->file = file;
+    t->file_level_size = level_size;
+    t->width = h->width;
+    t->height = h->height;
+    return true;
+}
+
+/*
+ * Create a texture object
+ * A cooked .tex file next to a .png is used in preference to
+ * the png. Otherwise, the image is decoded on the worker pool:
+ * use texture_wait_decoded to wait for it to complete
+ *
+ * Call Context: Any thread
+ */
+texture_ptr texture_create(const char *path, engine_ptr e)
+{
+    TRACE_ZONE("texture_create");
+
+    size_t len = strlen(path);
+    if (len > 4 && !strcmp(path + len - 4, ".png"))
+    {
+        texture_ptr t = calloc(1, sizeof(struct texture));
+        assert(t);
+        t->path = strdup(path);
+        memcpy(t->path + len - 4, ".tex", 4);
+
+        if (map_cooked_texture(t, t->path, e))
+        {
+            // Mipmaps are already included in the file
+            memcpy(t->path + len - 4, ".png", 4);
+            t->decoded = true;
+            pending_init_begin(&t->pending, 1);
+            t->upload_async = engine_has_upload_thread(e);
+            queue_upload(t, e);
+            return t;
+        }
+
+        free(t->path);
+        free(t);
+    }
+
+    vfs_file_ptr file = vfs_open(engine_get_vfs(e), path);
+    if (!file)
+        return NULL;
+
+    // Test that this is actually a png
+    if (vfs_file_size(file) < 8 || png_sig_cmp((png_bytep)vfs_file_data(file), 0, 8))
+    {
+        vfs_close(file);
+        return NULL;
+    }
+
+    texture_ptr t = calloc(1, sizeof(struct texture));
+    assert(t);
+    t->path = strdup(path);
+
+    // Destruction is deferred until the upload and mipmap tasks have run
+    // The upload thread does both in a single task
+    t->upload_async = engine_has_upload_thread(e);
+    pending_init_begin(&t->pending, t->upload_async ? 1 : 2);
+
+    struct texture_decode_job *j = calloc(1, sizeof(struct texture_decode_job));
+    assert(j);
+    j->t = t;
+    j->file = file;
+    j->e = e;
+
+    // Separate textures (even within the same scene) decode in parallel
+    t->decode = job_batch_create();
+    engine_queue_job(e, t->decode, texture_decode_job, j);
     return t;
 }
 
+/*
+ * Wait for the texture image to be decoded
+ *
+ * Call Context: Any thread
+ */
+void texture_wait_decoded(texture_instance_ptr t, engine_ptr e)
+{
+    // Cooked textures don't need decoding
+    if (t->decode)
+        engine_wait_jobs(e, t->decode);
+}
+
+/*
+ * Check which cooked texture formats can be uploaded
+ *
+ * Call Context: Main thread
+ */
+void texture_detect_formats()
+{
+#if PLATFORM_GLES
+    const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+    dxt5_supported = extensions && strstr(extensions, "GL_EXT_texture_compression_s3tc");
+#else
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (GLint i = 0; i < count; i++)
+        if (!strcmp((const char *)glGetStringi(GL_EXTENSIONS, i), "GL_EXT_texture_compression_s3tc"))
+            dxt5_supported = true;
+#endif
+}
+
 /*
  * Destroy texture
  *
@@ -176,7 +541,7 @@ texture_ptr texture_create(const char *path, engine_ptr e)
  */
 void texture_destroy(texture_ptr t, engine_ptr e)
 {
-    engine_queue_task(e, uninit_gl, t);
+    engine_queue_task(e, TASK_PRIORITY_CHEAP, uninit_gl, t);
 }
 
 /*
@@ -198,6 +563,15 @@ void texture_bind(texture_instance_ptr t, GLenum attachment)
 {
     if (!t->initialized)
     {
+        // Never block the main thread on decoding or uploading
+        if (!t->decoded || t->upload_async)
+        {
+            printf("WARNING: Attempting to access texture %s before it has loaded.\n", t->path);
+            glActiveTexture(attachment);
+            glBindTexture(GL_TEXTURE_2D, 0);
+            return;
+        }
+
         printf("WARNING: Attempting to access uninitialized texture. Initializing on hot path.\n");
         init_gl((void *)t);
     }
@@ -206,9 +580,41 @@ void texture_bind(texture_instance_ptr t, GLenum attachment)
     glBindTexture(GL_TEXTURE_2D, t->glid);
 }
 
-bool texture_has_path(texture_ptr t, const char *path)
+/*
+ * Check whether the texture has been uploaded and can be drawn
+ *
+ * Call Context: Main thread
+ */
+bool texture_is_ready(texture_instance_ptr t)
+{
+    return t->initialized;
+}
+
+const char *texture_path(texture_instance_ptr t)
+{
+    return t->path;
+}
+
+/*
+ * Approximate GPU memory used by the texture: the levels of a
+ * cooked texture, or RGBA8 image data plus a third again for
+ * the mipmap chain
+ */
+size_t texture_memory_size(texture_instance_ptr t)
+{
+    if (t->file_level_size)
+        return t->file_level_size;
+
+    return (size_t)t->width*t->height*4*4/3;
+}
+
+/*
+ * Dimensions of the decoded image
+ */
+void texture_dimensions(texture_instance_ptr t, GLuint *width, GLuint *height)
 {
-    return strcmp(path, t->path) == 0;
+    *width = t->width;
+    *height = t->height;
 }
 
 
@@ -24,9 +24,14 @@
 texture_ptr texture_create(const char *path, engine_ptr e);
 void texture_destroy(texture_ptr t, engine_ptr e);
 void texture_destroy_internal(texture_ptr t);
+void texture_wait_decoded(texture_instance_ptr t, engine_ptr e);
+void texture_detect_formats();
 
 void texture_bind(texture_instance_ptr t, GLenum unit);
-bool texture_has_path(texture_ptr t, const char *path);
+bool texture_is_ready(texture_instance_ptr t);
+const char *texture_path(texture_instance_ptr t);
+size_t texture_memory_size(texture_instance_ptr t);
+void texture_dimensions(texture_instance_ptr t, GLuint *width, GLuint *height);
 textureref texture_get_textureref(texture_ptr t, GLfloat width, GLfloat height);
 
 #endif
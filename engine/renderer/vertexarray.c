@@ -23,6 +23,7 @@
 #include "engine.h"
 #include "renderer.h"
 #include "vertexarray.h"
+#include "pending_init.h"
 
 struct vertexarray
 {
@@ -33,8 +34,22 @@ struct vertexarray
     GLsizei vertex_count;
     GLsizei texcoord_size;
 
+    // Keyframed arrays store frame_count consecutive copies of the
+    // vertices, and draw a pair of them at once (see vertexarray_draw_keyframes)
+    GLsizei frame_count;
+    GLsizei bound_frame;
+    GLsizei bound_next_frame;
+
+    // Created on first use by vertexarray_draw_vertices: a stream buffer
+    // for vertices blended on the CPU, drawn with the keyframe texcoords
+    GLuint stream_vao;
+    GLuint stream_vbo;
+
     // For delayed init
     bool initialized;
+
+    // Destruction is deferred until the init task has run
+    struct pending_init pending;
     GLfloat *vertices;
     GLfloat *texcoords;
 };
@@ -63,10 +78,16 @@ static void init_gl(void *_va)
 
     // Fill vertex buffer
     glBindBuffer(GL_ARRAY_BUFFER, va->vbo); checkGLError();
-    glBufferData(GL_ARRAY_BUFFER, 3*va->vertex_count*sizeof(GLfloat), va->vertices, GL_STATIC_DRAW); checkGLError();
+    glBufferData(GL_ARRAY_BUFFER, 3*va->vertex_count*va->frame_count*sizeof(GLfloat), va->vertices, GL_STATIC_DRAW); checkGLError();
     glVertexAttribPointer(VERTEX_POS_ATTRIB_IDX, 3, GL_FLOAT, GL_FALSE, 0, 0); checkGLError();
     glEnableVertexAttribArray(VERTEX_POS_ATTRIB_IDX); checkGLError();
 
+    if (va->frame_count > 1)
+    {
+        glVertexAttribPointer(NEXT_VERTEX_POS_ATTRIB_IDX, 3, GL_FLOAT, GL_FALSE, 0, 0); checkGLError();
+        glEnableVertexAttribArray(NEXT_VERTEX_POS_ATTRIB_IDX); checkGLError();
+    }
+
     // Fill texcoord buffer
     if (va->texcoord_size > 0)
     {
@@ -90,14 +111,46 @@ static void init_gl(void *_va)
 static void uninit_gl(void *_va)
 {
     vertexarray_ptr va = _va;
+
+    // Destruction was requested before the vertex array was initialized
+    if (pending_init_defer_destroy(&va->pending))
+        return;
+
     assert(va->initialized);
 
     glDeleteBuffers(1, &va->vbo); checkGLError();
     glDeleteBuffers(1, &va->tbo); checkGLError();
 	glDeleteVertexArrays(1, &va->vao); checkGLError();
+
+    if (va->stream_vao)
+    {
+        glDeleteBuffers(1, &va->stream_vbo); checkGLError();
+        glDeleteVertexArrays(1, &va->stream_vao); checkGLError();
+    }
     free(va);
 }
 
+/*
+ * Run the queued initialization
+ *
+ * Call Context: Main thread (via engine_process_tasks)
+ */
+static void init_task(void *_va)
+{
+    vertexarray_ptr va = _va;
+
+    // May have been initialized by draw before the task was run
+    pending_init_run(&va->pending, va->initialized, init_gl, uninit_gl, va);
+}
+
+/*
+ * Bytes uploaded by init_gl
+ */
+static size_t vertexarray_data_size(vertexarray_ptr va)
+{
+    return (3*(size_t)va->frame_count + va->texcoord_size)*va->vertex_count*sizeof(GLfloat);
+}
+
 /*
  * Create a vertexarray (vao) with the given vertices, texcoords, and draw type
  * Note: vertices and texcoords may be null if the caller wants to allocate space
@@ -111,6 +164,7 @@ vertexarray_ptr vertexarray_create(GLfloat *vertices, GLfloat *texcoords, GLsize
     assert(va);
 
     va->vertex_count = vertex_count;
+    va->frame_count = 1;
     va->type = type;
     va->texcoord_size = texcoord_size;
 
@@ -130,7 +184,43 @@ vertexarray_ptr vertexarray_create(GLfloat *vertices, GLfloat *texcoords, GLsize
         memcpy(va->texcoords, texcoords, s);
     }
 
-    engine_queue_task(e, init_gl, va);
+    pending_init_begin(&va->pending, 1);
+    engine_queue_sized_task(e, TASK_PRIORITY_UPLOAD, init_task, va, vertexarray_data_size(va));
+    return va;
+}
+
+/*
+ * Create a vertexarray holding every keyframe of an animated mesh.
+ * vertices contains frame_count consecutive frames of vertex_count vertices,
+ * which share a single set of texcoords.
+ * The frames are uploaded once, and drawn using vertexarray_draw_keyframes
+ *
+ * Call Context: Any thread
+ */
+vertexarray_ptr vertexarray_create_keyframes(const GLfloat *vertices, const GLfloat *texcoords, GLsizei vertex_count,
+                                             GLsizei frame_count, GLenum type, engine_ptr e)
+{
+    assert(vertices && texcoords && frame_count > 0);
+    vertexarray_ptr va = calloc(1, sizeof(struct vertexarray));
+    assert(va);
+
+    va->vertex_count = vertex_count;
+    va->frame_count = frame_count;
+    va->type = type;
+    va->texcoord_size = 2;
+
+    size_t s = 3*(size_t)va->vertex_count*va->frame_count*sizeof(GLfloat);
+    va->vertices = malloc(s);
+    assert(va->vertices);
+    memcpy(va->vertices, vertices, s);
+
+    s = va->texcoord_size*va->vertex_count*sizeof(GLfloat);
+    va->texcoords = malloc(s);
+    assert(va->texcoords);
+    memcpy(va->texcoords, texcoords, s);
+
+    pending_init_begin(&va->pending, 1);
+    engine_queue_sized_task(e, TASK_PRIORITY_UPLOAD, init_task, va, vertexarray_data_size(va));
     return va;
 }
 
@@ -169,7 +259,7 @@ vertexarray_ptr vertexarray_create_quad(GLfloat width, GLfloat height, engine_pt
  */
 void vertexarray_destroy(vertexarray_ptr va, engine_ptr e)
 {
-    engine_queue_task(e, uninit_gl, va);
+    engine_queue_task(e, TASK_PRIORITY_CHEAP, uninit_gl, va);
 }
 
 /*
@@ -185,6 +275,8 @@ void vertexarray_update(vertexarray_ptr va, GLfloat *vertices, GLfloat *texcoord
         init_gl(va);
     }
 
+    // Keyframed arrays are static
+    assert(va->frame_count == 1);
     va->vertex_count = count;
     glBindVertexArray(va->vao); checkGLError();
     if (vertices)
@@ -219,3 +311,79 @@ void vertexarray_draw(vertexarray_ptr va)
     glDrawArrays(va->type, 0, va->vertex_count); checkGLError();
     glBindVertexArray(0); checkGLError();
 }
+
+/*
+ * Draw a keyframed vertexarray, blending from frame to next_frame.
+ * The frames are selected by offsetting the position attributes
+ * into the static keyframe buffer, so nothing is uploaded.
+ * The blend factor is set by the caller (see renderer_enable_model_anim_shader)
+ *
+ * Call Context: Main thread
+ */
+void vertexarray_draw_keyframes(vertexarray_ptr va, GLsizei frame, GLsizei next_frame)
+{
+    assert(frame < va->frame_count && next_frame < va->frame_count);
+    if (!va->initialized)
+    {
+        printf("WARNING: Attempting to access uninitialized vertexarray. Initializing on hot path.\n");
+        init_gl(va);
+    }
+
+    glBindVertexArray(va->vao); checkGLError();
+
+    // Attribute offsets are stored in the vao, so only need
+    // to be changed when a different pair of frames is drawn
+    if (va->frame_count > 1 && (frame != va->bound_frame || next_frame != va->bound_next_frame))
+    {
+        size_t frame_size = 3*(size_t)va->vertex_count*sizeof(GLfloat);
+        glBindBuffer(GL_ARRAY_BUFFER, va->vbo); checkGLError();
+        glVertexAttribPointer(VERTEX_POS_ATTRIB_IDX, 3, GL_FLOAT, GL_FALSE, 0, (const GLvoid *)(frame*frame_size)); checkGLError();
+        glVertexAttribPointer(NEXT_VERTEX_POS_ATTRIB_IDX, 3, GL_FLOAT, GL_FALSE, 0, (const GLvoid *)(next_frame*frame_size)); checkGLError();
+        va->bound_frame = frame;
+        va->bound_next_frame = next_frame;
+    }
+
+    glDrawArrays(va->type, 0, va->vertex_count); checkGLError();
+    glBindVertexArray(0); checkGLError();
+}
+
+/*
+ * Draw a single frame of vertices supplied by the caller, using the
+ * texcoords of a keyframed vertexarray. The vertices are uploaded
+ * to a stream buffer shared by every draw of the array
+ *
+ * Call Context: Main thread
+ */
+void vertexarray_draw_vertices(vertexarray_ptr va, const GLfloat *vertices)
+{
+    if (!va->initialized)
+    {
+        printf("WARNING: Attempting to access uninitialized vertexarray. Initializing on hot path.\n");
+        init_gl(va);
+    }
+
+    if (!va->stream_vao)
+    {
+        glGenVertexArrays(1, &va->stream_vao); checkGLError();
+        glGenBuffers(1, &va->stream_vbo); checkGLError();
+        assert(va->stream_vao && va->stream_vbo);
+
+        glBindVertexArray(va->stream_vao); checkGLError();
+        glBindBuffer(GL_ARRAY_BUFFER, va->stream_vbo); checkGLError();
+        glVertexAttribPointer(VERTEX_POS_ATTRIB_IDX, 3, GL_FLOAT, GL_FALSE, 0, 0); checkGLError();
+        glEnableVertexAttribArray(VERTEX_POS_ATTRIB_IDX); checkGLError();
+
+        glBindBuffer(GL_ARRAY_BUFFER, va->tbo); checkGLError();
+        glVertexAttribPointer(TEXTURE_COORDS_ATTRIB_IDX, va->texcoord_size, GL_FLOAT, GL_FALSE, 0, 0); checkGLError();
+        glEnableVertexAttribArray(TEXTURE_COORDS_ATTRIB_IDX); checkGLError();
+    }
+
+    glBindVertexArray(va->stream_vao); checkGLError();
+
+    // Orphan the previous contents rather than waiting for draws that use them
+    glBindBuffer(GL_ARRAY_BUFFER, va->stream_vbo); checkGLError();
+    glBufferData(GL_ARRAY_BUFFER, 3*va->vertex_count*sizeof(GLfloat), vertices, GL_STREAM_DRAW); checkGLError();
+
+    glDrawArrays(va->type, 0, va->vertex_count); checkGLError();
+    glBindVertexArray(0); checkGLError();
+}
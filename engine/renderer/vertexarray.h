@@ -24,9 +24,13 @@
 vertexarray_ptr vertexarray_create_quad(GLfloat width, GLfloat height, engine_ptr e);
 vertexarray_ptr vertexarray_create(GLfloat *vertices, GLfloat *texcoords, GLsizei vertex_count,
                                    GLsizei texcoord_size, GLenum type, engine_ptr e);
+vertexarray_ptr vertexarray_create_keyframes(const GLfloat *vertices, const GLfloat *texcoords, GLsizei vertex_count,
+                                             GLsizei frame_count, GLenum type, engine_ptr e);
 void vertexarray_destroy(vertexarray_ptr va, engine_ptr e);
 
 void vertexarray_update(vertexarray_ptr va, GLfloat *vertices, GLfloat *texcoords, GLsizei count, GLenum type);
 void vertexarray_draw(vertexarray_ptr va);
+void vertexarray_draw_keyframes(vertexarray_ptr va, GLsizei frame, GLsizei next_frame);
+void vertexarray_draw_vertices(vertexarray_ptr va, const GLfloat *vertices);
 
 #endif
@@ -19,6 +19,9 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "luabridge.h"
 #include "luabridge_scene.h"
@@ -31,16 +34,37 @@
 #include "layer.h"
 #include "walkmap.h"
 #include "actor.h"
+#include "model.h"
+#include "worker_pool.h"
+#include "vfs.h"
+#include "timer.h"
+#include "trace.h"
+
+// The snapshot triple buffer state is packed into a single word:
+// bits 0-1 hold the slot being written by the simulation, bits 2-3 the
+// most recently published slot, and bits 4-5 the slot being rendered.
+// SNAPSHOT_FRESH is set when the published slot hasn't been rendered yet
+#define SNAPSHOT_WRITE(x) ((x) & 3)
+#define SNAPSHOT_READY(x) (((x) >> 2) & 3)
+#define SNAPSHOT_READ(x) (((x) >> 4) & 3)
+#define SNAPSHOT_SLOTS(write, ready, read) ((write) | ((ready) << 2) | ((read) << 4))
+#define SNAPSHOT_FRESH (1 << 6)
 
 struct actor_list
 {
     actor_ptr actor;
+
+    // Loaded after the scene is shown, see scene_set_load_deferred
+    bool deferred;
     struct actor_list *next;
 };
 
 struct layer_list
 {
     layer_ptr layer;
+
+    // Loaded after the scene is shown, see scene_set_load_deferred
+    bool deferred;
     struct layer_list *next;
 };
 
@@ -52,25 +76,122 @@ struct timeout_list
     struct timeout_list *next;
 };
 
+// A trigger region whose callback loads a neighbouring scene
+struct scene_exit
+{
+    size_t neighbour;
+    GLfloat position[2];
+};
+
+// A line of the scene script that loads a neighbouring scene
+struct scene_exit_call
+{
+    int line;
+    size_t neighbour;
+};
+
+struct scene_actor_snapshot
+{
+    actor_ptr actor;
+    struct actor_state prev;
+    struct actor_state cur;
+};
+
+struct scene_layer_snapshot
+{
+    layer_ptr layer;
+    GLsizei frame;
+};
+
+// Everything needed to render the scene, copied
+// at the end of each simulation step
+struct scene_snapshot
+{
+    double step_time;
+    GLfloat camera[16];
+
+    struct scene_actor_snapshot *actors;
+    size_t actor_count;
+    size_t actor_capacity;
+
+    // Visible layers in render order
+    struct scene_layer_snapshot *layers;
+    size_t layer_count;
+    size_t layer_capacity;
+};
+
 struct scene
 {
+    char *name;
     lua_State *lua;
     struct camera_state camera;
 
+    // Scene assets are read from this pack if it exists
+    char *pack_path;
+    bool pack_mounted;
+
     struct layer_list *layers;
     walkmap_ptr walkmap;
 
-    // Camera matrices
+    // Camera matrix, updated by the simulation
+    GLfloat camera_matrix[16];
+
+    // Camera matrices used for rendering
     modelview_ptr mv;
 
     // Actors
     struct actor_list *actors;
     struct actor_list **actors_tail;
 
+    // Scenes that may be loaded from this one, and the
+    // trigger regions (exits) that load them
+    struct scene_neighbour *neighbours;
+    size_t neighbour_count;
+    struct scene_exit *exits;
+    size_t exit_count;
+
+    // Script lines that load a neighbour, for
+    // matching trigger callbacks to exits during setup
+    struct scene_exit_call *exit_calls;
+    size_t exit_call_count;
+
+    // Exit distances are measured from this actor
+    actor_ptr player;
+
+    // Load time saved by the script cache, in seconds
+    double script_saved;
+
+    // Set while the scene is kept in the scene cache after it was left
+    bool suspended;
+
+    // Priority of the assets being loaded by setup
+    bool load_deferred;
+
     // Tiemout callbacks
     struct timeout_list *timeouts;
     struct timeout_list **timeouts_tail;
 
+    // Simulation time not yet consumed by a fixed step, and the
+    // fraction of a step that rendering should interpolate by
+    double sim_accumulator;
+    GLfloat sim_alpha;
+
+    // Render state published by the simulation
+    struct scene_snapshot snapshots[3];
+    volatile uint32_t snapshot_slots;
+
+    // Simulation thread, if enabled
+    pthread_t sim_thread;
+    bool sim_running;
+    volatile bool sim_stop;
+    double sim_timestep;
+    uint8_t sim_max_substeps;
+    engine_ptr sim_engine;
+
+    // Held by the simulation thread while stepping, so that the
+    // main thread can safely draw debug views of the walkmap
+    pthread_mutex_t sim_mutex;
+
     // OpenGL state
     framebuffer_ptr fb;
 
@@ -79,25 +200,171 @@ struct scene
     GLuint height;
 };
 
+static void scene_publish_snapshot(scene_ptr s);
+
+struct scene_walkmap_job
+{
+    char *path;
+    scene_ptr s;
+    engine_ptr e;
+};
+
+/*
+ * Parse the scene walkmap
+ *
+ * Call Context: Worker thread
+ */
+static void scene_load_walkmap_job(void *_j)
+{
+    struct scene_walkmap_job *j = _j;
+    j->s->walkmap = walkmap_create(j->path, j->e);
+}
+
+/*
+ * Find the index of a neighbouring scene, adding it if necessary
+ * Returns SIZE_MAX for the scene itself
+ */
+static size_t scene_neighbour_index(scene_ptr s, const char *name)
+{
+    if (!strcmp(name, s->name))
+        return SIZE_MAX;
+
+    for (size_t i = 0; i < s->neighbour_count; i++)
+        if (!strcmp(s->neighbours[i].name, name))
+            return i;
+
+    s->neighbours = realloc(s->neighbours, (s->neighbour_count + 1)*sizeof(struct scene_neighbour));
+    assert(s->neighbours);
+    s->neighbours[s->neighbour_count] = (struct scene_neighbour){strdup(name), INFINITY};
+    return s->neighbour_count++;
+}
+
+/*
+ * Find the lines of the scene script that load another scene by name,
+ * e.g. engine:loadScene("street", "slide"), and add these scenes as
+ * neighbours. Trigger regions whose callbacks include one of these
+ * lines are treated as exits to the scene
+ *
+ * Call Context: Worker thread
+ */
+static void scene_find_exit_calls(scene_ptr s, const char *script_path, engine_ptr e)
+{
+    vfs_file_ptr file = vfs_open(engine_get_vfs(e), script_path);
+    if (!file)
+        return;
+
+    const char *data = vfs_file_data(file);
+    size_t size = vfs_file_size(file);
+    const char *key = "loadScene";
+    size_t key_length = strlen(key);
+
+    int line = 1;
+    for (size_t i = 0; i < size; i++)
+    {
+        if (data[i] == '\n')
+        {
+            line++;
+            continue;
+        }
+
+        if (size - i < key_length || memcmp(&data[i], key, key_length))
+            continue;
+
+        // Only string literal names can be inferred
+        size_t j = i + key_length;
+        while (j < size && (data[j] == ' ' || data[j] == '\t'))
+            j++;
+        if (j == size || data[j++] != '(')
+            continue;
+
+        while (j < size && (data[j] == ' ' || data[j] == '\t'))
+            j++;
+        if (j == size || (data[j] != '"' && data[j] != '\''))
+            continue;
+
+        char quote = data[j++];
+        size_t start = j;
+        while (j < size && data[j] != quote && data[j] != '\n')
+            j++;
+        if (j == size || data[j] != quote || j == start)
+            continue;
+
+        char *name = calloc(j - start + 1, sizeof(char));
+        assert(name);
+        memcpy(name, &data[start], j - start);
+        size_t neighbour = scene_neighbour_index(s, name);
+        free(name);
+        i = j;
+
+        if (neighbour == SIZE_MAX)
+            continue;
+
+        s->exit_calls = realloc(s->exit_calls, (s->exit_call_count + 1)*sizeof(struct scene_exit_call));
+        assert(s->exit_calls);
+        s->exit_calls[s->exit_call_count++] = (struct scene_exit_call){line, neighbour};
+    }
+
+    vfs_close(file);
+}
+
+/*
+ * Abandon a partially built scene if its load has been cancelled
+ *
+ * Call Context: Worker thread (during scene_create)
+ */
+static bool scene_abandon_if_cancelled(scene_ptr s, const volatile bool *cancelled, engine_ptr e)
+{
+    if (!cancelled || !*cancelled)
+        return false;
+
+    printf("Cancelled load of scene %s\n", s->name);
+    scene_destroy(s, e);
+    return true;
+}
+
 /*
  * Create a scene
+ * If cancelled is non-NULL it is checked between the setup steps, and
+ * once set the partially built scene is destroyed and NULL returned
  *
  * Call Context: Worker thread
  */
-scene_ptr scene_create(const char *scene_prefix, GLuint width, GLuint height, engine_ptr e)
+scene_ptr scene_create(const char *scene_prefix, GLuint width, GLuint height, const volatile bool *cancelled, engine_ptr e)
 {
+    TRACE_ZONE("scene_create");
+    if (cancelled && *cancelled)
+        return NULL;
+
     // Initialize scene
     scene_ptr s = calloc(1, sizeof(struct scene));
     assert(s);
+    s->name = strdup(scene_prefix);
+
+    // Mount the scene pack before anything is loaded
+    s->pack_path = calloc(strlen(scene_prefix) + 18, sizeof(char));
+    assert(s->pack_path);
+    sprintf(s->pack_path, "scenes/%s/scene.pack", scene_prefix);
+    s->pack_mounted = vfs_mount(engine_get_vfs(e), s->pack_path);
+
+    // Parse the walkmap on another worker while the script loads
+    struct scene_walkmap_job wj = {
+        .path = calloc(strlen(scene_prefix) + 17, sizeof(char)),
+        .s = s,
+        .e = e
+    };
+    assert(wj.path);
+    sprintf(wj.path, "scenes/%s/scene.map", scene_prefix);
+
+    job_batch_ptr walkmap_load = job_batch_create();
+    engine_queue_job(e, walkmap_load, scene_load_walkmap_job, &wj);
 
     // Load scene metadata
     char *scene_path = calloc(strlen(scene_prefix) + 17, sizeof(char));
     assert(scene_path);
     sprintf(scene_path, "scenes/%s/scene.lua", scene_prefix);
-    s->lua = luabridge_load(scene_path);
-
-    sprintf(scene_path, "scenes/%s/scene.map", scene_prefix);
-    s->walkmap = walkmap_create(scene_path, e);
+    s->lua = luabridge_load(scene_path, e, &s->script_saved);
+    scene_find_exit_calls(s, scene_path, e);
+    luabridge_parse_scene_neighbours(s->lua, s);
     free(scene_path);
 
     // Prepare camera and framebuffer
@@ -115,14 +382,46 @@ scene_ptr scene_create(const char *scene_prefix, GLuint width, GLuint height, en
 
     s->actors_tail = &s->actors;
     s->timeouts_tail = &s->timeouts;
+    s->snapshot_slots = SNAPSHOT_SLOTS(0, 1, 2);
+    pthread_mutex_init(&s->sim_mutex, NULL);
+
+    // Setup needs the walkmap for placing actors
+    engine_wait_jobs(e, walkmap_load);
+    job_batch_destroy(walkmap_load);
+    free(wj.path);
+
+    if (scene_abandon_if_cancelled(s, cancelled, e))
+        return NULL;
 
     // Run setup script
     luabridge_set_globals(s->lua, s, s->walkmap, e, true);
     luabridge_run_setup(s->lua, s);
     luabridge_clear_globals(s->lua);
 
+    // Exits are only added during setup
+    free(s->exit_calls);
+    s->exit_calls = NULL;
+    s->exit_call_count = 0;
+
+    // Setup only queues the layer and actor assets, which are
+    // read and decoded in parallel on the worker pool. Wait for
+    // the critical assets so that their upload tasks are queued
+    // before synchronizing. Deferred assets continue to load
+    // after the scene is shown, and are drawn once they are ready
+    for (struct layer_list *ll = s->layers; ll; ll = ll->next)
+        if (!ll->deferred)
+            layer_wait_loaded(ll->layer, e);
+
+    for (struct actor_list *al = s->actors; al; al = al->next)
+        if (!al->deferred)
+            actor_wait_loaded(al->actor, e);
+
+    if (scene_abandon_if_cancelled(s, cancelled, e))
+        return NULL;
+
     // Init framebuffer
     s->fb = framebuffer_create(s->width, s->height, e);
+    scene_publish_snapshot(s);
 
     // Block until all previous tasks have completed
     engine_synchronize_tasks(e);
@@ -131,11 +430,15 @@ scene_ptr scene_create(const char *scene_prefix, GLuint width, GLuint height, en
 
 /*
  * Destroy scene state
+ * GL objects are released by queued tasks, so scenes that
+ * are not being displayed may also be destroyed on a worker
  *
- * Call Context: Main thread
+ * Call Context: Main thread, or worker thread for scenes that are not displayed
  */
 void scene_destroy(scene_ptr s, engine_ptr e)
 {
+    scene_stop_simulation(s);
+
     for (struct layer_list *ll = s->layers, *next; ll; ll = next)
     {
         layer_destroy(ll->layer, e);
@@ -166,10 +469,147 @@ void scene_destroy(scene_ptr s, engine_ptr e)
     modelview_destroy(s->mv);
     lua_close(s->lua);
 
-    framebuffer_destroy(s->fb, e);
+    // Not created if the load was cancelled
+    if (s->fb)
+        framebuffer_destroy(s->fb, e);
+
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        free(s->snapshots[i].actors);
+        free(s->snapshots[i].layers);
+    }
+
+    pthread_mutex_destroy(&s->sim_mutex);
+
+    // Assets that are still open keep the pack mapped
+    if (s->pack_mounted)
+        vfs_unmount(engine_get_vfs(e), s->pack_path);
+    free(s->pack_path);
+
+    for (size_t i = 0; i < s->neighbour_count; i++)
+        free(s->neighbours[i].name);
+    free(s->neighbours);
+    free(s->exits);
+    free(s->exit_calls);
+    free(s->name);
     free(s);
 }
 
+struct scene_release_args
+{
+    scene_ptr s;
+    engine_ptr e;
+};
+
+static void scene_release_job(void *_args)
+{
+    struct scene_release_args *args = _args;
+    scene_destroy(args->s, args->e);
+    free(args);
+}
+
+/*
+ * Destroy a scene that is no longer displayed on a worker thread,
+ * keeping its teardown off the render thread
+ *
+ * Call Context: Main thread
+ */
+void scene_release(scene_ptr s, engine_ptr e)
+{
+    struct scene_release_args *args = calloc(1, sizeof(struct scene_release_args));
+    assert(args);
+    args->s = s;
+    args->e = e;
+    engine_queue_job(e, NULL, scene_release_job, args);
+}
+
+#pragma mark Render snapshots
+/*
+ * Copy the current render state into the write slot and publish it
+ *
+ * Call Context: Simulation thread
+ */
+static void scene_publish_snapshot(scene_ptr s)
+{
+    // Only the simulation changes the write slot
+    struct scene_snapshot *snap = &s->snapshots[SNAPSHOT_WRITE(s->snapshot_slots)];
+    snap->step_time = timer_now();
+    memcpy(snap->camera, s->camera_matrix, 16*sizeof(GLfloat));
+
+    snap->actor_count = 0;
+    for (struct actor_list *al = s->actors; al; al = al->next)
+    {
+        if (snap->actor_count == snap->actor_capacity)
+        {
+            snap->actor_capacity = snap->actor_capacity ? 2*snap->actor_capacity : 8;
+            snap->actors = realloc(snap->actors, snap->actor_capacity*sizeof(struct scene_actor_snapshot));
+            assert(snap->actors);
+        }
+
+        struct scene_actor_snapshot *as = &snap->actors[snap->actor_count];
+        as->actor = al->actor;
+        if (actor_get_states(al->actor, &as->prev, &as->cur))
+            snap->actor_count++;
+    }
+
+    snap->layer_count = 0;
+    for (struct layer_list *ll = s->layers; ll; ll = ll->next)
+    {
+        if (!layer_visible(ll->layer))
+            continue;
+
+        if (snap->layer_count == snap->layer_capacity)
+        {
+            snap->layer_capacity = snap->layer_capacity ? 2*snap->layer_capacity : 8;
+            snap->layers = realloc(snap->layers, snap->layer_capacity*sizeof(struct scene_layer_snapshot));
+            assert(snap->layers);
+        }
+
+        struct scene_layer_snapshot *ls = &snap->layers[snap->layer_count++];
+        ls->layer = ll->layer;
+        ls->frame = layer_frame(ll->layer);
+    }
+
+    // Swap the write and ready slots
+    uint32_t old, new;
+    __sync_synchronize();
+    do
+    {
+        old = s->snapshot_slots;
+        new = SNAPSHOT_SLOTS(SNAPSHOT_READY(old), SNAPSHOT_WRITE(old), SNAPSHOT_READ(old)) | SNAPSHOT_FRESH;
+    }
+    while (!__sync_bool_compare_and_swap(&s->snapshot_slots, old, new));
+}
+
+/*
+ * Return the most recently published snapshot
+ * The snapshot remains valid until the next call
+ *
+ * Call Context: Main thread
+ */
+static struct scene_snapshot *scene_acquire_snapshot(scene_ptr s)
+{
+    uint32_t old, new;
+    do
+    {
+        old = s->snapshot_slots;
+        if (!(old & SNAPSHOT_FRESH))
+            break;
+
+        // Swap the ready and read slots
+        new = SNAPSHOT_SLOTS(SNAPSHOT_WRITE(old), SNAPSHOT_READ(old), SNAPSHOT_READY(old));
+        if (__sync_bool_compare_and_swap(&s->snapshot_slots, old, new))
+        {
+            old = new;
+            break;
+        }
+    }
+    while (true);
+
+    __sync_synchronize();
+    return &s->snapshots[SNAPSHOT_READ(old)];
+}
+
 /*
  * Render scene into its framebuffer and return
  * a reference to the texture
@@ -189,27 +629,70 @@ void scene_destroy(scene_ptr s, engine_ptr e)
  *    (so that the z-sorting remains correct, otherwise fragments may be lost)
  */
 
-textureref scene_draw(scene_ptr s, engine_config_ptr ec, renderer_ptr r)
+textureref scene_draw(scene_ptr s, engine_ptr e, renderer_ptr r)
 {
+    TRACE_ZONE("scene_draw");
     assert(s);
+    engine_config_ptr ec = engine_get_config_ref(e);
+
+    struct scene_snapshot *snap = scene_acquire_snapshot(s);
+    modelview_set_camera(s->mv, snap->camera);
+
+    // Interpolate towards the snapshot over the following step
+    GLfloat alpha = s->sim_alpha;
+    if (s->sim_running)
+    {
+        alpha = (timer_now() - snap->step_time) / s->sim_timestep;
+        if (alpha > 1)
+            alpha = 1;
+    }
+
+    // Blend every animated actor at once, across the worker pool
+    if (renderer_cpu_animation(r) && snap->actor_count > 0)
+    {
+        model_instance_ptr *instances = calloc(snap->actor_count, sizeof(model_instance_ptr));
+        assert(instances);
+
+        size_t count = 0;
+        for (size_t i = 0; i < snap->actor_count; i++)
+        {
+            struct scene_actor_snapshot *as = &snap->actors[i];
+            if (actor_is_ready(as->actor))
+                instances[count++] = actor_update_animation(as->actor, &as->prev, &as->cur, alpha);
+        }
 
+        model_instances_blend(instances, count, e);
+        free(instances);
+    }
+
+    // Deferred assets are skipped until they have loaded
     framebuffer_bind(s->fb);
-    for (struct actor_list *al = s->actors; al; al = al->next)
-        actor_draw(al->actor, s->mv, r);
+    for (size_t i = 0; i < snap->actor_count; i++)
+    {
+        struct scene_actor_snapshot *as = &snap->actors[i];
+        if (actor_is_ready(as->actor))
+            actor_draw(as->actor, &as->prev, &as->cur, alpha, s->mv, r);
+    }
 
-    for (struct layer_list *ll = s->layers; ll; ll = ll->next)
-        layer_draw(ll->layer, s->mv, r);
+    for (size_t i = 0; i < snap->layer_count; i++)
+        if (layer_is_ready(snap->layers[i].layer))
+            layer_draw(snap->layers[i].layer, snap->layers[i].frame, s->mv, r);
 
     glDisable(GL_DEPTH_TEST);
     if (ec->debug_render_layer_mesh)
-        for (struct layer_list *ll = s->layers; ll; ll = ll->next)
-            layer_debug_draw(ll->layer, s->mv, r);
+        for (size_t i = 0; i < snap->layer_count; i++)
+            layer_debug_draw(snap->layers[i].layer, s->mv, r);
 
-    if (ec->debug_render_walkmesh)
-        walkmap_debug_draw_walkmesh(s->walkmap, s->mv, r);
+    if (ec->debug_render_walkmesh || ec->debug_render_collisions)
+    {
+        pthread_mutex_lock(&s->sim_mutex);
+        if (ec->debug_render_walkmesh)
+            walkmap_debug_draw_walkmesh(s->walkmap, s->mv, r);
 
-    if (ec->debug_render_collisions)
-        walkmap_debug_draw_collisions(s->walkmap, s->mv, r);
+        if (ec->debug_render_collisions)
+            walkmap_debug_draw_collisions(s->walkmap, s->mv, r);
+        pthread_mutex_unlock(&s->sim_mutex);
+    }
     glEnable(GL_DEPTH_TEST);
 
     framebuffer_unbind(s->fb);
@@ -223,10 +706,16 @@ static void trigger_zone_callback(scene_ptr s, actor_ptr a, int callback)
 }
 
 /*
- * Update the scene state
+ * Advance the scene state by a single fixed step
+ *
+ * Call Context: Simulation thread
  */
-void scene_tick(scene_ptr s, engine_ptr e, double dt)
+static void scene_step(scene_ptr s, engine_ptr e, double dt)
 {
+    TRACE_ZONE("scene_step");
+    for (struct actor_list *al = s->actors; al; al = al->next)
+        actor_store_state(al->actor);
+
     luabridge_set_globals(s->lua, s, s->walkmap, e, false);
 
     // Tick timed function callbacks
@@ -259,6 +748,283 @@ void scene_tick(scene_ptr s, engine_ptr e, double dt)
     luabridge_clear_globals(s->lua);
 }
 
+/*
+ * Update the scene state
+ * Runs as many fixed simulation steps as fit in the
+ * accumulated time, up to the configured limit.
+ * Does nothing if the scene simulates on its own thread
+ *
+ * Call Context: Main thread
+ */
+void scene_tick(scene_ptr s, engine_ptr e, double dt)
+{
+    if (s->sim_running)
+        return;
+
+    TRACE_ZONE("scene_tick");
+    engine_config_ptr ec = engine_get_config_ref(e);
+    double step = ec->sim_timestep;
+
+    s->sim_accumulator += dt;
+    for (uint8_t i = 0; s->sim_accumulator >= step; i++)
+    {
+        // Drop the remaining time rather than falling further
+        // behind when steps take longer than they simulate
+        if (i == ec->sim_max_substeps)
+        {
+            s->sim_accumulator = fmod(s->sim_accumulator, step);
+            break;
+        }
+
+        scene_step(s, e, step);
+        scene_publish_snapshot(s);
+        s->sim_accumulator -= step;
+    }
+
+    s->sim_alpha = s->sim_accumulator / step;
+}
+
+/*
+ * Run fixed simulation steps in real time until stopped
+ *
+ * Call Context: Simulation thread
+ */
+static void *scene_simulation_thread(void *_s)
+{
+    scene_ptr s = _s;
+    double step = s->sim_timestep;
+    double next = timer_now() + step;
+
+    while (!s->sim_stop)
+    {
+        double now = timer_now();
+        if (now < next)
+        {
+            usleep((next - now)*1e6);
+            continue;
+        }
+
+        // Drop the backlog if we have fallen too far behind
+        if (now - next > s->sim_max_substeps*step)
+            next = now;
+
+        pthread_mutex_lock(&s->sim_mutex);
+        scene_step(s, s->sim_engine, step);
+        scene_publish_snapshot(s);
+        pthread_mutex_unlock(&s->sim_mutex);
+        next += step;
+    }
+
+    return NULL;
+}
+
+/*
+ * Move the scene simulation to its own thread if enabled
+ * in the engine config. Otherwise the scene is stepped by scene_tick
+ *
+ * Call Context: Main thread
+ */
+void scene_start_simulation(scene_ptr s, engine_ptr e)
+{
+    engine_config_ptr ec = engine_get_config_ref(e);
+    if (s->sim_running || !ec->threaded_simulation)
+        return;
+
+    s->sim_timestep = ec->sim_timestep;
+    s->sim_max_substeps = ec->sim_max_substeps;
+    s->sim_engine = e;
+    s->sim_stop = false;
+    if (pthread_create(&s->sim_thread, NULL, scene_simulation_thread, s))
+    {
+        printf("Unable to create simulation thread. Simulating on the main thread\n");
+        return;
+    }
+
+    s->sim_running = true;
+}
+
+/*
+ * Stop the simulation thread (if running) and wait for it to exit
+ *
+ * Call Context: Main thread
+ */
+void scene_stop_simulation(scene_ptr s)
+{
+    if (!s->sim_running)
+        return;
+
+    s->sim_stop = true;
+    pthread_join(s->sim_thread, NULL);
+    s->sim_running = false;
+}
+
+/*
+ * Estimate the memory used by the scene's textures and framebuffer
+ *
+ * Call Context: Any thread
+ */
+size_t scene_memory_size(scene_ptr s)
+{
+    // RGBA8 color and a 32 bit depth buffer
+    size_t fb_size = framebuffer_size(s->width, s->height);
+    size_t size = fb_size*fb_size*8;
+
+    for (struct layer_list *ll = s->layers; ll; ll = ll->next)
+        size += layer_memory_size(ll->layer);
+
+    return size;
+}
+
+double scene_script_saved_time(scene_ptr s)
+{
+    return s->script_saved;
+}
+
+const char *scene_name(scene_ptr s)
+{
+    return s->name;
+}
+
+/*
+ * Mark a scene that is being left as suspended, so that it can be
+ * kept and resumed later instead of being loaded again.
+ * Returns false if the scene can't be resumed: the script must define
+ * a resume() function, as the player will still be standing in the
+ * trigger that left the scene
+ *
+ * Call Context: Main thread
+ */
+bool scene_suspend(scene_ptr s)
+{
+    assert(!s->sim_running);
+
+    // Deferred assets must have loaded for the memory size to be known
+    s->suspended = scene_is_loaded(s) && luabridge_has_function(s->lua, "resume");
+    return s->suspended;
+}
+
+/*
+ * Run the resume() script function of a suspended scene
+ * and publish the updated state for rendering.
+ * Does nothing if the scene wasn't suspended
+ *
+ * Call Context: Main thread
+ */
+void scene_resume(scene_ptr s, engine_ptr e)
+{
+    if (!s->suspended)
+        return;
+
+    luabridge_set_globals(s->lua, s, s->walkmap, e, false);
+    luabridge_run_resume(s->lua, s);
+    luabridge_clear_globals(s->lua);
+
+    // Actors moved by the script shouldn't be interpolated from their old positions
+    for (struct actor_list *al = s->actors; al; al = al->next)
+        actor_store_state(al->actor);
+
+    scene_publish_snapshot(s);
+    s->suspended = false;
+}
+
+/*
+ * Declare a scene that may be loaded from this one
+ *
+ * Call Context: Worker thread (during scene_create)
+ */
+void scene_add_neighbour(scene_ptr s, const char *name)
+{
+    scene_neighbour_index(s, name);
+}
+
+/*
+ * Return the scenes that may be loaded from this one,
+ * with the player's distance to the nearest exit leading
+ * to each, as of the most recently rendered snapshot
+ *
+ * Call Context: Main thread
+ */
+const struct scene_neighbour *scene_neighbours(scene_ptr s, size_t *count)
+{
+    // Only the main thread changes the read slot
+    struct scene_snapshot *snap = &s->snapshots[SNAPSHOT_READ(s->snapshot_slots)];
+    const GLfloat *player = NULL;
+    for (size_t i = 0; i < snap->actor_count && s->player; i++)
+        if (snap->actors[i].actor == s->player)
+            player = snap->actors[i].cur.position;
+
+    for (size_t i = 0; i < s->neighbour_count; i++)
+        s->neighbours[i].distance = INFINITY;
+
+    for (size_t i = 0; i < s->exit_count && player; i++)
+    {
+        struct scene_exit *ex = &s->exits[i];
+        GLfloat distance = hypotf(ex->position[0] - player[0], ex->position[1] - player[1]);
+        if (distance < s->neighbours[ex->neighbour].distance)
+            s->neighbours[ex->neighbour].distance = distance;
+    }
+
+    *count = s->neighbour_count;
+    return s->neighbours;
+}
+
+/*
+ * Set the actor that exit distances are measured from
+ *
+ * Call Context: Worker thread (during scene_create)
+ */
+void scene_set_player(scene_ptr s, actor_ptr a)
+{
+    s->player = a;
+}
+
+/*
+ * Set the priority of the layers and actors that are loaded next.
+ * Critical assets (the default) are loaded before the scene is
+ * shown. Deferred assets are loaded in the background afterwards,
+ * and appear once they are ready
+ *
+ * Call Context: Worker thread (during scene_create)
+ */
+void scene_set_load_deferred(scene_ptr s, bool deferred)
+{
+    s->load_deferred = deferred;
+}
+
+/*
+ * Check whether every asset, including deferred assets, can be drawn
+ *
+ * Call Context: Main thread
+ */
+bool scene_is_loaded(scene_ptr s)
+{
+    for (struct layer_list *ll = s->layers; ll; ll = ll->next)
+        if (!layer_is_ready(ll->layer))
+            return false;
+
+    for (struct actor_list *al = s->actors; al; al = al->next)
+        if (!actor_is_ready(al->actor))
+            return false;
+
+    return true;
+}
+
+/*
+ * Wait for the deferred assets to finish loading
+ *
+ * Call Context: Worker thread
+ */
+void scene_wait_loaded(scene_ptr s, engine_ptr e)
+{
+    for (struct layer_list *ll = s->layers; ll; ll = ll->next)
+        if (ll->deferred)
+            layer_wait_loaded(ll->layer, e);
+
+    for (struct actor_list *al = s->actors; al; al = al->next)
+        if (al->deferred)
+            actor_wait_loaded(al->actor, e);
+}
+
 /*
  * Fetch a copy of the camera_state struct
  */
@@ -269,21 +1035,22 @@ struct camera_state scene_camera(scene_ptr s)
 
 /*
  * Set the debug camera offset
+ * The new camera is rendered from the next snapshot
+ *
+ * Call Context: Simulation thread
  */
 void scene_update_camera(scene_ptr s, GPpolar offset)
 {
     s->camera.debug_offset = offset;
 
     // Position camera
-    GLfloat camera[16];
+    GLfloat *camera = s->camera_matrix;
     mtxLoadIdentity(camera);
     mtxTranslateApply(camera, 0, 0, -s->camera.debug_offset.radius);
     mtxRotateXApply(camera, -(s->camera.pitch + 90));
     mtxRotateZApply(camera, s->camera.yaw);
     mtxTranslateApply(camera, -s->camera.pos[0], -s->camera.pos[1], -s->camera.pos[2]);
     mtxRotateZApply(camera, s->camera.debug_offset.angle);
-
-    modelview_set_camera(s->mv, camera);
 }
 
 actor_ptr scene_load_actor(scene_ptr s, const char *model, GLfloat collision_radius, engine_ptr e)
@@ -292,6 +1059,7 @@ actor_ptr scene_load_actor(scene_ptr s, const char *model, GLfloat collision_rad
     assert(al);
 
     al->actor = actor_create(model, collision_radius, s->walkmap, e);
+    al->deferred = s->load_deferred;
     assert(al->actor);
 
     // Append to tail of list
@@ -308,6 +1076,7 @@ layer_ptr scene_load_layer(scene_ptr s, const char *image, GLfloat *screen_regio
     assert(ll);
 
     ll->layer = layer_create(image, screen_region, depth, frame_regions, frame_count, normal, &s->camera, e);
+    ll->deferred = s->load_deferred;
     assert(ll->layer);
 
     // Sort layers into the correct render order on insert
@@ -332,7 +1101,7 @@ layer_ptr scene_load_layer(scene_ptr s, const char *image, GLfloat *screen_regio
     while (cur->next)
     {
         GLfloat next_order = layer_render_order(cur->next->layer);
-        if (order <= cur_order && order >= next_order);
+        if (order <= cur_order && order >= next_order)
         {
             // Intermediate layer
             ll->next = cur->next;
@@ -349,9 +1118,38 @@ layer_ptr scene_load_layer(scene_ptr s, const char *image, GLfloat *screen_regio
     return ll->layer;
 }
 
-void scene_add_trigger_region(scene_ptr s, GLfloat pos[3], GLfloat *vertices, GLsizei vertex_count, int callback, engine_ptr e)
+/*
+ * Add a trigger region that runs callback when entered
+ * callback_lines are the first and last script lines of the
+ * callback, which are used to find the scenes that it loads
+ *
+ * Call Context: Worker thread (during scene_create)
+ */
+void scene_add_trigger_region(scene_ptr s, GLfloat pos[3], GLfloat *vertices, GLsizei vertex_count,
+                              int callback, int callback_lines[2], engine_ptr e)
 {
     walkmap_register_trigger_region(s->walkmap, pos, vertices, vertex_count, callback, e);
+
+    GLfloat center[2] = {0, 0};
+    for (GLsizei i = 0; i < vertex_count; i++)
+    {
+        center[0] += vertices[2*i]/vertex_count;
+        center[1] += vertices[2*i+1]/vertex_count;
+    }
+
+    for (size_t i = 0; i < s->exit_call_count; i++)
+    {
+        struct scene_exit_call *ec = &s->exit_calls[i];
+        if (ec->line < callback_lines[0] || ec->line > callback_lines[1])
+            continue;
+
+        s->exits = realloc(s->exits, (s->exit_count + 1)*sizeof(struct scene_exit));
+        assert(s->exits);
+        s->exits[s->exit_count++] = (struct scene_exit){
+            .neighbour = ec->neighbour,
+            .position = {pos[0] + center[0], pos[1] + center[1]}
+        };
+    }
 }
 
 void scene_add_timeout(scene_ptr s, int callback, GLfloat ms)
@@ -35,14 +35,40 @@ struct camera_state
     GPpolar debug_offset;
 };
 
-scene_ptr scene_create(const char *scene_path, GLuint resolution, GLuint aspect, engine_ptr e);
+// A scene that may be loaded from the current scene
+struct scene_neighbour
+{
+    char *name;
+
+    // Distance from the player to the nearest exit that
+    // loads this scene, or INFINITY if this isn't known
+    GLfloat distance;
+};
+
+scene_ptr scene_create(const char *scene_path, GLuint resolution, GLuint aspect, const volatile bool *cancelled, engine_ptr e);
 void scene_destroy(scene_ptr s, engine_ptr e);
+void scene_release(scene_ptr s, engine_ptr e);
 void scene_tick(scene_ptr s, engine_ptr e, double dt);
+void scene_start_simulation(scene_ptr s, engine_ptr e);
+void scene_stop_simulation(scene_ptr s);
+
+size_t scene_memory_size(scene_ptr s);
+const char *scene_name(scene_ptr s);
+double scene_script_saved_time(scene_ptr s);
+bool scene_suspend(scene_ptr s);
+void scene_resume(scene_ptr s, engine_ptr e);
+
+void scene_add_neighbour(scene_ptr s, const char *name);
+const struct scene_neighbour *scene_neighbours(scene_ptr s, size_t *count);
+void scene_set_player(scene_ptr s, actor_ptr a);
+void scene_set_load_deferred(scene_ptr s, bool deferred);
+void scene_wait_loaded(scene_ptr s, engine_ptr e);
+bool scene_is_loaded(scene_ptr s);
 
 struct camera_state scene_camera(scene_ptr s);
 void scene_update_camera(scene_ptr s, GPpolar offset);
 
-textureref scene_draw(scene_ptr s, engine_config_ptr ec, renderer_ptr r);
+textureref scene_draw(scene_ptr s, engine_ptr e, renderer_ptr r);
 
 actor_ptr scene_load_actor(scene_ptr s, const char *model, GLfloat collision_radius, engine_ptr e);
 void scene_add_actor(scene_ptr s, actor_ptr a);
@@ -51,7 +77,8 @@ void scene_remove_actor(scene_ptr s, actor_ptr a);
 layer_ptr scene_load_layer(scene_ptr s, const char *image, GLfloat *screen_region, GLfloat depth,
                            GLfloat *frame_regions, GLsizei frame_count, GLfloat *normal, engine_ptr e);
 
-void scene_add_trigger_region(scene_ptr s, GLfloat pos[3], GLfloat *vertices, GLsizei vertex_count, int callback, engine_ptr e);
+void scene_add_trigger_region(scene_ptr s, GLfloat pos[3], GLfloat *vertices, GLsizei vertex_count,
+                              int callback, int callback_lines[2], engine_ptr e);
 void scene_add_timeout(scene_ptr s, int callback, GLfloat ms);
 
 #endif
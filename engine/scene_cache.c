@@ -0,0 +1,447 @@
+/*
+ * This file is part of SceneFlipEngine.
+ * Copyright 2012, 2017 Paul Chote
+ *
+ * SceneFlipEngine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SceneFlipEngine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SceneFlipEngine.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Speculatively loaded scenes.
+ *
+ * The current scene reports the scenes that it may load next (its
+ * neighbours), along with the player's distance to the exit leading
+ * to each of them. Neighbours are built in the background one at a
+ * time, nearest first, and kept while they fit within the engine's
+ * prefetch_budget. A neighbour that hasn't been built before has an
+ * unknown size, so it is only built while no other neighbours are kept.
+ * Loading a neighbour then only needs to take the finished scene from
+ * the cache.
+ *
+ * Scenes that are left are suspended rather than destroyed, and the
+ * most recently used are kept (within suspended_scene_limit and
+ * suspended_scene_budget) so that returning to them resumes their
+ * previous state. A suspended scene that is also a neighbour of the
+ * current scene is kept under either rule.
+ *
+ * A prefetch that stops being wanted while it is still loading is
+ * cancelled, and the partially built scene is discarded by the worker.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "scene_cache.h"
+#include "engine.h"
+#include "worker_pool.h"
+#include "timer.h"
+
+struct scene_cache_entry
+{
+    char *name;
+
+    // Set by the load job, and valid once loaded is set.
+    // scene is NULL if the load was cancelled
+    scene_ptr scene;
+    job_batch_ptr load;
+    volatile bool loaded;
+    volatile bool cancelled;
+
+    // Estimated memory used by the scene once it has loaded, or
+    // zero if it hasn't been built yet. Kept if the scene is evicted,
+    // so that a scene that doesn't fit within the budget isn't loaded again
+    size_t memory_size;
+
+    // Set while scene_cache_take waits for the load to complete
+    bool claimed;
+
+    // Set for scenes that were left, and when they were last used
+    bool suspended;
+    uint32_t last_used;
+    bool retained;
+
+    // Priority from the most recent update
+    GLfloat distance;
+    bool wanted;
+    bool fits;
+
+    struct scene_cache_entry *next;
+};
+
+struct scene_cache
+{
+    GLuint width;
+    GLuint height;
+
+    struct scene_cache_entry *entries;
+    pthread_mutex_t mutex;
+
+    // Incremented for each suspended scene
+    uint32_t use_count;
+};
+
+struct scene_cache_job
+{
+    scene_cache_ptr c;
+    struct scene_cache_entry *entry;
+    engine_ptr e;
+};
+
+/*
+ * Build a neighbouring scene
+ *
+ * Call Context: Worker thread
+ */
+static void scene_cache_load_job(void *_j)
+{
+    struct scene_cache_job *j = _j;
+    struct scene_cache_entry *entry = j->entry;
+
+    double start = timer_now();
+    scene_ptr s = scene_create(entry->name, j->c->width, j->c->height, &entry->cancelled, j->e);
+    if (s)
+    {
+        // Nothing is shown until the scene is taken,
+        // so there is no need to stream in deferred assets
+        scene_wait_loaded(s, j->e);
+        entry->memory_size = scene_memory_size(s);
+        printf("Prefetched `%s' (%.1f MB) in %.1f ms\n", entry->name,
+               entry->memory_size/(1024.0*1024.0), (timer_now() - start)*1000);
+    }
+
+    entry->scene = s;
+    __sync_synchronize();
+    entry->loaded = true;
+    free(j);
+}
+
+static struct scene_cache_entry *find_entry(scene_cache_ptr c, const char *name)
+{
+    for (struct scene_cache_entry *entry = c->entries; entry; entry = entry->next)
+        if (!strcmp(entry->name, name))
+            return entry;
+
+    return NULL;
+}
+
+/*
+ * Release the scene and load state for an entry
+ * The entry must not have a load in progress.
+ * Scenes are destroyed on a worker if async is set
+ *
+ * Call Context: Main thread
+ */
+static void release_entry(struct scene_cache_entry *entry, bool async, engine_ptr e)
+{
+    // loaded is set by the job itself, so the batch may not
+    // have been released by the worker yet
+    if (entry->load)
+        engine_wait_jobs(e, entry->load);
+
+    if (entry->scene && async)
+        scene_release(entry->scene, e);
+    else if (entry->scene)
+        scene_destroy(entry->scene, e);
+
+    if (entry->load)
+        job_batch_destroy(entry->load);
+
+    entry->scene = NULL;
+    entry->load = NULL;
+    entry->loaded = false;
+    entry->cancelled = false;
+    entry->suspended = false;
+}
+
+/*
+ * Create an empty cache for scenes of the given resolution
+ *
+ * Call Context: Main thread
+ */
+scene_cache_ptr scene_cache_create(GLuint width, GLuint height)
+{
+    scene_cache_ptr c = calloc(1, sizeof(struct scene_cache));
+    assert(c);
+
+    c->width = width;
+    c->height = height;
+    pthread_mutex_init(&c->mutex, NULL);
+    return c;
+}
+
+/*
+ * Destroy the cache and any scenes it holds
+ *
+ * Call Context: Main thread
+ */
+void scene_cache_destroy(scene_cache_ptr c, engine_ptr e)
+{
+    for (struct scene_cache_entry *entry = c->entries, *next; entry; entry = next)
+    {
+        // The engine finishes all jobs before the frame is destroyed
+        if (entry->load)
+            engine_wait_jobs(e, entry->load);
+        release_entry(entry, false, e);
+
+        next = entry->next;
+        free(entry->name);
+        free(entry);
+    }
+
+    pthread_mutex_destroy(&c->mutex);
+    free(c);
+}
+
+/*
+ * Mark the most recently used suspended scenes that fit within
+ * the limits as retained. Scenes that are kept as neighbours
+ * don't count against the limits
+ */
+static void retain_suspended(scene_cache_ptr c, engine_config_ptr ec)
+{
+    size_t used = 0;
+    uint8_t count = 0;
+    for (struct scene_cache_entry *entry = c->entries; entry; entry = entry->next)
+        entry->retained = false;
+
+    while (true)
+    {
+        struct scene_cache_entry *newest = NULL;
+        for (struct scene_cache_entry *entry = c->entries; entry; entry = entry->next)
+            if (entry->suspended && !entry->retained && !(entry->wanted && entry->fits) &&
+                (!newest || entry->last_used > newest->last_used))
+                newest = entry;
+
+        if (!newest || count == ec->suspended_scene_limit ||
+            used + newest->memory_size > ec->suspended_scene_budget)
+            break;
+
+        newest->retained = true;
+        used += newest->memory_size;
+        count++;
+    }
+}
+
+/*
+ * Update the cache from the neighbours of the current scene.
+ * Scenes that are no longer neighbours, or that no longer fit within
+ * the budget once nearer neighbours are accounted for, are destroyed
+ * unless they are being kept as recently used suspended scenes.
+ * Loads of such scenes are cancelled. If no load is in progress,
+ * the nearest neighbour that fits is loaded
+ *
+ * Call Context: Main thread
+ */
+void scene_cache_update(scene_cache_ptr c, const struct scene_neighbour *neighbours, size_t count, engine_ptr e)
+{
+    engine_config_ptr ec = engine_get_config_ref(e);
+    size_t budget = ec->prefetch_budget;
+
+    pthread_mutex_lock(&c->mutex);
+    for (struct scene_cache_entry *entry = c->entries; entry; entry = entry->next)
+        entry->wanted = false;
+
+    // Neighbours in ascending distance order
+    struct scene_cache_entry **order = calloc(count + 1, sizeof(struct scene_cache_entry *));
+    assert(order);
+
+    size_t wanted_count = 0;
+    for (size_t i = 0; i < count && budget > 0; i++)
+    {
+        struct scene_cache_entry *entry = find_entry(c, neighbours[i].name);
+        if (!entry)
+        {
+            entry = calloc(1, sizeof(struct scene_cache_entry));
+            assert(entry);
+            entry->name = strdup(neighbours[i].name);
+            entry->next = c->entries;
+            c->entries = entry;
+        }
+
+        if (entry->wanted || entry->claimed)
+            continue;
+
+        entry->wanted = true;
+        entry->distance = neighbours[i].distance;
+
+        size_t j = wanted_count++;
+        for (; j > 0 && order[j - 1]->distance > entry->distance; j--)
+            order[j] = order[j - 1];
+        order[j] = entry;
+    }
+
+    // The size of a scene is only known once it has been built, so a
+    // scene of unknown size is only built when nothing else is using
+    // the budget, and reserves all of it until its size is known
+    size_t used = 0;
+    for (size_t i = 0; i < wanted_count; i++)
+    {
+        size_t size = order[i]->memory_size;
+        order[i]->fits = size ? used + size <= budget : used == 0;
+        if (order[i]->fits)
+            used += size ? size : budget;
+    }
+
+    retain_suspended(c, ec);
+
+    // Cancel loads and evict scenes that are no longer wanted.
+    // Cancelled loads are released once the job has finished
+    bool loading = false;
+    for (struct scene_cache_entry **pe = &c->entries; *pe;)
+    {
+        struct scene_cache_entry *entry = *pe;
+        bool keep = entry->claimed || (entry->wanted && entry->fits) || entry->retained;
+        if (entry->load && !entry->loaded)
+        {
+            if (!keep && !entry->cancelled)
+            {
+                printf("Cancelling prefetch of `%s'\n", entry->name);
+                entry->cancelled = true;
+            }
+
+            loading = true;
+            pe = &entry->next;
+            continue;
+        }
+
+        if (keep && !entry->cancelled)
+        {
+            pe = &entry->next;
+            continue;
+        }
+
+        if (entry->scene)
+            printf("Evicted %s `%s'\n", entry->suspended ? "suspended" : "prefetched", entry->name);
+        release_entry(entry, true, e);
+
+        if (entry->wanted)
+            pe = &entry->next;
+        else
+        {
+            *pe = entry->next;
+            free(entry->name);
+            free(entry);
+        }
+    }
+
+    // Load scenes one at a time so that prefetching
+    // competes as little as possible with the current scene
+    for (size_t i = 0; i < wanted_count && !loading; i++)
+    {
+        struct scene_cache_entry *entry = order[i];
+        if (!entry->fits || entry->load || entry->suspended)
+            continue;
+
+        struct scene_cache_job *j = calloc(1, sizeof(struct scene_cache_job));
+        assert(j);
+        j->c = c;
+        j->entry = entry;
+        j->e = e;
+
+        entry->load = job_batch_create();
+        engine_queue_job(e, entry->load, scene_cache_load_job, j);
+        loading = true;
+    }
+
+    pthread_mutex_unlock(&c->mutex);
+    free(order);
+}
+
+/*
+ * Remove a scene from the cache, returning NULL if it isn't cached.
+ * If the scene is still loading, wait for it to complete if wait
+ * is set, otherwise it is left in the cache and NULL is returned.
+ * The caller takes ownership of the returned scene
+ *
+ * Call Context: Main thread (wait = false) or worker thread
+ */
+scene_ptr scene_cache_take(scene_cache_ptr c, const char *name, bool wait, engine_ptr e)
+{
+    pthread_mutex_lock(&c->mutex);
+    struct scene_cache_entry *entry = find_entry(c, name);
+    if (!entry || !entry->load || entry->claimed || entry->cancelled || (!entry->loaded && !wait))
+    {
+        pthread_mutex_unlock(&c->mutex);
+        return NULL;
+    }
+
+    // Claimed entries are left alone by scene_cache_update
+    entry->claimed = true;
+    pthread_mutex_unlock(&c->mutex);
+    engine_wait_jobs(e, entry->load);
+    pthread_mutex_lock(&c->mutex);
+
+    for (struct scene_cache_entry **pe = &c->entries; *pe; pe = &(*pe)->next)
+        if (*pe == entry)
+        {
+            *pe = entry->next;
+            break;
+        }
+    pthread_mutex_unlock(&c->mutex);
+
+    scene_ptr s = entry->scene;
+    job_batch_destroy(entry->load);
+    free(entry->name);
+    free(entry);
+    return s;
+}
+
+/*
+ * Keep a scene that is being left so that it can be resumed later.
+ * The scene is destroyed if it can't be resumed, or if it is
+ * immediately evicted by the limits on suspended scenes
+ *
+ * Call Context: Main thread
+ */
+void scene_cache_suspend(scene_cache_ptr c, scene_ptr s, engine_ptr e)
+{
+    engine_config_ptr ec = engine_get_config_ref(e);
+    if (ec->suspended_scene_limit == 0 || !scene_suspend(s))
+    {
+        scene_release(s, e);
+        return;
+    }
+
+    pthread_mutex_lock(&c->mutex);
+    struct scene_cache_entry *entry = find_entry(c, scene_name(s));
+    if (entry && (entry->claimed || (entry->load && !entry->loaded)))
+    {
+        // Another copy of the scene is being loaded
+        pthread_mutex_unlock(&c->mutex);
+        scene_release(s, e);
+        return;
+    }
+
+    if (entry)
+        release_entry(entry, true, e);
+    else
+    {
+        entry = calloc(1, sizeof(struct scene_cache_entry));
+        assert(entry);
+        entry->name = strdup(scene_name(s));
+        entry->next = c->entries;
+        c->entries = entry;
+    }
+
+    // Suspended scenes are treated as loaded,
+    // using an empty batch in place of the load job
+    entry->scene = s;
+    entry->load = job_batch_create();
+    entry->loaded = true;
+    entry->memory_size = scene_memory_size(s);
+    entry->suspended = true;
+    entry->last_used = ++c->use_count;
+    pthread_mutex_unlock(&c->mutex);
+}
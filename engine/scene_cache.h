@@ -0,0 +1,31 @@
+/*
+ * This file is part of SceneFlipEngine.
+ * Copyright 2012, 2017 Paul Chote
+ *
+ * SceneFlipEngine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SceneFlipEngine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SceneFlipEngine.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GPEngine_scene_cache_h
+#define GPEngine_scene_cache_h
+
+#include "typedefs.h"
+#include "scene.h"
+
+scene_cache_ptr scene_cache_create(GLuint width, GLuint height);
+void scene_cache_destroy(scene_cache_ptr c, engine_ptr e);
+void scene_cache_update(scene_cache_ptr c, const struct scene_neighbour *neighbours, size_t count, engine_ptr e);
+scene_ptr scene_cache_take(scene_cache_ptr c, const char *name, bool wait, engine_ptr e);
+void scene_cache_suspend(scene_cache_ptr c, scene_ptr s, engine_ptr e);
+
+#endif
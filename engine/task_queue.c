@@ -0,0 +1,229 @@
+/*
+ * This file is part of SceneFlipEngine.
+ * Copyright 2012, 2017 Paul Chote
+ *
+ * SceneFlipEngine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SceneFlipEngine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SceneFlipEngine.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Lock-free multiple producer / single consumer task queue.
+ *
+ * Any number of worker threads may push tasks concurrently, but only
+ * a single thread (normally the main thread) may pop them.
+ * The queue always holds a "stub" node at the tail: a pushed task is
+ * stored in the node after the stub, and popping it turns that node
+ * into the new stub and recycles the old one.
+ *
+ * Nodes are recycled through a free list instead of being returned to
+ * the allocator. The free list links nodes by index rather than pointer
+ * so that its head can carry an update counter, which stops a stale
+ * compare-and-swap from succeeding if the head is popped and pushed
+ * again between a read and the swap (the ABA problem).
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+
+#include "task_queue.h"
+
+// Nodes are allocated in fixed-size chunks that are never freed
+// until the queue is destroyed. This bounds the number of
+// outstanding tasks to 65536, which is far beyond anything
+// a scene load should need.
+#define TASK_QUEUE_CHUNK_SIZE 256
+#define TASK_QUEUE_MAX_CHUNKS 256
+
+struct task_queue_node
+{
+    struct task task;
+    struct task_queue_node *volatile next;
+
+    // Position in the node pool, and the position (+1)
+    // of the next node in the free list
+    uint32_t index;
+    volatile uint32_t free_next;
+};
+
+struct task_queue
+{
+    // Producers append to head, the consumer removes from tail
+    struct task_queue_node *volatile head;
+    struct task_queue_node *tail;
+
+    // Low 32 bits hold the index (+1) of the first free node,
+    // or zero if the free list is empty.
+    // High 32 bits are incremented on every update
+    volatile uint64_t free_head;
+
+    struct task_queue_node *volatile chunks[TASK_QUEUE_MAX_CHUNKS];
+    volatile uint32_t chunk_count;
+};
+
+static inline struct task_queue_node *node_at(task_queue_ptr q, uint32_t index)
+{
+    return &q->chunks[index / TASK_QUEUE_CHUNK_SIZE][index % TASK_QUEUE_CHUNK_SIZE];
+}
+
+/*
+ * Return a node to the free list
+ *
+ * Call Context: Any thread
+ */
+static void free_node(task_queue_ptr q, struct task_queue_node *n)
+{
+    uint64_t head, next;
+    do
+    {
+        head = q->free_head;
+        n->free_next = (uint32_t)head;
+        next = (((head >> 32) + 1) << 32) | (n->index + 1);
+    }
+    while (!__sync_bool_compare_and_swap(&q->free_head, head, next));
+}
+
+/*
+ * Take a node from the free list, allocating a new chunk if it is empty
+ *
+ * Call Context: Any thread
+ */
+static struct task_queue_node *alloc_node(task_queue_ptr q)
+{
+    for (;;)
+    {
+        uint64_t head = q->free_head;
+        uint32_t top = (uint32_t)head;
+        if (!top)
+            break;
+
+        // n->free_next may be stale if another thread takes n first,
+        // but the counter ensures that the swap will then fail
+        struct task_queue_node *n = node_at(q, top - 1);
+        uint64_t next = (((head >> 32) + 1) << 32) | n->free_next;
+        if (__sync_bool_compare_and_swap(&q->free_head, head, next))
+            return n;
+    }
+
+    // Free list is empty: claim a new chunk
+    uint32_t c = __sync_fetch_and_add(&q->chunk_count, 1);
+    if (c >= TASK_QUEUE_MAX_CHUNKS)
+    {
+        printf("Task queue exhausted its %d node limit\n", TASK_QUEUE_CHUNK_SIZE*TASK_QUEUE_MAX_CHUNKS);
+        assert(FATAL_ERROR);
+    }
+
+    struct task_queue_node *chunk = calloc(TASK_QUEUE_CHUNK_SIZE, sizeof(struct task_queue_node));
+    assert(chunk);
+
+    for (uint32_t i = 0; i < TASK_QUEUE_CHUNK_SIZE; i++)
+        chunk[i].index = c*TASK_QUEUE_CHUNK_SIZE + i;
+
+    // The chunk must be visible before any of its nodes are
+    // published through the free list (the swaps in free_node
+    // are full barriers)
+    q->chunks[c] = chunk;
+    __sync_synchronize();
+
+    // Keep the first node, and make the rest available to others
+    for (uint32_t i = 1; i < TASK_QUEUE_CHUNK_SIZE; i++)
+        free_node(q, &chunk[i]);
+
+    return &chunk[0];
+}
+
+/*
+ * Create a task queue
+ */
+task_queue_ptr task_queue_create()
+{
+    task_queue_ptr q = calloc(1, sizeof(struct task_queue));
+    assert(q);
+
+    struct task_queue_node *stub = alloc_node(q);
+    stub->next = NULL;
+    q->head = q->tail = stub;
+
+    return q;
+}
+
+/*
+ * Destroy a task queue. Any unprocessed tasks are discarded
+ *
+ * Call Context: Consumer thread, after all producers have finished
+ */
+void task_queue_destroy(task_queue_ptr q)
+{
+    for (uint32_t i = 0; i < q->chunk_count && i < TASK_QUEUE_MAX_CHUNKS; i++)
+        free(q->chunks[i]);
+    free(q);
+}
+
+/*
+ * Append a task to the queue
+ *
+ * Call Context: Any thread
+ */
+void task_queue_push(task_queue_ptr q, const struct task *t)
+{
+    struct task_queue_node *n = alloc_node(q);
+    n->task = *t;
+    n->next = NULL;
+
+    // Make the node contents visible before it can be reached
+    // from the queue, then swap it in as the new head.
+    // The consumer will not see the node until prev->next is
+    // set, so a task pushed concurrently with a pop may only be
+    // picked up by the next call to task_queue_pop.
+    __sync_synchronize();
+    struct task_queue_node *prev = __sync_lock_test_and_set(&q->head, n);
+    prev->next = n;
+}
+
+/*
+ * Read the oldest task without removing it from the queue
+ * Returns false if the queue is empty
+ *
+ * Call Context: Consumer thread
+ */
+bool task_queue_peek(task_queue_ptr q, struct task *t)
+{
+    struct task_queue_node *next = q->tail->next;
+    if (!next)
+        return false;
+
+    __sync_synchronize();
+    *t = next->task;
+    return true;
+}
+
+/*
+ * Remove the oldest task from the queue
+ * Returns false if the queue is empty
+ *
+ * Call Context: Consumer thread
+ */
+bool task_queue_pop(task_queue_ptr q, struct task *t)
+{
+    struct task_queue_node *tail = q->tail;
+    struct task_queue_node *next = tail->next;
+    if (!next)
+        return false;
+
+    __sync_synchronize();
+    *t = next->task;
+
+    // next becomes the new stub node
+    q->tail = next;
+    free_node(q, tail);
+    return true;
+}
@@ -0,0 +1,44 @@
+/*
+ * This file is part of SceneFlipEngine.
+ * Copyright 2012, 2017 Paul Chote
+ *
+ * SceneFlipEngine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SceneFlipEngine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SceneFlipEngine.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GPEngine_task_queue_h
+#define GPEngine_task_queue_h
+
+#include "typedefs.h"
+
+struct task
+{
+    void (*func)(void *);
+    void *data;
+
+    // Static string identifying the task in traces
+    const char *name;
+
+    // Approximate number of bytes processed by the task,
+    // or zero if unknown. Used for estimating its cost
+    size_t size;
+};
+
+task_queue_ptr task_queue_create();
+void task_queue_destroy(task_queue_ptr q);
+
+void task_queue_push(task_queue_ptr q, const struct task *t);
+bool task_queue_peek(task_queue_ptr q, struct task *t);
+bool task_queue_pop(task_queue_ptr q, struct task *t);
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ * This file is part of SceneFlipEngine.
+ * Copyright 2012, 2017 Paul Chote
+ *
+ * SceneFlipEngine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SceneFlipEngine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SceneFlipEngine.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <time.h>
+#if __APPLE__
+#include <mach/mach_time.h>
+#endif
+
+#include "timer.h"
+
+/*
+ * Monotonic wall-clock time in seconds, measured from an arbitrary epoch.
+ * Unlike clock(), this is unaffected by the CPU usage of other threads
+ *
+ * Call Context: Any thread
+ */
+double timer_now()
+{
+#if __APPLE__
+    // clock_gettime is not available before OS X 10.12 / iOS 10
+    static double scale = 0;
+    if (scale == 0)
+    {
+        mach_timebase_info_data_t info;
+        mach_timebase_info(&info);
+        scale = 1e-9*info.numer/info.denom;
+    }
+
+    return mach_absolute_time()*scale;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+#endif
+}
@@ -0,0 +1,214 @@
+/*
+ * This file is part of SceneFlipEngine.
+ * Copyright 2012, 2017 Paul Chote
+ *
+ * SceneFlipEngine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SceneFlipEngine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SceneFlipEngine.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Lightweight scoped timing zones for diagnosing frame spikes.
+ *
+ * Each thread records completed zones into its own fixed-size ring
+ * buffer, so recording never takes a lock or allocates. The buffers
+ * are linked into a global list that is only ever appended to, and
+ * trace_dump walks this list to write the recent history of every
+ * thread in the Chrome trace event format (chrome://tracing).
+ *
+ * A buffer is released when its thread exits, and is reused by the
+ * next thread that records a zone.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+// Number of zones kept per thread
+#define TRACE_BUFFER_SIZE 8192
+
+struct trace_event
+{
+    const char *name;
+    double start;
+    double end;
+};
+
+struct trace_buffer
+{
+    uint32_t thread_id;
+    volatile uint32_t in_use;
+
+    // Total number of events written. The newest event
+    // is at index (count - 1) % TRACE_BUFFER_SIZE
+    volatile uint32_t count;
+    struct trace_event events[TRACE_BUFFER_SIZE];
+
+    struct trace_buffer *next;
+};
+
+static struct trace_buffer *volatile trace_buffers = NULL;
+static volatile uint32_t trace_thread_count = 0;
+static pthread_key_t trace_buffer_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Mark the buffer of an exiting thread as available for reuse
+ */
+static void release_buffer(void *_b)
+{
+    struct trace_buffer *b = _b;
+    __sync_synchronize();
+    b->in_use = 0;
+}
+
+static void create_key()
+{
+    pthread_key_create(&trace_buffer_key, release_buffer);
+}
+
+/*
+ * Find (or create) the ring buffer for the current thread
+ *
+ * Call Context: Any thread
+ */
+static struct trace_buffer *thread_buffer()
+{
+    pthread_once(&trace_key_once, create_key);
+    struct trace_buffer *b = pthread_getspecific(trace_buffer_key);
+    if (b)
+        return b;
+
+    // Reuse a buffer from a thread that has exited
+    for (b = trace_buffers; b; b = b->next)
+        if (!b->in_use && __sync_bool_compare_and_swap(&b->in_use, 0, 1))
+        {
+            b->count = 0;
+            break;
+        }
+
+    if (!b)
+    {
+        b = calloc(1, sizeof(struct trace_buffer));
+        assert(b);
+        b->in_use = 1;
+
+        struct trace_buffer *head;
+        do
+        {
+            head = trace_buffers;
+            b->next = head;
+        }
+        while (!__sync_bool_compare_and_swap(&trace_buffers, head, b));
+    }
+
+    b->thread_id = __sync_add_and_fetch(&trace_thread_count, 1);
+    pthread_setspecific(trace_buffer_key, b);
+    return b;
+}
+
+/*
+ * Record a completed zone
+ * Called automatically at the end of a TRACE_ZONE scope
+ *
+ * Call Context: Any thread
+ */
+void trace_zone_end(struct trace_zone *z)
+{
+    struct trace_buffer *b = thread_buffer();
+    uint32_t i = b->count;
+    struct trace_event *ev = &b->events[i % TRACE_BUFFER_SIZE];
+    ev->name = z->name;
+    ev->start = z->start;
+    ev->end = timer_now();
+
+    // Publish the event only once it has been written
+    __sync_synchronize();
+    b->count = i + 1;
+}
+
+/*
+ * Strip the directory from names of the form "path/to/file.c:function"
+ */
+static const char *display_name(const char *name)
+{
+    const char *slash = strrchr(name, '/');
+    return slash ? slash + 1 : name;
+}
+
+/*
+ * Write zones that ended within the last seconds to path
+ * as Chrome trace event JSON
+ *
+ * Call Context: Any thread
+ */
+bool trace_dump(const char *path, double seconds)
+{
+#if TRACE_ENABLED
+    FILE *output = fopen(path, "w");
+    if (!output)
+    {
+        printf("Unable to open trace file %s\n", path);
+        return false;
+    }
+
+    double now = timer_now();
+    double cutoff = now - seconds;
+    struct trace_event *events = calloc(TRACE_BUFFER_SIZE, sizeof(struct trace_event));
+    assert(events);
+
+    bool first = true;
+    fprintf(output, "{\"traceEvents\":[\n");
+    for (struct trace_buffer *b = trace_buffers; b; b = b->next)
+    {
+        // Copy the events out, then discard any that the owning
+        // thread may have overwritten while they were being copied
+        uint32_t end = b->count;
+        uint32_t copied = end > TRACE_BUFFER_SIZE ? end - TRACE_BUFFER_SIZE : 0;
+        __sync_synchronize();
+
+        for (uint32_t i = copied; i < end; i++)
+            events[i - copied] = b->events[i % TRACE_BUFFER_SIZE];
+
+        __sync_synchronize();
+        uint32_t written = b->count;
+        uint32_t valid = written > TRACE_BUFFER_SIZE ? written - TRACE_BUFFER_SIZE : 0;
+        if (valid < copied)
+            valid = copied;
+
+        for (uint32_t i = valid; i < end; i++)
+        {
+            struct trace_event *ev = &events[i - copied];
+            if (ev->end < cutoff)
+                continue;
+
+            // Timestamps are in microseconds relative to the start of the dump window
+            fprintf(output, "%s{\"name\":\"%s\",\"cat\":\"engine\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u}",
+                    first ? "" : ",\n", display_name(ev->name),
+                    (ev->start - cutoff)*1e6, (ev->end - ev->start)*1e6, b->thread_id);
+            first = false;
+        }
+    }
+    fprintf(output, "\n]}\n");
+
+    free(events);
+    fclose(output);
+    printf("Wrote %.1f s trace to %s\n", seconds, path);
+    return true;
+#else
+    printf("Tracing is disabled in this build\n");
+    return false;
+#endif
+}
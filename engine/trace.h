@@ -0,0 +1,53 @@
+/*
+ * This file is part of SceneFlipEngine.
+ * Copyright 2012, 2017 Paul Chote
+ *
+ * SceneFlipEngine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SceneFlipEngine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SceneFlipEngine.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GPEngine_trace_h
+#define GPEngine_trace_h
+
+#include "typedefs.h"
+#include "timer.h"
+
+// Build with TRACE_ENABLED=0 to compile out all trace zones
+#ifndef TRACE_ENABLED
+    #define TRACE_ENABLED 1
+#endif
+
+struct trace_zone
+{
+    const char *name;
+    double start;
+};
+
+void trace_zone_end(struct trace_zone *z);
+bool trace_dump(const char *path, double seconds);
+
+/*
+ * Record the time from this statement until the end of the enclosing
+ * scope. name must be a string with static storage duration
+ */
+#if TRACE_ENABLED
+    #define TRACE_CONCAT_INNER(a, b) a ## b
+    #define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+    #define TRACE_ZONE(zone_name) \
+        struct trace_zone TRACE_CONCAT(trace_zone_, __LINE__) \
+        __attribute__((cleanup(trace_zone_end))) = { .name = (zone_name), .start = timer_now() }
+#else
+    #define TRACE_ZONE(zone_name)
+#endif
+
+#endif
@@ -30,9 +30,13 @@
     #define glBindVertexArray glBindVertexArrayOES
     #define glGenVertexArrays glGenVertexArraysOES
     #define glDeleteVertexArrays glDeleteVertexArraysOES
-#else
+#elif __APPLE__
     #import <OpenGL/OpenGL.h>
     #import <OpenGL/gl3.h>
+#else
+    // Core profile desktop GL (used by the headless Linux runner)
+    #define GL_GLEXT_PROTOTYPES 1
+    #include <GL/glcorearb.h>
 #endif
 
 // Defines for assertions
@@ -58,6 +62,15 @@ typedef enum
     ANALOG_INPUT_CAMERA    = 1,
 } analog_input_type;
 
+// Main thread task classes, in the order that they are run.
+// A class is only processed once all higher priority classes are empty
+typedef enum
+{
+    TASK_PRIORITY_CHEAP  = 0, // Destruction and other trivial tasks
+    TASK_PRIORITY_UPLOAD = 1, // GL object creation and data upload
+    TASK_PRIORITY_MIPMAP = 2, // Mipmap generation for uploaded textures
+} task_priority;
+#define TASK_PRIORITY_COUNT 3
 
 typedef struct
 {
@@ -82,6 +95,7 @@ typedef struct walkmap *walkmap_ptr;
 typedef struct walkmap_actordata *walkmap_actordata_ptr;
 typedef struct actor *actor_ptr;
 typedef struct model *model_ptr;
+typedef struct model_instance *model_instance_ptr;
 typedef struct font *font_ptr;
 typedef struct font const *font_instance_ptr;
 
@@ -90,6 +104,12 @@ typedef struct widget_string *widget_string_ptr;
 
 typedef struct frame *frame_ptr;
 typedef struct vertexarray *vertexarray_ptr;
+typedef struct task_queue *task_queue_ptr;
+typedef struct worker_pool *worker_pool_ptr;
+typedef struct job_batch *job_batch_ptr;
+typedef struct vfs *vfs_ptr;
+typedef struct vfs_file *vfs_file_ptr;
+typedef struct scene_cache *scene_cache_ptr;
 
 // Defined in engine.h
 typedef struct engine_config *engine_config_ptr;
@@ -0,0 +1,437 @@
+/*
+ * This file is part of SceneFlipEngine.
+ * Copyright 2012, 2017 Paul Chote
+ *
+ * SceneFlipEngine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SceneFlipEngine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SceneFlipEngine.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Read-only virtual file layer for loading assets.
+ *
+ * Files are looked up in the mounted pack archives (most recently
+ * mounted first), and then on disk relative to the working directory.
+ * A pack is mapped once when it is mounted. Stored entries are returned
+ * in place from the mapping, and zlib compressed entries are inflated
+ * into memory when they are opened. Loose files are mapped directly.
+ *
+ * An open file keeps its pack mapped, so packs can be unmounted
+ * while files from them are still in use.
+ *
+ * .pack format:
+ *
+ * struct pack_header header;
+ * struct pack_entry entries[entry_count]; // sorted by name (strcmp order)
+ * char names[]; // NUL terminated
+ * entry data, each 16 byte aligned so that mappable formats
+ * (.mdl, .map, .tex) can be used in place
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "vfs.h"
+
+#define PACK_MAGIC 0x4B505047 // "GPPK"
+#define PACK_VERSION 1
+
+typedef enum
+{
+    PACK_ENTRY_ZLIB = (1 << 0),
+} pack_entry_flags;
+
+// Must match the definitions in GPModelConverter
+struct pack_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_count;
+    uint32_t names_size;
+};
+
+struct pack_entry
+{
+    uint32_t name_offset;
+    uint32_t flags;
+    uint32_t offset;
+    uint32_t stored_size;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+struct vfs_pack
+{
+    char *path;
+    void *mapping;
+    size_t mapping_size;
+    const struct pack_entry *entries;
+    const char *names;
+    uint32_t entry_count;
+
+    // Number of times the pack has been mounted
+    uint32_t mount_count;
+
+    // References from mounts and open files
+    volatile uint32_t refcount;
+
+    struct vfs_pack *next;
+};
+
+struct vfs
+{
+    // Mounted packs, most recently mounted first
+    struct vfs_pack *packs;
+    pthread_mutex_t mutex;
+};
+
+struct vfs_file
+{
+    const void *data;
+    size_t size;
+
+    // Set for files read from a pack
+    struct vfs_pack *pack;
+
+    // Set for inflated entries
+    void *buffer;
+
+    // Set for loose files
+    void *mapping;
+    size_t mapping_size;
+};
+
+#pragma mark Packs
+/*
+ * Map a pack and validate its index
+ *
+ * Call Context: Any thread
+ */
+static struct vfs_pack *pack_open(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    void *mapping = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size >= sizeof(struct pack_header))
+        mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    size_t size = st.st_size;
+    const struct pack_header *h = mapping;
+    const struct pack_entry *entries = (const struct pack_entry *)(h + 1);
+    const char *names = (const char *)&entries[h->entry_count];
+
+    bool valid = h->magic == PACK_MAGIC && h->version == PACK_VERSION &&
+        h->entry_count <= (size - sizeof(struct pack_header))/sizeof(struct pack_entry) &&
+        h->names_size > 0 && h->names_size <= size - ((const uint8_t *)names - (const uint8_t *)mapping) &&
+        names[h->names_size - 1] == '\0';
+
+    // Stored entries are used in place, so must keep their alignment
+    for (uint32_t i = 0; valid && i < h->entry_count; i++)
+        valid = entries[i].name_offset < h->names_size &&
+            entries[i].offset <= size && entries[i].stored_size <= size - entries[i].offset &&
+            ((entries[i].flags & PACK_ENTRY_ZLIB) ||
+             (entries[i].stored_size == entries[i].size && entries[i].offset % 16 == 0));
+
+    if (!valid)
+    {
+        printf("Ignoring invalid pack %s\n", path);
+        munmap(mapping, size);
+        return NULL;
+    }
+
+    struct vfs_pack *p = calloc(1, sizeof(struct vfs_pack));
+    assert(p);
+    p->path = strdup(path);
+    p->mapping = mapping;
+    p->mapping_size = size;
+    p->entries = entries;
+    p->names = names;
+    p->entry_count = h->entry_count;
+    return p;
+}
+
+static void pack_release(struct vfs_pack *p)
+{
+    if (__sync_sub_and_fetch(&p->refcount, 1) > 0)
+        return;
+
+    munmap(p->mapping, p->mapping_size);
+    free(p->path);
+    free(p);
+}
+
+/*
+ * Binary search the pack index for a file
+ */
+static const struct pack_entry *pack_find(struct vfs_pack *p, const char *path)
+{
+    uint32_t lo = 0, hi = p->entry_count;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo)/2;
+        int cmp = strcmp(path, p->names + p->entries[mid].name_offset);
+        if (cmp == 0)
+            return &p->entries[mid];
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return NULL;
+}
+
+/*
+ * Return the contents of a pack entry, inflating it if necessary
+ *
+ * Call Context: Any thread
+ */
+static bool pack_read_entry(struct vfs_pack *p, const struct pack_entry *pe, vfs_file_ptr f)
+{
+    const uint8_t *stored = (const uint8_t *)p->mapping + pe->offset;
+    f->size = pe->size;
+    if (!(pe->flags & PACK_ENTRY_ZLIB))
+    {
+        f->data = stored;
+        return true;
+    }
+
+    // Allocate at least one byte so that empty files have valid data
+    f->buffer = malloc(pe->size + 1);
+    assert(f->buffer);
+
+    uLongf size = pe->size;
+    if (uncompress(f->buffer, &size, stored, pe->stored_size) != Z_OK || size != pe->size)
+    {
+        printf("Unable to inflate %s from %s\n", p->names + pe->name_offset, p->path);
+        free(f->buffer);
+        return false;
+    }
+
+    f->data = f->buffer;
+    return true;
+}
+
+#pragma mark Public Interface
+/*
+ * Create a file layer with no packs mounted
+ *
+ * Call Context: Main thread
+ */
+vfs_ptr vfs_create()
+{
+    vfs_ptr v = calloc(1, sizeof(struct vfs));
+    assert(v);
+    pthread_mutex_init(&v->mutex, NULL);
+    return v;
+}
+
+/*
+ * Unmount all packs and destroy the file layer
+ * Files that are still open remain valid until closed
+ *
+ * Call Context: Main thread
+ */
+void vfs_destroy(vfs_ptr v)
+{
+    for (struct vfs_pack *p = v->packs, *next; p; p = next)
+    {
+        next = p->next;
+        pack_release(p);
+    }
+
+    pthread_mutex_destroy(&v->mutex);
+    free(v);
+}
+
+/*
+ * Map a pack and search it for files opened after this call
+ * Mounting a pack that is already mounted only counts the reference
+ * Returns false if the pack is missing or invalid
+ *
+ * Call Context: Any thread
+ */
+bool vfs_mount(vfs_ptr v, const char *pack_path)
+{
+    pthread_mutex_lock(&v->mutex);
+    for (struct vfs_pack *p = v->packs; p; p = p->next)
+        if (!strcmp(p->path, pack_path))
+        {
+            p->mount_count++;
+            pthread_mutex_unlock(&v->mutex);
+            return true;
+        }
+    pthread_mutex_unlock(&v->mutex);
+
+    // Validate the index without holding the lock
+    struct vfs_pack *p = pack_open(pack_path);
+    if (!p)
+        return false;
+
+    pthread_mutex_lock(&v->mutex);
+
+    // Another thread may have mounted the same pack in the meantime
+    for (struct vfs_pack *q = v->packs; q; q = q->next)
+        if (!strcmp(q->path, pack_path))
+        {
+            q->mount_count++;
+            pthread_mutex_unlock(&v->mutex);
+
+            munmap(p->mapping, p->mapping_size);
+            free(p->path);
+            free(p);
+            return true;
+        }
+
+    p->mount_count = 1;
+    p->refcount = 1;
+    p->next = v->packs;
+    v->packs = p;
+    pthread_mutex_unlock(&v->mutex);
+    return true;
+}
+
+/*
+ * Release a reference to a mounted pack
+ * The pack stops being searched once every mount has been released
+ *
+ * Call Context: Any thread
+ */
+void vfs_unmount(vfs_ptr v, const char *pack_path)
+{
+    pthread_mutex_lock(&v->mutex);
+    for (struct vfs_pack **pp = &v->packs; *pp; pp = &(*pp)->next)
+    {
+        struct vfs_pack *p = *pp;
+        if (strcmp(p->path, pack_path))
+            continue;
+
+        if (--p->mount_count == 0)
+        {
+            *pp = p->next;
+            pack_release(p);
+        }
+        break;
+    }
+    pthread_mutex_unlock(&v->mutex);
+}
+
+/*
+ * Open a file for reading
+ * Returns NULL if the file doesn't exist in any mounted pack or on disk
+ *
+ * Call Context: Any thread
+ */
+vfs_file_ptr vfs_open(vfs_ptr v, const char *path)
+{
+    vfs_file_ptr f = calloc(1, sizeof(struct vfs_file));
+    assert(f);
+
+    const struct pack_entry *pe = NULL;
+    pthread_mutex_lock(&v->mutex);
+    for (struct vfs_pack *p = v->packs; p && !pe; p = p->next)
+        if ((pe = pack_find(p, path)))
+        {
+            __sync_add_and_fetch(&p->refcount, 1);
+            f->pack = p;
+        }
+    pthread_mutex_unlock(&v->mutex);
+
+    if (f->pack)
+    {
+        if (pack_read_entry(f->pack, pe, f))
+            return f;
+
+        pack_release(f->pack);
+        free(f);
+        return NULL;
+    }
+
+    // Fall back to a loose file
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        free(f);
+        return NULL;
+    }
+
+    struct stat st;
+    bool valid = !fstat(fd, &st);
+    if (valid && st.st_size > 0)
+    {
+        f->mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        valid = f->mapping != MAP_FAILED;
+        f->mapping_size = st.st_size;
+        f->data = f->mapping;
+        f->size = st.st_size;
+    }
+    else if (valid)
+    {
+        // Empty files can't be mapped
+        f->mapping = NULL;
+        f->data = "";
+    }
+    close(fd);
+
+    if (!valid)
+    {
+        free(f);
+        return NULL;
+    }
+
+    return f;
+}
+
+/*
+ * Close a file, invalidating its data
+ *
+ * Call Context: Any thread
+ */
+void vfs_close(vfs_file_ptr f)
+{
+    if (f->mapping)
+        munmap(f->mapping, f->mapping_size);
+    free(f->buffer);
+    if (f->pack)
+        pack_release(f->pack);
+    free(f);
+}
+
+/*
+ * The file contents. Pack entries and loose files are
+ * aligned to at least 16 bytes
+ *
+ * Call Context: Any thread
+ */
+const void *vfs_file_data(vfs_file_ptr f)
+{
+    return f->data;
+}
+
+size_t vfs_file_size(vfs_file_ptr f)
+{
+    return f->size;
+}
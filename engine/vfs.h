@@ -0,0 +1,34 @@
+/*
+ * This file is part of SceneFlipEngine.
+ * Copyright 2012, 2017 Paul Chote
+ *
+ * SceneFlipEngine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SceneFlipEngine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SceneFlipEngine.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GPEngine_vfs_h
+#define GPEngine_vfs_h
+
+#include "typedefs.h"
+
+vfs_ptr vfs_create();
+void vfs_destroy(vfs_ptr v);
+bool vfs_mount(vfs_ptr v, const char *pack_path);
+void vfs_unmount(vfs_ptr v, const char *pack_path);
+
+vfs_file_ptr vfs_open(vfs_ptr v, const char *path);
+void vfs_close(vfs_file_ptr f);
+const void *vfs_file_data(vfs_file_ptr f);
+size_t vfs_file_size(vfs_file_ptr f);
+
+#endif
@@ -27,8 +27,11 @@
 #include "vertexarray.h"
 #include "scene.h"
 #include "walkmap.h"
+#include "walkmap_grid.h"
 #include "actor.h"
 #include "collision.h"
+#include "trace.h"
+#include "vfs.h"
 
 /*
  * Private implementation details
@@ -55,28 +58,6 @@ GLfloat *group_colors[] =
     (GLfloat[]){1,0,0,1},
 };
 
-struct walkmap_triangle
-{
-    // Read from file
-    uint16_t group;
-    uint16_t group_interaction_mask;
-
-    // Vertices
-    GLfloat a[3];
-    GLfloat b[3];
-    GLfloat c[3];
-
-    // Calculated at runtime
-    // Vectors from c to a,b
-    GLfloat ca[3];
-    GLfloat cb[3];
-
-    // 1 / determinant of transform to barycentric coords
-    GLfloat invdet;
-
-    collision_object_t co;
-};
-
 struct walkmap_border
 {
     uint16_t group;
@@ -103,9 +84,21 @@ struct trigger_region_list
 struct walkmap
 {
     // Walkmap mesh
-    struct walkmap_triangle *triangles;
+    const struct walkmap_triangle *triangles;
     uint32_t triangle_count;
 
+    // Uniform grid of triangles overlapping each cell, for hittests
+    const uint32_t *grid_cells;
+    const uint32_t *grid_triangles;
+    uint32_t grid_columns;
+    uint32_t grid_rows;
+    GLfloat grid_origin[2];
+    GLfloat grid_cell_size;
+
+    // Version 2 files are kept open and used in place.
+    // The arrays above are owned by the walkmap otherwise
+    vfs_file_ptr file;
+
     struct walkmap_border *borders;
     uint32_t border_count;
 
@@ -113,12 +106,14 @@ struct walkmap
     struct trigger_region_list *triggers;
     struct trigger_region_list **triggers_tail;
 
-    // For debug display
+    // For debug display. The walkmesh arrays are only
+    // created once the walkmesh is first drawn
     vertexarray_ptr actor_debug;
     vertexarray_ptr height_debug[16];
+    bool height_debug_created;
+    engine_ptr engine;
 
     // For box2d
-    collision_world_t walkmap_triangle_lookup;
     collision_world_t collision;
     collision_world_t trigger_lookup;
 };
@@ -128,40 +123,63 @@ struct walkmap_actordata
     actor_ptr actor;
     GLfloat position[3];
     GLfloat radius;
-    struct walkmap_triangle *current_triangle;
+    const struct walkmap_triangle *current_triangle;
     void (*movement_callback)(actor_ptr, GLfloat[3], GLfloat[3]);
     collision_object_t co;
 };
 
 /*
- * Calculate the height intersection for a given point
- * with the plane defined by the given triangle
+ * Calculate the barycentric coordinates u,v of a point
+ * in the xy projection of the given triangle
  */
-static GLfloat walkmap_triangle_height_at_point(struct walkmap_triangle *t, GLfloat xy[2])
+static void walkmap_triangle_barycentric(const struct walkmap_triangle *t, GLfloat xy[2], GLfloat *u, GLfloat *v)
 {
-    // Calculate barycentric coordinates u,v
     GLfloat dx = xy[0] - t->c[0];
     GLfloat dy = xy[1] - t->c[1];
-    GLfloat u =  t->invdet*(t->cb[1]*dx - t->cb[0]*dy);
-    GLfloat v = -t->invdet*(t->ca[1]*dx - t->ca[0]*dy);
+    *u =  t->invdet*(t->cb[1]*dx - t->cb[0]*dy);
+    *v = -t->invdet*(t->ca[1]*dx - t->ca[0]*dy);
+}
+
+/*
+ * Calculate the height intersection for a given point
+ * with the plane defined by the given triangle
+ */
+static GLfloat walkmap_triangle_height_at_point(const struct walkmap_triangle *t, GLfloat xy[2])
+{
+    GLfloat u, v;
+    walkmap_triangle_barycentric(t, xy, &u, &v);
 
     // Calculate w (height) from u,v
     return u*t->a[2] + v*t->b[2] + (1 - u - v)*t->c[2];
 }
 
-static void *walkmap_triangle_hittest_height_filter(void *current, void *test, void *callbackdata)
+/*
+ * Test whether a point lies inside (or on the edge of)
+ * the xy projection of the given triangle
+ */
+static bool walkmap_triangle_contains_point(const struct walkmap_triangle *t, GLfloat xy[2])
+{
+    // Allow for rounding errors on edges shared with neighbouring triangles
+    const GLfloat epsilon = 1e-5;
+
+    GLfloat u, v;
+    walkmap_triangle_barycentric(t, xy, &u, &v);
+    return u >= -epsilon && v >= -epsilon && u + v <= 1 + epsilon;
+}
+
+static const struct walkmap_triangle *walkmap_triangle_hittest_height_filter(const struct walkmap_triangle *current,
+                                                                             const struct walkmap_triangle *test, void *callbackdata)
 {
     GLfloat *pos = callbackdata;
 
-    GLfloat test_height = walkmap_triangle_height_at_point((struct walkmap_triangle *)test, pos);
-    GLfloat current_height = walkmap_triangle_height_at_point((struct walkmap_triangle *)current, pos);
+    GLfloat test_height = walkmap_triangle_height_at_point(test, pos);
+    GLfloat current_height = walkmap_triangle_height_at_point(current, pos);
     return (fabs(test_height - pos[2]) < fabs(current_height - pos[2])) ? test : current;
 }
 
-static void *walkmap_triangle_hittest_group_filter(void *_current, void *_test, void *callbackdata)
+static const struct walkmap_triangle *walkmap_triangle_hittest_group_filter(const struct walkmap_triangle *current,
+                                                                            const struct walkmap_triangle *test, void *callbackdata)
 {
-    struct walkmap_triangle *current = _current;
-    struct walkmap_triangle *test = _test;
     uint16_t group_mask = *((uint16_t *)callbackdata);
 
     // Matches collision group better than current match
@@ -172,20 +190,53 @@ static void *walkmap_triangle_hittest_group_filter(void *_current, void *_test,
     return current;
 }
 
+/*
+ * Find the triangle containing a point, using the grid to limit the search.
+ * filter chooses between triangles when several overlap the point
+ */
+typedef const struct walkmap_triangle *(*walkmap_hittest_filter)(const struct walkmap_triangle *,
+                                                                 const struct walkmap_triangle *, void *);
+static const struct walkmap_triangle *walkmap_hittest(walkmap_ptr w, GLfloat pos[2], walkmap_hittest_filter filter, void *callbackdata)
+{
+    GLfloat x = (pos[0] - w->grid_origin[0]) / w->grid_cell_size;
+    GLfloat y = (pos[1] - w->grid_origin[1]) / w->grid_cell_size;
+    if (!(x >= 0 && y >= 0 && x <= w->grid_columns && y <= w->grid_rows))
+        return NULL;
+
+    // Points on the far edges belong to the last cell
+    uint32_t column = (uint32_t)x < w->grid_columns ? (uint32_t)x : w->grid_columns - 1;
+    uint32_t row = (uint32_t)y < w->grid_rows ? (uint32_t)y : w->grid_rows - 1;
+    uint32_t cell = row*w->grid_columns + column;
+
+    const struct walkmap_triangle *match = NULL;
+    for (uint32_t i = w->grid_cells[cell]; i < w->grid_cells[cell + 1]; i++)
+    {
+        const struct walkmap_triangle *test = &w->triangles[w->grid_triangles[i]];
+        if (!walkmap_triangle_contains_point(test, pos))
+            continue;
+
+        // Accept the first triangle that passes the hittest,
+        // then let the filter choose between the others
+        match = match ? filter(match, test, callbackdata) : test;
+    }
+
+    return match;
+}
+
 static void update_actor_data(walkmap_ptr w, walkmap_actordata_ptr ad, bool prioritize_height)
 {
     GLfloat pos[2];
     collision_object_position(ad->co, pos);
-    struct walkmap_triangle *wt;
+    const struct walkmap_triangle *wt;
 
     // Filter based on closest z-separation, ignoring group
     if (prioritize_height)
-        wt = collision_world_hittest(w->walkmap_triangle_lookup, pos, walkmap_triangle_hittest_height_filter, ad->position);
+        wt = walkmap_hittest(w, pos, walkmap_triangle_hittest_height_filter, ad->position);
     else
     {
         // Filter based on group mask, ignoring height
         uint16_t mask = ad->current_triangle ? ad->current_triangle->group_interaction_mask : 0xFFFF;
-        wt = collision_world_hittest(w->walkmap_triangle_lookup, pos, walkmap_triangle_hittest_group_filter, &mask);
+        wt = walkmap_hittest(w, pos, walkmap_triangle_hittest_group_filter, &mask);
     }
 
     if (!wt)
@@ -195,11 +246,11 @@ static void update_actor_data(walkmap_ptr w, walkmap_actordata_ptr ad, bool prio
     }
 
     // Actor collison flags are set from the current triangle
-    collision_object_copy_collisiondata(ad->co, wt->co);
-
-    // Update current triangle ref
     if (wt != ad->current_triangle)
+    {
+        collision_object_set_collisiondata(ad->co, wt->group, wt->group_interaction_mask);
         ad->current_triangle = wt;
+    }
 
     // Update position
     ad->position[0] = pos[0];
@@ -207,21 +258,52 @@ static void update_actor_data(walkmap_ptr w, walkmap_actordata_ptr ad, bool prio
     ad->position[2] = walkmap_triangle_height_at_point(ad->current_triangle, ad->position);
 }
 
+#pragma mark Map Loading
 /*
- * Load mesh definition from file into the triangles array
- * and initializes the vertex array for debug display
+ * Cache intermediate quantities for calculating
+ * barycentric coordinates for height calculation
+ */
+static void walkmap_triangle_init(struct walkmap_triangle *wt)
+{
+    wt->ca[0] = wt->a[0] - wt->c[0];
+    wt->ca[1] = wt->a[1] - wt->c[1];
+    wt->cb[0] = wt->b[0] - wt->c[0];
+    wt->cb[1] = wt->b[1] - wt->c[1];
+    wt->invdet = 1.0/(wt->cb[1]*wt->ca[0] - wt->cb[0]*wt->ca[1]);
+}
+
+/*
+ * Build the triangle lookup grid for maps that don't include one
  *
  * Call Context: Worker thread
  */
-static void load_map(walkmap_ptr w, const char *map_path, engine_ptr e)
+static void build_grid(walkmap_ptr w)
+{
+    struct walkmap_grid grid;
+    walkmap_grid_build(w->triangles, w->triangle_count, &grid);
+
+    w->grid_cells = grid.cells;
+    w->grid_triangles = grid.triangles;
+    w->grid_columns = grid.columns;
+    w->grid_rows = grid.rows;
+    w->grid_origin[0] = grid.origin[0];
+    w->grid_origin[1] = grid.origin[1];
+    w->grid_cell_size = grid.cell_size;
+}
+
+/*
+ * Load a version 1 map into memory.
+ * Triangle and border vertices are copied out of the shared vertex array
+ * and a lookup grid is built, giving the same arrays as a version 2 file
+ *
+ * Call Context: Worker thread
+ */
+static bool load_map_v1(walkmap_ptr w, const void *file_data, size_t file_size,
+                        const struct walkmap_file_border **out_borders, const GLfloat **out_border_vertices)
 {
     /*
-     * .map format:
+     * Version 1 .map format (following the header):
      *
-     * uint32_t version
-     * uint32_t vertex_count
-     * uint32_t triangle_count;
-     * uint32_t border_count;
      * GLfloat vertices[3*vertex_count]; // x,y,z vertex data triplets
      * triangle_count x:
      *    uint16_t group;
@@ -233,108 +315,231 @@ static void load_map(walkmap_ptr w, const char *map_path, engine_ptr e)
      *    uint32_t length;
      *    uint32_t indices[length];
      */
-    FILE *input = fopen(map_path, "rb");
-    assert(input);
+    const struct walkmap_header *h = file_data;
+    if (h->triangle_count == 0)
+        return false;
 
-    // Read static header data
-    uint32_t version, vertex_count;
-    assert(fread(&version, sizeof(uint32_t), 1, input) == 1);
-    assert(fread(&vertex_count, sizeof(uint32_t), 1, input) == 1);
-    assert(fread(&w->triangle_count, sizeof(uint32_t), 1, input) == 1);
-    assert(fread(&w->border_count, sizeof(uint32_t), 1, input) == 1);
+    const uint8_t *data = (const uint8_t *)file_data + sizeof(struct walkmap_header);
+    size_t size = file_size - sizeof(struct walkmap_header);
 
-    // Read vertex data
-    GLfloat *vertices = calloc(3*vertex_count, sizeof(GLfloat));
-    assert(vertices);
-    assert(fread(vertices, sizeof(GLfloat), 3*vertex_count, input) == 3*vertex_count);
+    const GLfloat *vertices = (const GLfloat *)data;
+    size_t offset = 3*sizeof(GLfloat)*(size_t)h->vertex_count;
+    size_t triangles_size = 4*sizeof(uint32_t)*(size_t)h->triangle_count;
+    if (offset > size || triangles_size > size - offset)
+        return false;
 
-    // Read triangle data
-    w->triangles = calloc(w->triangle_count, sizeof(struct walkmap_triangle));
-    assert(w->triangles);
+    struct walkmap_triangle *triangles = calloc(h->triangle_count, sizeof(struct walkmap_triangle));
+    struct walkmap_file_border *borders = calloc(h->border_count, sizeof(struct walkmap_file_border));
+    assert(triangles && borders);
 
-    for (size_t i = 0; i < w->triangle_count; i++)
+    bool valid = true;
+    for (uint32_t i = 0; i < h->triangle_count && valid; i++, offset += 4*sizeof(uint32_t))
     {
-        struct walkmap_triangle *wt = &w->triangles[i];
-        assert(fread(&wt->group, sizeof(uint16_t), 1, input) == 1);
-        assert(wt->group < 16);
-        assert(fread(&wt->group_interaction_mask, sizeof(uint16_t), 1, input) == 1);
-
-        uint32_t indices[3];
-        assert(fread(&indices, sizeof(uint32_t), 3, input) == 3);
-        memcpy(wt->a, &vertices[3*indices[0]], 3*sizeof(GLfloat));
-        memcpy(wt->b, &vertices[3*indices[1]], 3*sizeof(GLfloat));
-        memcpy(wt->c, &vertices[3*indices[2]], 3*sizeof(GLfloat));
-
-        // Cache intermediate quantities for calculating
-        // barycentric coordinates for height calculation
-        wt->ca[0] = wt->a[0] - wt->c[0];
-        wt->ca[1] = wt->a[1] - wt->c[1];
-        wt->cb[0] = wt->b[0] - wt->c[0];
-        wt->cb[1] = wt->b[1] - wt->c[1];
-        wt->invdet = 1.0/(wt->cb[1]*wt->ca[0] - wt->cb[0]*wt->ca[1]);
-        wt->co = collision_object_create_triangle(w->walkmap_triangle_lookup, wt->a, wt->b, wt->c,
-                                                  wt->group, wt->group_interaction_mask, wt);
+        struct walkmap_triangle *wt = &triangles[i];
+        const uint32_t *indices = (const uint32_t *)(data + offset + 2*sizeof(uint16_t));
+        memcpy(&wt->group, data + offset, sizeof(uint16_t));
+        memcpy(&wt->group_interaction_mask, data + offset + sizeof(uint16_t), sizeof(uint16_t));
+
+        valid = wt->group < 16 && indices[0] < h->vertex_count &&
+            indices[1] < h->vertex_count && indices[2] < h->vertex_count;
+        if (valid)
+        {
+            memcpy(wt->a, &vertices[3*indices[0]], 3*sizeof(GLfloat));
+            memcpy(wt->b, &vertices[3*indices[1]], 3*sizeof(GLfloat));
+            memcpy(wt->c, &vertices[3*indices[2]], 3*sizeof(GLfloat));
+            walkmap_triangle_init(wt);
+        }
     }
 
-    // Generate debug mesh vertex arrays
-    for (size_t j = 0; j < 16; j++)
+    // Find the border lengths so the vertices can be stored contiguously
+    uint32_t border_vertex_count = 0;
+    size_t border_offset = offset;
+    for (uint32_t i = 0; i < h->border_count && valid; i++)
     {
-        uint32_t count = 0;
-        for (size_t i = 0; i < w->triangle_count; i++)
-            if (w->triangles[i].group == j)
-                count++;
+        struct walkmap_file_border *wb = &borders[i];
+        valid = size - offset >= 2*sizeof(uint32_t);
+        if (!valid)
+            break;
+
+        memcpy(&wb->group, data + offset, sizeof(uint16_t));
+        memcpy(&wb->group_interaction_mask, data + offset + sizeof(uint16_t), sizeof(uint16_t));
+        memcpy(&wb->length, data + offset + sizeof(uint32_t), sizeof(uint32_t));
+        offset += 2*sizeof(uint32_t);
+
+        wb->first_vertex = border_vertex_count;
+        border_vertex_count += wb->length;
+        valid = wb->group < 16 && wb->length <= (size - offset)/sizeof(uint32_t);
+        offset += wb->length*sizeof(uint32_t);
+    }
 
-        if (count == 0)
-            continue;
+    GLfloat *border_vertices = calloc(3*(size_t)border_vertex_count + 1, sizeof(GLfloat));
+    assert(border_vertices);
 
-        GLfloat *mesh_vertices = calloc(9*count, sizeof(GLfloat));
-        assert(mesh_vertices);
+    offset = border_offset;
+    for (uint32_t i = 0; i < h->border_count && valid; i++)
+    {
+        const uint32_t *indices = (const uint32_t *)(data + offset + 2*sizeof(uint32_t));
+        for (uint32_t j = 0; j < borders[i].length && valid; j++)
+        {
+            valid = indices[j] < h->vertex_count;
+            if (valid)
+                memcpy(&border_vertices[3*(borders[i].first_vertex + j)], &vertices[3*indices[j]], 3*sizeof(GLfloat));
+        }
+        offset += (2 + borders[i].length)*sizeof(uint32_t);
+    }
 
-        for (size_t k = 0, i = 0; i < w->triangle_count; i++)
-            if (w->triangles[i].group == j)
-            {
-                struct walkmap_triangle *wt = &w->triangles[i];
-                memcpy(&mesh_vertices[9*k], wt->a, 3*sizeof(GLfloat));
-                memcpy(&mesh_vertices[9*k+3], wt->b, 3*sizeof(GLfloat));
-                memcpy(&mesh_vertices[9*k+6], wt->c, 3*sizeof(GLfloat));
-                k++;
-            }
+    if (!valid)
+    {
+        free(triangles);
+        free(borders);
+        free(border_vertices);
+        return false;
+    }
+
+    w->triangles = triangles;
+    w->triangle_count = h->triangle_count;
+    w->border_count = h->border_count;
+    build_grid(w);
+
+    *out_borders = borders;
+    *out_border_vertices = border_vertices;
+    return true;
+}
+
+/*
+ * Point the walkmap arrays into the contents of a version 2 file
+ *
+ * Call Context: Worker thread
+ */
+static bool map_map_v2(walkmap_ptr w, const void *data, size_t size,
+                       const struct walkmap_file_border **out_borders, const GLfloat **out_border_vertices)
+{
+    const struct walkmap_header_v2 *h = data;
+    if (size < sizeof(struct walkmap_header_v2))
+        return false;
+
+    size_t cell_count = (size_t)h->grid_columns*h->grid_rows;
+    struct
+    {
+        uint32_t offset;
+        size_t length;
+    } arrays[] =
+    {
+        {h->triangle_offset, sizeof(struct walkmap_triangle)*(size_t)h->base.triangle_count},
+        {h->border_offset, sizeof(struct walkmap_file_border)*(size_t)h->base.border_count},
+        {h->border_vertex_offset, 3*sizeof(GLfloat)*(size_t)h->border_vertex_count},
+        {h->grid_cell_offset, sizeof(uint32_t)*(cell_count + 1)},
+        {h->grid_triangle_offset, sizeof(uint32_t)*(size_t)h->grid_triangle_count},
+    };
+
+    for (size_t i = 0; i < sizeof(arrays)/sizeof(arrays[0]); i++)
+        if (arrays[i].offset % 16 || arrays[i].offset > size || arrays[i].length > size - arrays[i].offset)
+            return false;
+
+    const uint8_t *base = data;
+    const uint32_t *cells = (const uint32_t *)(base + h->grid_cell_offset);
+    if (cell_count == 0 || !(h->grid_cell_size > 0) || cells[cell_count] != h->grid_triangle_count)
+        return false;
+
+    const struct walkmap_file_border *borders = (const struct walkmap_file_border *)(base + h->border_offset);
+    for (uint32_t i = 0; i < h->base.border_count; i++)
+        if (borders[i].group >= 16 || borders[i].first_vertex > h->border_vertex_count ||
+            borders[i].length > h->border_vertex_count - borders[i].first_vertex)
+            return false;
+
+    // Hit tests index the triangles through the grid without checking
+    const struct walkmap_triangle *triangles = (const struct walkmap_triangle *)(base + h->triangle_offset);
+    for (uint32_t i = 0; i < h->base.triangle_count; i++)
+        if (triangles[i].group >= 16)
+            return false;
+
+    for (size_t i = 0; i < cell_count; i++)
+        if (cells[i] > cells[i + 1])
+            return false;
+
+    const uint32_t *grid_triangles = (const uint32_t *)(base + h->grid_triangle_offset);
+    for (uint32_t i = 0; i < h->grid_triangle_count; i++)
+        if (grid_triangles[i] >= h->base.triangle_count)
+            return false;
+
+    w->triangles = triangles;
+    w->triangle_count = h->base.triangle_count;
+    w->border_count = h->base.border_count;
+    w->grid_cells = cells;
+    w->grid_triangles = grid_triangles;
+    w->grid_columns = h->grid_columns;
+    w->grid_rows = h->grid_rows;
+    w->grid_origin[0] = h->grid_origin[0];
+    w->grid_origin[1] = h->grid_origin[1];
+    w->grid_cell_size = h->grid_cell_size;
+
+    *out_borders = borders;
+    *out_border_vertices = (const GLfloat *)(base + h->border_vertex_offset);
+    return true;
+}
+
+/*
+ * Load mesh definition from file into the triangles array
+ * and create the border chains.
+ * Version 2 files are used in place from the mapped file (or pack)
+ *
+ * Call Context: Worker thread
+ */
+static void load_map(walkmap_ptr w, const char *map_path, engine_ptr e)
+{
+    vfs_file_ptr file = vfs_open(engine_get_vfs(e), map_path);
+    assert(file);
 
-        w->height_debug[j] = vertexarray_create(mesh_vertices, NULL, 3*count, 0, GL_TRIANGLES, e);
-        free(mesh_vertices);
+    const void *data = vfs_file_data(file);
+    size_t size = vfs_file_size(file);
+    if (size < sizeof(struct walkmap_header))
+    {
+        printf("Unable to read walkmap header from %s\n", map_path);
+        assert(FATAL_ERROR);
     }
 
-    // Read border data
+    const struct walkmap_file_border *borders = NULL;
+    const GLfloat *border_vertices = NULL;
+    bool valid = false;
+    uint32_t version = ((const struct walkmap_header *)data)->version;
+    if (version == 2)
+        valid = map_map_v2(w, data, size, &borders, &border_vertices);
+    else if (version == 1)
+        valid = load_map_v1(w, data, size, &borders, &border_vertices);
+
+    // Version 1 data has been copied out of the file
+    if (valid && version == 2)
+        w->file = file;
+    else
+        vfs_close(file);
+
+    if (!valid)
+    {
+        printf("Invalid or unsupported walkmap file %s\n", map_path);
+        assert(FATAL_ERROR);
+    }
+
+    // Create border chains
     w->borders = calloc(w->border_count, sizeof(struct walkmap_border));
-    assert(w->borders);
+    assert(w->borders || w->border_count == 0);
 
     for (size_t j = 0; j < w->border_count; j++)
     {
         struct walkmap_border *wb = &w->borders[j];
-        assert(fread(&wb->group, sizeof(uint16_t), 1, input) == 1);
-        assert(wb->group < 16);
-        assert(fread(&wb->group_interaction_mask, sizeof(uint16_t), 1, input) == 1);
-
-        GLsizei length;
-        assert(fread(&length, sizeof(uint32_t), 1, input) == 1);
+        wb->group = borders[j].group;
+        wb->group_interaction_mask = borders[j].group_interaction_mask;
 
-        GLfloat *border_vertices = calloc(3*length, sizeof(GLfloat));
-        assert(border_vertices);
-
-        for (GLuint i = 0; i < length; i++)
-        {
-            uint32_t index;
-            assert(fread(&index, sizeof(uint32_t), 1, input) == 1);
-            memcpy(&border_vertices[3*i], &vertices[3*index], 3*sizeof(GLfloat));
-        }
-
-        wb->co = collision_object_create_chain(w->collision, border_vertices, length,
+        GLfloat *vertices = (GLfloat *)&border_vertices[3*borders[j].first_vertex];
+        wb->co = collision_object_create_chain(w->collision, vertices, borders[j].length,
                                                wb->group, wb->group_interaction_mask, NULL);
-        wb->border_debug = vertexarray_create(border_vertices, NULL, length, 0, GL_LINE_STRIP, e);
+        wb->border_debug = vertexarray_create(vertices, NULL, borders[j].length, 0, GL_LINE_STRIP, e);
     }
 
-    free(vertices);
-    fclose(input);
+    if (!w->file)
+    {
+        free((void *)borders);
+        free((void *)border_vertices);
+    }
 
     GLfloat circle_vertices[48];
     for (size_t i = 0; i < 16; i++)
@@ -358,10 +563,10 @@ walkmap_ptr walkmap_create(const char *map_path, engine_ptr e)
     assert(w);
 
     // We don't use gravity
-    w->walkmap_triangle_lookup = collision_world_create();
     w->collision = collision_world_create();
     w->trigger_lookup = collision_world_create();
     w->triggers_tail = &w->triggers;
+    w->engine = e;
 
     // Temporary hack: hardcode map definition
     load_map(w, map_path, e);
@@ -383,13 +588,16 @@ void walkmap_destroy(walkmap_ptr w, engine_ptr e)
     assert(collision_world_count(w->collision) == 0);
     collision_world_free(w->collision);
 
-    for (size_t i = 0; i < w->triangle_count; i++)
-        collision_object_free(w->triangles[i].co, w->walkmap_triangle_lookup);
+    free(w->borders);
 
-    free(w->triangles);
-
-    assert(collision_world_count(w->walkmap_triangle_lookup) == 0);
-    collision_world_free(w->walkmap_triangle_lookup);
+    if (w->file)
+        vfs_close(w->file);
+    else
+    {
+        free((void *)w->triangles);
+        free((void *)w->grid_cells);
+        free((void *)w->grid_triangles);
+    }
 
     for (struct trigger_region_list *tr = w->triggers, *next; tr; tr = next)
     {
@@ -484,9 +692,53 @@ void walkmap_debug_draw_collisions(walkmap_ptr w, modelview_ptr mv, renderer_ptr
 #endif
 }
 
+#if !PLATFORM_GLES
+/*
+ * Create the walkmesh debug vertex arrays, one per triangle group
+ *
+ * Call Context: Main thread
+ */
+static void create_height_debug(walkmap_ptr w)
+{
+    uint32_t group_counts[16] = {0};
+    for (size_t i = 0; i < w->triangle_count; i++)
+        group_counts[w->triangles[i].group]++;
+
+    GLfloat *group_vertices[16] = {NULL};
+    for (size_t j = 0; j < 16; j++)
+        if (group_counts[j])
+        {
+            group_vertices[j] = calloc(9*group_counts[j], sizeof(GLfloat));
+            assert(group_vertices[j]);
+            group_counts[j] = 0;
+        }
+
+    for (size_t i = 0; i < w->triangle_count; i++)
+    {
+        const struct walkmap_triangle *wt = &w->triangles[i];
+        GLfloat *v = &group_vertices[wt->group][9*group_counts[wt->group]++];
+        memcpy(&v[0], wt->a, 3*sizeof(GLfloat));
+        memcpy(&v[3], wt->b, 3*sizeof(GLfloat));
+        memcpy(&v[6], wt->c, 3*sizeof(GLfloat));
+    }
+
+    for (size_t j = 0; j < 16; j++)
+        if (group_vertices[j])
+        {
+            w->height_debug[j] = vertexarray_create(group_vertices[j], NULL, 3*group_counts[j], 0, GL_TRIANGLES, w->engine);
+            free(group_vertices[j]);
+        }
+
+    w->height_debug_created = true;
+}
+#endif
+
 void walkmap_debug_draw_walkmesh(walkmap_ptr w, modelview_ptr mv, renderer_ptr r)
 {
 #if !PLATFORM_GLES
+    if (!w->height_debug_created)
+        create_height_debug(w);
+
     GLfloat mvp[16];
     modelview_push(mv);
     modelview_calculate_mvp(mv, mvp);
@@ -507,6 +759,7 @@ void walkmap_debug_draw_walkmesh(walkmap_ptr w, modelview_ptr mv, renderer_ptr r
 
 void walkmap_tick(walkmap_ptr w, double dt)
 {
+    TRACE_ZONE("walkmap_tick");
     collision_world_tick(w->collision, dt);
     collision_iterator_t it = collision_iterator_create(w->collision);
     while (!collision_iterator_finished(it))
@@ -606,7 +859,7 @@ void walkmap_register_trigger_region(walkmap_ptr w, GLfloat pos[3], GLfloat *ver
     memcpy(tr->position, pos, 3*sizeof(GLfloat));
 
     // Filter based on closest z-separation, ignoring group
-    struct walkmap_triangle *wt = collision_world_hittest(w->walkmap_triangle_lookup, pos, walkmap_triangle_hittest_height_filter, pos);
+    const struct walkmap_triangle *wt = walkmap_hittest(w, pos, walkmap_triangle_hittest_height_filter, pos);
     if (!wt)
     {
         fprintf(stderr, "Trigger zone outside walkmap");
@@ -0,0 +1,113 @@
+/*
+ * This file is part of SceneFlipEngine.
+ * Copyright 2012, 2017 Paul Chote
+ *
+ * SceneFlipEngine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SceneFlipEngine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SceneFlipEngine.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "walkmap_grid.h"
+
+/*
+ * Bin triangles into a uniform grid of roughly one cell per triangle.
+ * The cell and triangle arrays are allocated, and owned by the caller
+ *
+ * Call Context: Any thread
+ */
+void walkmap_grid_build(const struct walkmap_triangle *triangles, uint32_t triangle_count, struct walkmap_grid *grid)
+{
+    float min[2] = {INFINITY, INFINITY};
+    float max[2] = {-INFINITY, -INFINITY};
+    for (uint32_t i = 0; i < triangle_count; i++)
+    {
+        const struct walkmap_triangle *wt = &triangles[i];
+        for (uint8_t j = 0; j < 2; j++)
+        {
+            min[j] = fminf(min[j], fminf(wt->a[j], fminf(wt->b[j], wt->c[j])));
+            max[j] = fmaxf(max[j], fmaxf(wt->a[j], fmaxf(wt->b[j], wt->c[j])));
+        }
+    }
+
+    // Aim for roughly one cell per triangle
+    float width = max[0] - min[0];
+    float height = max[1] - min[1];
+    float cell_size = sqrtf(width*height/triangle_count);
+    cell_size = fmaxf(cell_size, fmaxf(width, height)/1024);
+    if (!(cell_size > 0))
+        cell_size = 1;
+
+    grid->origin[0] = min[0];
+    grid->origin[1] = min[1];
+    grid->cell_size = cell_size;
+    grid->columns = (uint32_t)(width/cell_size) + 1;
+    grid->rows = (uint32_t)(height/cell_size) + 1;
+
+    uint32_t cell_count = grid->columns*grid->rows;
+    uint32_t *cells = calloc(cell_count + 1, sizeof(uint32_t));
+    assert(cells);
+
+    // Count the triangles overlapping each cell, then convert
+    // the counts into offsets and fill in the triangle lists
+    uint32_t *cell_triangles = NULL;
+    for (uint8_t pass = 0; pass < 2; pass++)
+    {
+        for (uint32_t i = 0; i < triangle_count; i++)
+        {
+            const struct walkmap_triangle *wt = &triangles[i];
+            uint32_t first[2], last[2];
+            for (uint8_t j = 0; j < 2; j++)
+            {
+                // Pad the bounds to match the hittest edge tolerance
+                float lo = fminf(wt->a[j], fminf(wt->b[j], wt->c[j]));
+                float hi = fmaxf(wt->a[j], fmaxf(wt->b[j], wt->c[j]));
+                uint32_t limit = (j == 0 ? grid->columns : grid->rows) - 1;
+                first[j] = (uint32_t)fmaxf(0, (lo - grid->origin[j])/cell_size - 1e-3);
+                last[j] = (uint32_t)fmaxf(0, (hi - grid->origin[j])/cell_size + 1e-3);
+                first[j] = first[j] < limit ? first[j] : limit;
+                last[j] = last[j] < limit ? last[j] : limit;
+            }
+
+            for (uint32_t y = first[1]; y <= last[1]; y++)
+                for (uint32_t x = first[0]; x <= last[0]; x++)
+                {
+                    uint32_t cell = y*grid->columns + x;
+                    if (pass == 0)
+                        cells[cell + 1]++;
+                    else
+                        cell_triangles[cells[cell]++] = i;
+                }
+        }
+
+        if (pass == 0)
+        {
+            for (uint32_t i = 0; i < cell_count; i++)
+                cells[i + 1] += cells[i];
+
+            cell_triangles = calloc(cells[cell_count] + 1, sizeof(uint32_t));
+            assert(cell_triangles);
+        }
+    }
+
+    // Filling advanced each offset to the start of the next cell
+    memmove(&cells[1], &cells[0], cell_count*sizeof(uint32_t));
+    cells[0] = 0;
+
+    grid->cells = cells;
+    grid->triangles = cell_triangles;
+}
@@ -0,0 +1,131 @@
+/*
+ * This file is part of SceneFlipEngine.
+ * Copyright 2012, 2017 Paul Chote
+ *
+ * SceneFlipEngine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SceneFlipEngine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SceneFlipEngine.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef GPEngine_walkmap_grid_h
+#define GPEngine_walkmap_grid_h
+
+#include <stdint.h>
+
+/*
+ * The .map file layout and triangle lookup grid, shared by the
+ * engine and GPModelConverter, which bakes version 2 walkmap files.
+ * Only depends on the C library, so that the converter
+ * can build it without the engine's GL headers
+ */
+
+/*
+ * .map file header
+ * Version 1 files are followed by the shared vertex array,
+ * then triangles and borders that index into it (see load_map_v1 in walkmap.c)
+ */
+struct walkmap_header
+{
+    uint32_t version;
+    uint32_t vertex_count;
+    uint32_t triangle_count;
+    uint32_t border_count;
+};
+
+/*
+ * Version 2 files store each array contiguously (16 byte aligned)
+ * in its runtime layout, along with a baked triangle lookup grid,
+ * so that they can be used in place from a read-only mapping.
+ * Triangles and borders store their own vertices, so vertex_count is 0
+ */
+struct walkmap_header_v2
+{
+    struct walkmap_header base;
+
+    // struct walkmap_triangle[triangle_count]
+    uint32_t triangle_offset;
+
+    // struct walkmap_file_border[border_count]
+    uint32_t border_offset;
+
+    // float[3*border_vertex_count]
+    uint32_t border_vertex_offset;
+    uint32_t border_vertex_count;
+
+    // uint32_t[grid_columns*grid_rows + 1]: index of the first
+    // entry in grid_triangles for each cell, in row-major order
+    uint32_t grid_cell_offset;
+
+    // uint32_t[grid_triangle_count]: triangles overlapping each cell
+    uint32_t grid_triangle_offset;
+    uint32_t grid_triangle_count;
+
+    uint32_t grid_columns;
+    uint32_t grid_rows;
+    float grid_origin[2];
+    float grid_cell_size;
+};
+
+/*
+ * Border of length vertices, starting at first_vertex in the border vertex array
+ */
+struct walkmap_file_border
+{
+    uint16_t group;
+    uint16_t group_interaction_mask;
+    uint32_t first_vertex;
+    uint32_t length;
+    uint32_t reserved;
+};
+
+/*
+ * Walkmesh triangle, in the layout stored by version 2 files
+ */
+struct walkmap_triangle
+{
+    uint16_t group;
+    uint16_t group_interaction_mask;
+
+    // Vertices
+    float a[3];
+    float b[3];
+    float c[3];
+
+    // Vectors from c to a,b in the xy plane
+    float ca[2];
+    float cb[2];
+
+    // 1 / determinant of transform to barycentric coords
+    float invdet;
+    uint32_t reserved;
+};
+
+/*
+ * Uniform grid of the triangles overlapping each cell
+ */
+struct walkmap_grid
+{
+    float origin[2];
+    float cell_size;
+    uint32_t columns;
+    uint32_t rows;
+
+    // Index of the first entry in triangles for each cell (in row-major
+    // order), followed by the total number of entries
+    uint32_t *cells;
+    uint32_t *triangles;
+};
+
+void walkmap_grid_build(const struct walkmap_triangle *triangles, uint32_t triangle_count, struct walkmap_grid *grid);
+
+#endif
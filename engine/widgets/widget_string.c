@@ -25,6 +25,7 @@
 #include "engine.h"
 #include "renderer.h"
 #include "modelview.h"
+#include "pending_init.h"
 
 struct widget_string
 {
@@ -37,6 +38,9 @@ struct widget_string
     GLuint vbo;
     GLsizei vertex_count;
     bool initialized;
+
+    // Destruction is deferred until the init task has run
+    struct pending_init pending;
 };
 
 /*
@@ -87,6 +91,11 @@ static void init_gl(void *_ws)
 static void uninit_gl(void *_ws)
 {
     widget_string_ptr ws = _ws;
+
+    // Destruction was requested before the string was initialized
+    if (pending_init_defer_destroy(&ws->pending))
+        return;
+
     assert(ws->initialized);
 
     glDeleteBuffers(1, &ws->vbo); checkGLError();
@@ -96,6 +105,19 @@ static void uninit_gl(void *_ws)
     free(ws);
 }
 
+/*
+ * Run the queued initialization
+ *
+ * Call Context: Main thread (via engine_process_tasks)
+ */
+static void init_task(void *_ws)
+{
+    widget_string_ptr ws = _ws;
+
+    // May have been initialized by draw before the task was run
+    pending_init_run(&ws->pending, ws->initialized, init_gl, uninit_gl, ws);
+}
+
 widget_string_ptr widget_string_create(const char *font_id, engine_ptr e)
 {
     widget_string_ptr ws = calloc(1, sizeof(struct widget_string));
@@ -104,7 +126,8 @@ widget_string_ptr widget_string_create(const char *font_id, engine_ptr e)
     ws->lifetime = GL_STATIC_DRAW;
     ws->font_ref = engine_retain_font(e, font_id);
 
-    engine_queue_task(e, init_gl, ws);
+    pending_init_begin(&ws->pending, 1);
+    engine_queue_task(e, TASK_PRIORITY_UPLOAD, init_task, ws);
 
     return ws;
 }
@@ -112,7 +135,7 @@ widget_string_ptr widget_string_create(const char *font_id, engine_ptr e)
 void widget_string_destroy(widget_string_ptr ws, engine_ptr e)
 {
     engine_release_font(e, ws->font_ref);
-    engine_queue_task(e, uninit_gl, ws);
+    engine_queue_task(e, TASK_PRIORITY_CHEAP, uninit_gl, ws);
 }
 
 static void update_buffers(widget_string_ptr ws)
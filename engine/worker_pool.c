@@ -0,0 +1,419 @@
+/*
+ * This file is part of SceneFlipEngine.
+ * Copyright 2012, 2017 Paul Chote
+ *
+ * SceneFlipEngine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SceneFlipEngine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SceneFlipEngine.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Persistent pool of worker threads for loading jobs.
+ *
+ * Each worker owns a job deque. Jobs submitted from a worker are pushed
+ * onto that worker's own deque, and jobs submitted from other threads
+ * are distributed between the workers round-robin. A worker runs its
+ * newest job first, and steals the oldest job from another worker when
+ * its own deque is empty.
+ *
+ * Jobs can be grouped into a batch, which another thread can wait on.
+ * A worker that waits on a batch keeps running jobs while it waits, so
+ * a job may safely submit child jobs and wait for them to complete.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "worker_pool.h"
+
+struct job
+{
+    void (*func)(void *);
+    void *data;
+    job_batch_ptr batch;
+};
+
+// Ring buffer of jobs, guarded by its own mutex
+// The owning worker takes from the back; thieves from the front
+struct job_deque
+{
+    pthread_mutex_t mutex;
+    struct job *jobs;
+    size_t capacity;
+    size_t head;
+    size_t count;
+};
+
+struct worker
+{
+    worker_pool_ptr pool;
+    uint32_t index;
+    pthread_t thread;
+    struct job_deque deque;
+};
+
+struct worker_pool
+{
+    struct worker *workers;
+    uint32_t worker_count;
+
+    // Jobs that have been submitted but not yet started,
+    // and jobs that are currently running
+    volatile uint32_t queued;
+    volatile uint32_t running;
+
+    // Idle workers sleep on this condition
+    pthread_mutex_t idle_mutex;
+    pthread_cond_t idle_condition;
+    volatile bool shutdown;
+
+    // Deque to receive the next job from a non-worker thread
+    volatile uint32_t next_deque;
+
+    // Identifies the worker (if any) that is running on the current thread
+    pthread_key_t current_worker;
+};
+
+struct job_batch
+{
+    volatile uint32_t remaining;
+    pthread_mutex_t mutex;
+    pthread_cond_t condition;
+};
+
+#pragma mark Job deques
+static void deque_init(struct job_deque *d)
+{
+    pthread_mutex_init(&d->mutex, NULL);
+    d->capacity = 16;
+    d->jobs = calloc(d->capacity, sizeof(struct job));
+    assert(d->jobs);
+}
+
+static void deque_free(struct job_deque *d)
+{
+    pthread_mutex_destroy(&d->mutex);
+    free(d->jobs);
+}
+
+/*
+ * Push a job, incrementing queued while the deque is still locked.
+ * The job can't be taken until the lock is released, so queued never
+ * counts fewer jobs than can be taken, and a worker that sees the
+ * increment finds the job as soon as it can lock the deque
+ */
+static void deque_push(struct job_deque *d, struct job *j, volatile uint32_t *queued)
+{
+    pthread_mutex_lock(&d->mutex);
+    if (d->count == d->capacity)
+    {
+        // Grow, unwrapping the ring so the oldest job is at index 0
+        struct job *jobs = calloc(2*d->capacity, sizeof(struct job));
+        assert(jobs);
+        for (size_t i = 0; i < d->count; i++)
+            jobs[i] = d->jobs[(d->head + i) % d->capacity];
+
+        free(d->jobs);
+        d->jobs = jobs;
+        d->capacity *= 2;
+        d->head = 0;
+    }
+
+    d->jobs[(d->head + d->count) % d->capacity] = *j;
+    d->count++;
+    __sync_fetch_and_add(queued, 1);
+    pthread_mutex_unlock(&d->mutex);
+}
+
+static bool deque_pop_back(struct job_deque *d, struct job *j)
+{
+    bool found = false;
+    pthread_mutex_lock(&d->mutex);
+    if (d->count)
+    {
+        d->count--;
+        *j = d->jobs[(d->head + d->count) % d->capacity];
+        found = true;
+    }
+    pthread_mutex_unlock(&d->mutex);
+    return found;
+}
+
+static bool deque_pop_front(struct job_deque *d, struct job *j)
+{
+    bool found = false;
+    pthread_mutex_lock(&d->mutex);
+    if (d->count)
+    {
+        *j = d->jobs[d->head];
+        d->head = (d->head + 1) % d->capacity;
+        d->count--;
+        found = true;
+    }
+    pthread_mutex_unlock(&d->mutex);
+    return found;
+}
+
+#pragma mark Workers
+/*
+ * Take the next job for worker w: first from its own deque,
+ * otherwise stolen from one of the other workers
+ *
+ * Call Context: Worker thread
+ */
+static bool take_job(worker_pool_ptr p, struct worker *w, struct job *j)
+{
+    bool found = deque_pop_back(&w->deque, j);
+    for (uint32_t i = 1; !found && i < p->worker_count; i++)
+        found = deque_pop_front(&p->workers[(w->index + i) % p->worker_count].deque, j);
+
+    if (found)
+    {
+        __sync_fetch_and_add(&p->running, 1);
+        __sync_fetch_and_sub(&p->queued, 1);
+    }
+
+    return found;
+}
+
+/*
+ * Run a job, and signal its batch if it was the last outstanding job
+ *
+ * Call Context: Worker thread
+ */
+static void run_job(worker_pool_ptr p, struct job *j)
+{
+    j->func(j->data);
+
+    // The batch may be destroyed as soon as a waiter sees it complete,
+    // so it must not be touched after the mutex is released
+    job_batch_ptr b = j->batch;
+    if (b)
+    {
+        pthread_mutex_lock(&b->mutex);
+        if (__sync_sub_and_fetch(&b->remaining, 1) == 0)
+            pthread_cond_broadcast(&b->condition);
+        pthread_mutex_unlock(&b->mutex);
+    }
+
+    __sync_fetch_and_sub(&p->running, 1);
+}
+
+static void *worker_main(void *_w)
+{
+    struct worker *w = _w;
+    worker_pool_ptr p = w->pool;
+    pthread_setspecific(p->current_worker, w);
+
+    for (;;)
+    {
+        struct job j;
+        if (take_job(p, w, &j))
+        {
+            run_job(p, &j);
+            continue;
+        }
+
+        // Sleep until more work arrives.
+        // queued is incremented before the condition is signalled,
+        // so checking it under the mutex cannot miss a wakeup
+        pthread_mutex_lock(&p->idle_mutex);
+        while (!p->queued && !p->shutdown)
+            pthread_cond_wait(&p->idle_condition, &p->idle_mutex);
+        bool exit = p->shutdown && !p->queued;
+        pthread_mutex_unlock(&p->idle_mutex);
+
+        if (exit)
+            break;
+    }
+
+    return NULL;
+}
+
+#pragma mark Public interface
+/*
+ * Create a worker pool and start its threads
+ *
+ * Call Context: Main thread
+ */
+worker_pool_ptr worker_pool_create(uint32_t thread_count)
+{
+    assert(thread_count > 0);
+
+    worker_pool_ptr p = calloc(1, sizeof(struct worker_pool));
+    assert(p);
+
+    p->worker_count = thread_count;
+    p->workers = calloc(thread_count, sizeof(struct worker));
+    assert(p->workers);
+
+    pthread_mutex_init(&p->idle_mutex, NULL);
+    pthread_cond_init(&p->idle_condition, NULL);
+    pthread_key_create(&p->current_worker, NULL);
+
+    // All deques must exist before any worker tries to steal
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        p->workers[i].pool = p;
+        p->workers[i].index = i;
+        deque_init(&p->workers[i].deque);
+    }
+
+    for (uint32_t i = 0; i < thread_count; i++)
+        if (pthread_create(&p->workers[i].thread, NULL, worker_main, &p->workers[i]))
+        {
+            printf("Unable to start worker thread %u\n", i);
+            assert(FATAL_ERROR);
+        }
+
+    return p;
+}
+
+/*
+ * Finish all queued jobs, then stop and destroy the pool
+ *
+ * Call Context: Main thread
+ */
+void worker_pool_destroy(worker_pool_ptr p)
+{
+    pthread_mutex_lock(&p->idle_mutex);
+    p->shutdown = true;
+    pthread_cond_broadcast(&p->idle_condition);
+    pthread_mutex_unlock(&p->idle_mutex);
+
+    for (uint32_t i = 0; i < p->worker_count; i++)
+        pthread_join(p->workers[i].thread, NULL);
+
+    for (uint32_t i = 0; i < p->worker_count; i++)
+        deque_free(&p->workers[i].deque);
+
+    pthread_key_delete(p->current_worker);
+    pthread_cond_destroy(&p->idle_condition);
+    pthread_mutex_destroy(&p->idle_mutex);
+    free(p->workers);
+    free(p);
+}
+
+uint32_t worker_pool_thread_count(worker_pool_ptr p)
+{
+    return p->worker_count;
+}
+
+/*
+ * Returns true if any jobs are queued or running
+ */
+bool worker_pool_busy(worker_pool_ptr p)
+{
+    return p->queued || p->running;
+}
+
+/*
+ * Submit a job to the pool.
+ * b is an optional batch that can be used to wait for the job to complete
+ *
+ * Call Context: Any thread
+ */
+void worker_pool_submit(worker_pool_ptr p, job_batch_ptr b, void (*func)(void *), void *data)
+{
+    struct job j = {.func = func, .data = data, .batch = b};
+    if (b)
+        __sync_fetch_and_add(&b->remaining, 1);
+
+    // Workers keep their own jobs local; other threads spread them out
+    struct worker *w = pthread_getspecific(p->current_worker);
+    if (!w || w->pool != p)
+        w = &p->workers[__sync_fetch_and_add(&p->next_deque, 1) % p->worker_count];
+
+    deque_push(&w->deque, &j, &p->queued);
+
+    pthread_mutex_lock(&p->idle_mutex);
+    pthread_cond_signal(&p->idle_condition);
+    pthread_mutex_unlock(&p->idle_mutex);
+}
+
+/*
+ * Create a batch for tracking a group of jobs
+ */
+job_batch_ptr job_batch_create()
+{
+    job_batch_ptr b = calloc(1, sizeof(struct job_batch));
+    assert(b);
+
+    pthread_mutex_init(&b->mutex, NULL);
+    pthread_cond_init(&b->condition, NULL);
+    return b;
+}
+
+/*
+ * Destroy a batch. Any jobs submitted to it must have completed
+ */
+void job_batch_destroy(job_batch_ptr b)
+{
+    assert(b->remaining == 0);
+    pthread_cond_destroy(&b->condition);
+    pthread_mutex_destroy(&b->mutex);
+    free(b);
+}
+
+/*
+ * Block until all jobs in the batch have completed.
+ *
+ * Workers run other jobs while they wait, so that a job that waits on
+ * its own child jobs cannot deadlock the pool. Other threads only sleep:
+ * the main thread must not pick up a job that waits on a main-thread task.
+ *
+ * Call Context: Any thread
+ */
+void job_batch_wait(worker_pool_ptr p, job_batch_ptr b)
+{
+    struct worker *w = pthread_getspecific(p->current_worker);
+    if (w && w->pool != p)
+        w = NULL;
+
+    for (;;)
+    {
+        struct job j;
+        if (w && b->remaining && take_job(p, w, &j))
+        {
+            run_job(p, &j);
+            continue;
+        }
+
+        // Completion is only checked under the mutex, so that the
+        // final run_job has released it before we return
+        pthread_mutex_lock(&b->mutex);
+        if (!b->remaining)
+        {
+            pthread_mutex_unlock(&b->mutex);
+            break;
+        }
+
+        if (w)
+        {
+            // Wake periodically to check for jobs that we can help with
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            long nsec = now.tv_usec*1000 + 1000000;
+            struct timespec timeout = {
+                .tv_sec = now.tv_sec + nsec / 1000000000,
+                .tv_nsec = nsec % 1000000000
+            };
+            pthread_cond_timedwait(&b->condition, &b->mutex, &timeout);
+        }
+        else
+            pthread_cond_wait(&b->condition, &b->mutex);
+        pthread_mutex_unlock(&b->mutex);
+    }
+}
@@ -0,0 +1,35 @@
+/*
+ * This file is part of SceneFlipEngine.
+ * Copyright 2012, 2017 Paul Chote
+ *
+ * SceneFlipEngine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SceneFlipEngine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SceneFlipEngine.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GPEngine_worker_pool_h
+#define GPEngine_worker_pool_h
+
+#include "typedefs.h"
+
+worker_pool_ptr worker_pool_create(uint32_t thread_count);
+void worker_pool_destroy(worker_pool_ptr p);
+uint32_t worker_pool_thread_count(worker_pool_ptr p);
+bool worker_pool_busy(worker_pool_ptr p);
+
+void worker_pool_submit(worker_pool_ptr p, job_batch_ptr b, void (*func)(void *), void *data);
+
+job_batch_ptr job_batch_create();
+void job_batch_destroy(job_batch_ptr b);
+void job_batch_wait(worker_pool_ptr p, job_batch_ptr b);
+
+#endif
@@ -53,7 +53,7 @@
     GLfloat scale = self.view.contentScaleFactor;
 
     const char *assetPath = [[[[NSBundle mainBundle] resourcePath] stringByAppendingPathComponent:@"assets"] UTF8String];
-    self.gameEngine = engine_create(assetPath, size.height*scale, size.width*scale);
+    self.gameEngine = engine_create(assetPath, NULL, size.height*scale, size.width*scale);
 }
 
 - (void)viewDidUnload
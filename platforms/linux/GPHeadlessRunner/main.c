@@ -0,0 +1,902 @@
+/*
+ * This file is part of SceneFlipEngine.
+ * Copyright 2012, 2017 Paul Chote
+ *
+ * SceneFlipEngine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SceneFlipEngine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with SceneFlipEngine.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Headless frontend for reproducible performance measurements.
+ *
+ * Renders into an offscreen framebuffer on an EGL surfaceless context
+ * (Mesa's software rasterizer works fine, so no GPU or display is needed),
+ * ticks the engine with a fixed dt, replays recorded input, and reports
+ * tick / draw / task timing statistics for each scene.
+ *
+ * Input files contain one event per line:
+ *     <frame> direction <radius> <angle in degrees>
+ *     <frame> camera <radius> <angle in degrees>
+ *     <frame> press reset_camera
+ *     <frame> release reset_camera
+ * Frames are counted from the end of the scene load, and blank
+ * lines or lines starting with '#' are ignored.
+ *
+ * With -D the runner instead measures png decode throughput
+ * for every texture in the assets directory, with -M it measures
+ * the cost of animating and drawing 1, 50 and 500 model instances
+ * (blending keyframes in the vertex shader and on the CPU),
+ * and with -Q it measures task queue throughput with 1, 2, 4 and 8
+ * threads pushing tasks while the main thread pops them.
+ */
+
+// For nftw
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include "engine.h"
+#include "renderer.h"
+#include "texture.h"
+#include "model.h"
+#include "task_queue.h"
+#include "timer.h"
+
+// Scenes that are measured when none are given on the command line
+static const char *default_scenes[] = {"space_test", "street"};
+
+// Model and instance counts measured by the animation benchmark
+static const char *animation_model = "knight.mdl";
+static const uint32_t animation_instance_counts[] = {1, 50, 500};
+
+// Producer counts and tasks pushed by each producer in the queue benchmark
+static const uint32_t queue_producer_counts[] = {1, 2, 4, 8};
+#define QUEUE_TASKS_PER_PRODUCER (1 << 20)
+
+// Producers wait for the consumer once they are this many tasks ahead,
+// keeping the total well within the queue's node limit
+#define QUEUE_MAX_OUTSTANDING 4096
+
+// Give up on a scene that hasn't loaded after this many frames
+#define MAX_LOAD_FRAMES 10000
+
+typedef enum
+{
+    INPUT_EVENT_ANALOG,
+    INPUT_EVENT_PRESS,
+    INPUT_EVENT_RELEASE,
+} input_event_type;
+
+struct input_event
+{
+    uint32_t frame;
+    input_event_type type;
+    analog_input_type analog;
+    GPpolar value;
+    input_flags flags;
+};
+
+struct input_script
+{
+    struct input_event *events;
+    size_t count;
+};
+
+struct runner_options
+{
+    const char *resource_path;
+    const char *input_path;
+    GLuint width;
+    GLuint height;
+    uint32_t frames;
+    double dt;
+    bool decode_benchmark;
+    bool animation_benchmark;
+    bool queue_benchmark;
+    bool upload_thread;
+    bool scene_cache;
+};
+
+#pragma mark Offscreen context
+struct offscreen
+{
+    EGLDisplay display;
+    EGLContext context;
+
+    // Shares objects with context, for the engine's upload thread
+    EGLContext upload_context;
+    GLuint fbo;
+    GLuint color;
+    GLuint depth;
+};
+
+/*
+ * Create a core profile GL context with no window system
+ * and make it current on the calling thread
+ */
+static bool offscreen_create_context(struct offscreen *o)
+{
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (!get_platform_display)
+    {
+        fprintf(stderr, "EGL_EXT_platform_base is not supported\n");
+        return false;
+    }
+
+    o->display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    EGLint major, minor;
+    if (o->display == EGL_NO_DISPLAY || !eglInitialize(o->display, &major, &minor))
+    {
+        fprintf(stderr, "Unable to initialize surfaceless EGL display\n");
+        return false;
+    }
+
+    if (!eglBindAPI(EGL_OPENGL_API))
+    {
+        fprintf(stderr, "Desktop OpenGL is not supported by EGL\n");
+        return false;
+    }
+
+    const EGLint context_attribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 2,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+
+    // Surfaceless contexts don't need a config
+    o->context = eglCreateContext(o->display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, context_attribs);
+    if (o->context == EGL_NO_CONTEXT ||
+        !eglMakeCurrent(o->display, EGL_NO_SURFACE, EGL_NO_SURFACE, o->context))
+    {
+        fprintf(stderr, "Unable to create a GL 3.2 core context (EGL error 0x%x)\n", eglGetError());
+        return false;
+    }
+
+    printf("Using %s (%s)\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+
+    o->upload_context = eglCreateContext(o->display, EGL_NO_CONFIG_KHR, o->context, context_attribs);
+    if (o->upload_context == EGL_NO_CONTEXT)
+        fprintf(stderr, "Unable to create a shared upload context (EGL error 0x%x)\n", eglGetError());
+
+    return true;
+}
+
+/*
+ * Make the shared upload context current on (or release it from) the calling thread
+ *
+ * Call Context: Upload thread
+ */
+static bool offscreen_set_upload_context(void *_o, bool current)
+{
+    struct offscreen *o = _o;
+    if (o->upload_context == EGL_NO_CONTEXT)
+        return false;
+
+    return eglMakeCurrent(o->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                          current ? o->upload_context : EGL_NO_CONTEXT);
+}
+
+/*
+ * Create and bind the framebuffer that stands in for the window
+ */
+static bool offscreen_create_framebuffer(struct offscreen *o, GLuint width, GLuint height)
+{
+    glGenFramebuffers(1, &o->fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, o->fbo);
+
+    glGenRenderbuffers(1, &o->color);
+    glBindRenderbuffer(GL_RENDERBUFFER, o->color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, o->color);
+
+    glGenRenderbuffers(1, &o->depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, o->depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, o->depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        fprintf(stderr, "Offscreen framebuffer is incomplete\n");
+        return false;
+    }
+
+    return true;
+}
+
+static void offscreen_destroy(struct offscreen *o)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteRenderbuffers(1, &o->depth);
+    glDeleteRenderbuffers(1, &o->color);
+    glDeleteFramebuffers(1, &o->fbo);
+
+    eglMakeCurrent(o->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (o->upload_context != EGL_NO_CONTEXT)
+        eglDestroyContext(o->display, o->upload_context);
+    eglDestroyContext(o->display, o->context);
+    eglTerminate(o->display);
+}
+
+#pragma mark Input replay
+static bool parse_input_line(char *line, struct input_event *ev)
+{
+    char command[32], arg[32];
+    float radius, angle;
+
+    if (sscanf(line, "%u %31s", &ev->frame, command) != 2)
+        return false;
+
+    if (!strcmp(command, "direction") || !strcmp(command, "camera"))
+    {
+        if (sscanf(line, "%*u %*s %f %f", &radius, &angle) != 2)
+            return false;
+
+        ev->type = INPUT_EVENT_ANALOG;
+        ev->analog = command[0] == 'd' ? ANALOG_INPUT_DIRECTION : ANALOG_INPUT_CAMERA;
+        ev->value = (GPpolar){radius, angle*M_PI/180};
+        return true;
+    }
+
+    if (!strcmp(command, "press") || !strcmp(command, "release"))
+    {
+        if (sscanf(line, "%*u %*s %31s", arg) != 1 || strcmp(arg, "reset_camera"))
+            return false;
+
+        ev->type = command[0] == 'p' ? INPUT_EVENT_PRESS : INPUT_EVENT_RELEASE;
+        ev->flags = INPUT_RESET_CAMERA;
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Load a recorded input script
+ * Events must be listed in frame order
+ */
+static bool load_input_script(const char *path, struct input_script *s)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        fprintf(stderr, "Unable to open input file %s\n", path);
+        return false;
+    }
+
+    size_t capacity = 0;
+    char linebuf[256];
+    for (size_t line = 1; fgets(linebuf, sizeof(linebuf), file); line++)
+    {
+        char *start = linebuf + strspn(linebuf, " \t");
+        if (*start == '#' || *start == '\n' || *start == '\0')
+            continue;
+
+        if (s->count == capacity)
+        {
+            capacity = capacity ? 2*capacity : 64;
+            s->events = realloc(s->events, capacity*sizeof(struct input_event));
+            if (!s->events)
+                abort();
+        }
+
+        struct input_event *ev = &s->events[s->count];
+        if (!parse_input_line(start, ev) || (s->count > 0 && ev->frame < ev[-1].frame))
+        {
+            fprintf(stderr, "%s:%zu: invalid input event\n", path, line);
+            fclose(file);
+            return false;
+        }
+
+        s->count++;
+    }
+
+    fclose(file);
+    return true;
+}
+
+/*
+ * Apply the events for frame, starting from *next
+ */
+static void replay_input(engine_ptr e, const struct input_script *s, size_t *next, uint32_t frame)
+{
+    for (; *next < s->count && s->events[*next].frame <= frame; (*next)++)
+    {
+        const struct input_event *ev = &s->events[*next];
+        switch (ev->type)
+        {
+            case INPUT_EVENT_ANALOG:
+                engine_set_analog_input(e, ev->analog, ev->value);
+                break;
+            case INPUT_EVENT_PRESS:
+                engine_enable_inputs(e, ev->flags);
+                break;
+            case INPUT_EVENT_RELEASE:
+                engine_disable_inputs(e, ev->flags);
+                break;
+        }
+    }
+}
+
+#pragma mark Statistics
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Print the mean, 95th and 99th percentile (nearest rank)
+ * and maximum of a set of times in seconds.
+ * Sorts times in place
+ */
+static void print_stats(const char *label, double *times, size_t count)
+{
+    double total = 0;
+    for (size_t i = 0; i < count; i++)
+        total += times[i];
+
+    qsort(times, count, sizeof(double), compare_doubles);
+    size_t p95 = (size_t)ceil(0.95*count) - 1;
+    size_t p99 = (size_t)ceil(0.99*count) - 1;
+
+    printf("  %-5s mean %8.3f ms   p95 %8.3f ms   p99 %8.3f ms   max %8.3f ms\n",
+           label, 1000*total/count, 1000*times[p95], 1000*times[p99], 1000*times[count - 1]);
+}
+
+#pragma mark Runner
+/*
+ * Run the engine through a single scene and report timings
+ */
+static bool run_scene(const char *scene, const struct runner_options *o, const struct input_script *input, struct offscreen *offscreen)
+{
+    engine_ptr e = engine_create(o->resource_path, scene, o->width, o->height);
+    if (!e)
+        return false;
+
+    if (o->upload_thread && !engine_start_upload_thread(e, offscreen_set_upload_context, offscreen))
+        fprintf(stderr, "Upload thread unavailable: uploading on the main thread\n");
+
+    // Simulate in lockstep with the fixed ticks so runs are reproducible.
+    // Unless requested, don't build neighbouring scenes in the background
+    // either, as their loading competes with the measured frames
+    engine_config_ptr config = engine_get_config_ref(e);
+    config->threaded_simulation = false;
+    if (!o->scene_cache)
+    {
+        config->prefetch_budget = 0;
+        config->suspended_scene_limit = 0;
+        config->suspended_scene_budget = 0;
+    }
+
+    // Wait for the startup transition (and scene load) to finish
+    uint32_t load_frames = 0;
+    double load_start = timer_now();
+    while (engine_in_transition(e))
+    {
+        if (++load_frames > MAX_LOAD_FRAMES)
+        {
+            fprintf(stderr, "Scene `%s' didn't finish loading after %u frames\n", scene, MAX_LOAD_FRAMES);
+            engine_destroy(e);
+            return false;
+        }
+
+        engine_tick(e, o->dt);
+        engine_draw(e);
+    }
+    glFinish();
+    double load_time = timer_now() - load_start;
+
+    double *tick = calloc(o->frames, sizeof(double));
+    double *draw = calloc(o->frames, sizeof(double));
+    double *task = calloc(o->frames, sizeof(double));
+    double *frame = calloc(o->frames, sizeof(double));
+    if (!tick || !draw || !task || !frame)
+        abort();
+
+    size_t next_event = 0;
+    for (uint32_t i = 0; i < o->frames; i++)
+    {
+        replay_input(e, input, &next_event, i);
+
+        double start = timer_now();
+        engine_tick(e, o->dt);
+
+        // Wait for rendering to complete so that the
+        // draw time includes the GPU (or rasterizer) work
+        double draw_start = timer_now();
+        engine_draw(e);
+        glFinish();
+        double end = timer_now();
+
+        GLfloat tick_time, task_time;
+        engine_get_frame_times(e, &tick_time, &task_time);
+        tick[i] = tick_time;
+        task[i] = task_time;
+        draw[i] = end - draw_start;
+        frame[i] = end - start;
+    }
+
+    printf("%s: loaded in %.1f ms (%u frames), %u frames measured at dt = %.4f s\n",
+           scene, load_time*1000, load_frames, o->frames, o->dt);
+    print_stats("tick", tick, o->frames);
+    print_stats("draw", draw, o->frames);
+    print_stats("task", task, o->frames);
+    print_stats("frame", frame, o->frames);
+
+    free(tick);
+    free(draw);
+    free(task);
+    free(frame);
+    engine_destroy(e);
+    return true;
+}
+
+#pragma mark Decode benchmark
+struct png_list
+{
+    char **paths;
+    size_t count;
+    size_t capacity;
+};
+
+static struct png_list png_files;
+
+static int collect_png(const char *path, const struct stat *sb, int type, struct FTW *ftw)
+{
+    size_t len = strlen(path);
+    if (type != FTW_F || len < 4 || strcmp(path + len - 4, ".png"))
+        return 0;
+
+    if (png_files.count == png_files.capacity)
+    {
+        png_files.capacity = png_files.capacity ? 2*png_files.capacity : 32;
+        png_files.paths = realloc(png_files.paths, png_files.capacity*sizeof(char *));
+        if (!png_files.paths)
+            abort();
+    }
+
+    // Strip the leading "./"
+    png_files.paths[png_files.count++] = strdup(path + 2);
+    return 0;
+}
+
+/*
+ * Decode every texture, then destroy them and let the
+ * engine run the queued upload and destroy tasks.
+ * Returns the elapsed time, and the decoded size by reference
+ */
+static double decode_pass(engine_ptr e, texture_ptr *textures, bool parallel, double *bytes)
+{
+    *bytes = 0;
+    double start = timer_now();
+    for (size_t i = 0; i < png_files.count; i++)
+    {
+        textures[i] = texture_create(png_files.paths[i], e);
+        if (!parallel)
+            texture_wait_decoded(textures[i], e);
+    }
+
+    for (size_t i = 0; i < png_files.count; i++)
+    {
+        GLuint width, height;
+        texture_wait_decoded(textures[i], e);
+        texture_dimensions(textures[i], &width, &height);
+        *bytes += 4.0*width*height;
+    }
+    double elapsed = timer_now() - start;
+
+    for (size_t i = 0; i < png_files.count; i++)
+        texture_destroy(textures[i], e);
+
+    // Uploads are also queued for each texture
+    engine_config_ptr ec = engine_get_config_ref(e);
+    GLfloat budget = ec->task_budget;
+    ec->task_budget = 1000;
+    engine_tick(e, 0);
+    ec->task_budget = budget;
+
+    return elapsed;
+}
+
+/*
+ * Report png decode throughput, one texture at a time and with
+ * every texture decoding concurrently on the engine worker pool
+ */
+static bool run_decode_benchmark(const struct runner_options *o)
+{
+    engine_ptr e = engine_create(o->resource_path, NULL, o->width, o->height);
+    if (!e)
+        return false;
+
+    // Don't compete with the start scene for workers
+    while (engine_in_transition(e))
+    {
+        engine_tick(e, o->dt);
+        engine_draw(e);
+    }
+
+    // The engine runs from the assets directory
+    nftw(".", collect_png, 16, FTW_PHYS);
+    if (!png_files.count)
+    {
+        fprintf(stderr, "No png files found in %s\n", o->resource_path);
+        engine_destroy(e);
+        return false;
+    }
+
+    texture_ptr *textures = calloc(png_files.count, sizeof(texture_ptr));
+    if (!textures)
+        abort();
+
+    // Warm the file cache so that both passes measure decoding
+    double bytes;
+    decode_pass(e, textures, false, &bytes);
+
+    double serial = decode_pass(e, textures, false, &bytes);
+    double parallel = decode_pass(e, textures, true, &bytes);
+    uint32_t workers = engine_worker_count(e);
+    double mb = bytes / (1024*1024);
+
+    printf("Decoded %zu textures (%.1f MB of image data)\n", png_files.count, mb);
+    printf("  serial:   %8.1f ms   %7.1f MB/s per core\n", 1000*serial, mb/serial);
+    printf("  parallel: %8.1f ms   %7.1f MB/s over %u workers (%.1f MB/s per core)\n",
+           1000*parallel, mb/parallel, workers, mb/parallel/workers);
+
+    for (size_t i = 0; i < png_files.count; i++)
+        free(png_files.paths[i]);
+    free(png_files.paths);
+    free(textures);
+    engine_destroy(e);
+    return true;
+}
+
+#pragma mark Animation benchmark
+/*
+ * Animate and draw count instances of a model for o->frames frames,
+ * blending keyframes on the CPU if cpu is set.
+ * Instances are laid out in a grid, with staggered animation phases
+ */
+static void animation_pass(model_ptr m, uint32_t count, bool cpu, const struct runner_options *o, engine_ptr e, renderer_ptr r)
+{
+    renderer_set_cpu_animation(r, cpu);
+
+    model_instance_ptr *instances = calloc(count, sizeof(model_instance_ptr));
+    double *anim = calloc(o->frames, sizeof(double));
+    double *draw = calloc(o->frames, sizeof(double));
+    if (!instances || !anim || !draw)
+        abort();
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        instances[i] = model_instance_create(m, e);
+        model_instance_set_animation_frac(instances[i], (GLfloat)i / count);
+    }
+
+    uint32_t columns = ceil(sqrt(count));
+    GLfloat scale = 2.0f / columns;
+    GLfloat mvp[16] = {0};
+    mvp[0] = mvp[5] = mvp[10] = 0.05f*scale;
+    mvp[15] = 1;
+
+    for (uint32_t f = 0; f < o->frames; f++)
+    {
+        double start = timer_now();
+        for (uint32_t i = 0; i < count; i++)
+            model_instance_step_animation_frac(instances[i], o->dt);
+
+        if (cpu)
+            model_instances_blend(instances, count, e);
+
+        double draw_start = timer_now();
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            mvp[12] = -1 + scale*(i % columns + 0.5f);
+            mvp[13] = -1 + scale*(i / columns + 0.5f);
+            model_instance_draw(instances[i], mvp, r);
+        }
+        glFinish();
+        double end = timer_now();
+
+        anim[f] = draw_start - start;
+        draw[f] = end - draw_start;
+    }
+
+    if (cpu)
+        printf("%s x %u, %s blend over %u workers: %u frames measured at dt = %.4f s\n", animation_model, count,
+               model_blend_kernel_name(), engine_worker_count(e), o->frames, o->dt);
+    else
+        printf("%s x %u, shader blend: %u frames measured at dt = %.4f s\n", animation_model, count, o->frames, o->dt);
+    print_stats("anim", anim, o->frames);
+    print_stats("draw", draw, o->frames);
+
+    for (uint32_t i = 0; i < count; i++)
+        model_instance_destroy(instances[i], e);
+    free(instances);
+    free(anim);
+    free(draw);
+}
+
+/*
+ * Report the per-frame cost of animating and drawing increasing
+ * numbers of instances of the same model, for each blend path
+ */
+static bool run_animation_benchmark(const struct runner_options *o)
+{
+    engine_ptr e = engine_create(o->resource_path, NULL, o->width, o->height);
+    if (!e)
+        return false;
+
+    while (engine_in_transition(e))
+    {
+        engine_tick(e, o->dt);
+        engine_draw(e);
+    }
+
+    // The engine runs from the assets directory, so
+    // the shaders and model can be loaded by name
+    renderer_ptr r = renderer_create();
+    model_ptr m = engine_retain_model(e, animation_model);
+    model_wait_loaded(m, e);
+
+    // Run the queued uploads before measuring
+    engine_config_ptr ec = engine_get_config_ref(e);
+    GLfloat budget = ec->task_budget;
+    ec->task_budget = 1000;
+    engine_tick(e, 0);
+    ec->task_budget = budget;
+
+    glEnable(GL_DEPTH_TEST);
+    size_t pass_count = sizeof(animation_instance_counts) / sizeof(animation_instance_counts[0]);
+    for (size_t i = 0; i < pass_count; i++)
+    {
+        animation_pass(m, animation_instance_counts[i], false, o, e, r);
+        animation_pass(m, animation_instance_counts[i], true, o, e, r);
+    }
+
+    engine_release_model(e, m);
+    renderer_destroy(r);
+    engine_destroy(e);
+    return true;
+}
+
+#pragma mark Task queue benchmark
+struct queue_producer
+{
+    task_queue_ptr queue;
+    uintptr_t id;
+    pthread_barrier_t *start;
+
+    // Updated by the consumer as it pops this producer's tasks
+    volatile uint32_t popped;
+
+    // Time spent pushing, excluding waits for the consumer
+    double push_time;
+};
+
+static void queue_noop(void *data) {}
+
+/*
+ * Push QUEUE_TASKS_PER_PRODUCER tasks tagged with the producer id
+ */
+static void *queue_producer_thread(void *_p)
+{
+    struct queue_producer *p = _p;
+    struct task t = {queue_noop, (void *)p->id, "queue_noop"};
+
+    pthread_barrier_wait(p->start);
+    double start = timer_now();
+    double waited = 0;
+    for (uint32_t i = 0; i < QUEUE_TASKS_PER_PRODUCER; i++)
+    {
+        if (i - p->popped >= QUEUE_MAX_OUTSTANDING)
+        {
+            double wait_start = timer_now();
+            while (i - p->popped >= QUEUE_MAX_OUTSTANDING)
+                sched_yield();
+            waited += timer_now() - wait_start;
+        }
+
+        task_queue_push(p->queue, &t);
+    }
+
+    p->push_time = timer_now() - start - waited;
+    return NULL;
+}
+
+/*
+ * Push from count threads at once while the calling thread pops
+ * and runs every task, as the main thread does with worker tasks
+ */
+static void queue_pass(uint32_t count)
+{
+    task_queue_ptr q = task_queue_create();
+    struct queue_producer *producers = calloc(count, sizeof(struct queue_producer));
+    pthread_t *threads = calloc(count, sizeof(pthread_t));
+    if (!producers || !threads)
+        abort();
+
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, count + 1);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        producers[i].queue = q;
+        producers[i].id = i;
+        producers[i].start = &start;
+        pthread_create(&threads[i], NULL, queue_producer_thread, &producers[i]);
+    }
+
+    pthread_barrier_wait(&start);
+    double begin = timer_now();
+
+    uint64_t total = (uint64_t)count*QUEUE_TASKS_PER_PRODUCER;
+    for (uint64_t popped = 0; popped < total;)
+    {
+        struct task t;
+        if (!task_queue_pop(q, &t))
+            continue;
+
+        t.func(t.data);
+        __sync_fetch_and_add(&producers[(uintptr_t)t.data].popped, 1);
+        popped++;
+    }
+    double elapsed = timer_now() - begin;
+
+    double push_time = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        pthread_join(threads[i], NULL);
+        push_time += producers[i].push_time;
+    }
+
+    printf("%u producer%s: %.1f M tasks/s through the queue, %.1f ns per push\n",
+           count, count == 1 ? " " : "s", total/elapsed/1e6, 1e9*push_time/total);
+
+    pthread_barrier_destroy(&start);
+    free(threads);
+    free(producers);
+    task_queue_destroy(q);
+}
+
+/*
+ * Report task queue throughput as the number of pushing threads increases
+ */
+static bool run_queue_benchmark(void)
+{
+    printf("Pushing %u tasks from each producer\n", QUEUE_TASKS_PER_PRODUCER);
+    size_t pass_count = sizeof(queue_producer_counts) / sizeof(queue_producer_counts[0]);
+    for (size_t i = 0; i < pass_count; i++)
+        queue_pass(queue_producer_counts[i]);
+
+    return true;
+}
+
+static void print_usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-a assets] [-i input] [-n frames] [-d dt] [-w width] [-h height] [-u] [-p] [-D] [-M] [-Q] [scene ...]\n"
+            "  -a  Path to the assets directory (default: ../../assets)\n"
+            "  -i  Recorded input to replay in each scene\n"
+            "  -n  Number of frames to measure after the scene loads (default: 600)\n"
+            "  -d  Fixed tick length in seconds (default: 1/60)\n"
+            "  -w, -h  Framebuffer size (default: 1024x768)\n"
+            "  -u  Upload textures from a thread with a shared context\n"
+            "  -p  Prefetch neighbouring scenes and keep visited scenes in the background\n"
+            "  -D  Measure png decode throughput instead of frame times\n"
+            "  -M  Measure model animation cost instead of frame times\n"
+            "  -Q  Measure task queue throughput with several producers\n"
+            "Scenes default to space_test and street\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    struct runner_options o = {
+        .resource_path = "../../assets",
+        .input_path = NULL,
+        .width = 1024,
+        .height = 768,
+        .frames = 600,
+        .dt = 1.0/60,
+        .decode_benchmark = false,
+        .animation_benchmark = false,
+        .queue_benchmark = false,
+        .upload_thread = false,
+        .scene_cache = false
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:i:n:d:w:h:upDMQ")) != -1)
+    {
+        switch (opt)
+        {
+            case 'a': o.resource_path = optarg; break;
+            case 'i': o.input_path = optarg; break;
+            case 'n': o.frames = strtoul(optarg, NULL, 10); break;
+            case 'd': o.dt = strtod(optarg, NULL); break;
+            case 'w': o.width = strtoul(optarg, NULL, 10); break;
+            case 'h': o.height = strtoul(optarg, NULL, 10); break;
+            case 'u': o.upload_thread = true; break;
+            case 'p': o.scene_cache = true; break;
+            case 'D': o.decode_benchmark = true; break;
+            case 'M': o.animation_benchmark = true; break;
+            case 'Q': o.queue_benchmark = true; break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (o.frames == 0 || o.dt <= 0 || o.width == 0 || o.height == 0)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // The engine changes into the resource directory,
+    // so resolve relative paths before it is created
+    char *resource_path = realpath(o.resource_path, NULL);
+    if (!resource_path)
+    {
+        fprintf(stderr, "Unable to find assets directory %s\n", o.resource_path);
+        return 1;
+    }
+    o.resource_path = resource_path;
+
+    struct input_script input = {NULL, 0};
+    if (o.input_path && !load_input_script(o.input_path, &input))
+        return 1;
+
+    struct offscreen offscreen;
+    if (!offscreen_create_context(&offscreen) ||
+        !offscreen_create_framebuffer(&offscreen, o.width, o.height))
+        return 1;
+
+    const char **scenes = default_scenes;
+    size_t scene_count = sizeof(default_scenes) / sizeof(default_scenes[0]);
+    if (optind < argc)
+    {
+        scenes = (const char **)&argv[optind];
+        scene_count = argc - optind;
+    }
+
+    int ret = 0;
+    if (o.decode_benchmark)
+        ret = run_decode_benchmark(&o) ? 0 : 1;
+    else if (o.animation_benchmark)
+        ret = run_animation_benchmark(&o) ? 0 : 1;
+    else if (o.queue_benchmark)
+        ret = run_queue_benchmark() ? 0 : 1;
+    else
+        for (size_t i = 0; i < scene_count; i++)
+            if (!run_scene(scenes[i], &o, &input, &offscreen))
+                ret = 1;
+
+    offscreen_destroy(&offscreen);
+    free(input.events);
+    free(resource_path);
+    return ret;
+}
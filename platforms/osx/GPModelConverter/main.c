@@ -22,9 +22,17 @@
 #include <assert.h>
 #include <math.h>
 #include <stdbool.h>
-#import <OpenGL/OpenGL.h>
+#include <stdint.h>
+#include <png.h>
+#include <zlib.h>
+#if __APPLE__
+    #import <OpenGL/OpenGL.h>
+#else
+    #include <GL/gl.h>
+#endif
 
 #pragma mark obj -> mdl conversion
+// Must match the definitions in engine/renderer/model.c
 struct model_header
 {
     uint32_t version;
@@ -33,6 +41,104 @@ struct model_header
     uint32_t texture_name_length;
 };
 
+struct model_header_v2
+{
+    struct model_header base;
+    uint32_t vertex_offset;
+    uint32_t texcoord_offset;
+    uint32_t texture_name_offset;
+    uint32_t reserved;
+};
+
+/*
+ * Pad the file with zeros to the next 16 byte boundary
+ * Returns the new offset
+ */
+static uint32_t write_alignment(FILE *file)
+{
+    static const uint8_t padding[16];
+    long offset = ftell(file);
+    uint32_t aligned = (offset + 15) & ~15;
+    fwrite(padding, 1, aligned - offset, file);
+    return aligned;
+}
+
+/*
+ * Write a version 2 model, with 16 byte aligned arrays
+ * that the engine can use directly from a mapping
+ */
+static void model_write(const char *output, uint32_t frame_count, uint32_t triangle_count,
+                        const GLfloat *vertex_data, const GLfloat *texcoord_data, const char *texture_name)
+{
+    struct model_header_v2 h =
+    {
+        .base =
+        {
+            .version = 2,
+            .frame_count = frame_count,
+            .triangle_count = triangle_count,
+            .texture_name_length = (uint32_t)strlen(texture_name)
+        }
+    };
+
+    FILE *mdl = fopen(output, "wb");
+    assert(mdl);
+
+    // The header is rewritten once the offsets are known
+    fwrite(&h, sizeof(struct model_header_v2), 1, mdl);
+
+    h.vertex_offset = write_alignment(mdl);
+    fwrite(vertex_data, sizeof(GLfloat), 9*frame_count*triangle_count, mdl);
+
+    h.texcoord_offset = write_alignment(mdl);
+    fwrite(texcoord_data, sizeof(GLfloat), 6*triangle_count, mdl);
+
+    h.texture_name_offset = (uint32_t)ftell(mdl);
+    fwrite(texture_name, sizeof(char), h.base.texture_name_length + 1, mdl);
+
+    fseek(mdl, 0, SEEK_SET);
+    fwrite(&h, sizeof(struct model_header_v2), 1, mdl);
+    fclose(mdl);
+    printf("Saved %u frames of %u triangles to %s\n", frame_count, triangle_count, output);
+}
+
+/*
+ * Rewrite a version 1 model in the current format
+ */
+void model_upgrade(const char *input, const char *output)
+{
+    FILE *mdl = fopen(input, "rb");
+    assert(mdl);
+
+    struct model_header h;
+    if (fread(&h, sizeof(struct model_header), 1, mdl) != 1 || h.version != 1)
+    {
+        printf("%s is not a version 1 model\n", input);
+        exit(1);
+    }
+
+    size_t vertex_count = 9*(size_t)h.frame_count*h.triangle_count;
+    size_t texcoord_count = 6*(size_t)h.triangle_count;
+    GLfloat *vertex_data = calloc(vertex_count, sizeof(GLfloat));
+    GLfloat *texcoord_data = calloc(texcoord_count, sizeof(GLfloat));
+    char *texture_name = calloc(h.texture_name_length + 1, sizeof(char));
+    assert(vertex_data && texcoord_data && texture_name);
+
+    if (fread(vertex_data, sizeof(GLfloat), vertex_count, mdl) != vertex_count ||
+        fread(texcoord_data, sizeof(GLfloat), texcoord_count, mdl) != texcoord_count ||
+        fread(texture_name, sizeof(char), h.texture_name_length, mdl) != h.texture_name_length)
+    {
+        printf("%s is truncated\n", input);
+        exit(1);
+    }
+    fclose(mdl);
+
+    model_write(output, h.frame_count, h.triangle_count, vertex_data, texcoord_data, texture_name);
+    free(texture_name);
+    free(texcoord_data);
+    free(vertex_data);
+}
+
 /*
  * Parse an obj file and return the number of vertices, texcoords, and triangles by reference
  */
@@ -203,23 +309,8 @@ void model_convert_obj(const char **input, size_t input_count, const char *outpu
     
     // TODO: Load this from the obj file
     char *texture_name = "knight.png";
-    struct model_header h = 
-    {
-        .version = 1,
-        .frame_count = (uint32_t)input_count,
-        .triangle_count = (uint32_t)triangle_count,
-        .texture_name_length = (uint32_t)strlen(texture_name)
-    };
-    
-    FILE *mdl = fopen(output, "wb");
-    assert(mdl);
-
-    fwrite(&h, sizeof(struct model_header), 1, mdl);
-    fwrite(vertex_data, sizeof(GLfloat), 9*h.frame_count*h.triangle_count, mdl);
-    fwrite(texcoord_data, sizeof(GLfloat), 6*h.triangle_count, mdl);
-    fwrite(texture_name, sizeof(char), h.texture_name_length, mdl);
-    fclose(mdl);
-    printf("Saved to %s\n", output);
+    model_write(output, (uint32_t)input_count, (uint32_t)triangle_count, vertex_data, texcoord_data, texture_name);
+    free(texcoord_data);
     free(vertex_data);
 }
 
@@ -821,6 +912,183 @@ uint32_t calculate_mesh_borders(face *faces, uint32_t face_count, uint16_t group
     return border_count;
 }
 
+#pragma mark walkmap baking
+// The file layout and lookup grid are shared with the engine
+#include "../../../engine/walkmap_grid.h"
+
+// Indexed triangles and borders, as stored by version 1 files
+struct walkmap_source_triangle
+{
+    uint16_t group;
+    uint16_t group_interaction_mask;
+    uint32_t indices[3];
+};
+
+struct walkmap_source_border
+{
+    uint16_t group;
+    uint16_t group_interaction_mask;
+    uint32_t length;
+    uint32_t *indices;
+};
+
+/*
+ * Write a version 2 walkmap, with 16 byte aligned arrays
+ * that the engine can use directly from a mapping
+ */
+static void walkmap_write(const char *output, const GLfloat *vertices,
+                          const struct walkmap_source_triangle *source_triangles, uint32_t triangle_count,
+                          const struct walkmap_source_border *source_borders, uint32_t border_count)
+{
+    struct walkmap_header_v2 h =
+    {
+        .base =
+        {
+            .version = 2,
+            .vertex_count = 0,
+            .triangle_count = triangle_count,
+            .border_count = border_count
+        }
+    };
+
+    // Bake the runtime triangle data
+    struct walkmap_triangle *triangles = calloc(triangle_count, sizeof(struct walkmap_triangle));
+    assert(triangles);
+    for (uint32_t i = 0; i < triangle_count; i++)
+    {
+        struct walkmap_triangle *wt = &triangles[i];
+        wt->group = source_triangles[i].group;
+        wt->group_interaction_mask = source_triangles[i].group_interaction_mask;
+        memcpy(wt->a, &vertices[3*source_triangles[i].indices[0]], 3*sizeof(GLfloat));
+        memcpy(wt->b, &vertices[3*source_triangles[i].indices[1]], 3*sizeof(GLfloat));
+        memcpy(wt->c, &vertices[3*source_triangles[i].indices[2]], 3*sizeof(GLfloat));
+        wt->ca[0] = wt->a[0] - wt->c[0];
+        wt->ca[1] = wt->a[1] - wt->c[1];
+        wt->cb[0] = wt->b[0] - wt->c[0];
+        wt->cb[1] = wt->b[1] - wt->c[1];
+        wt->invdet = 1.0/(wt->cb[1]*wt->ca[0] - wt->cb[0]*wt->ca[1]);
+    }
+
+    // Border vertices are stored contiguously
+    struct walkmap_file_border *borders = calloc(border_count + 1, sizeof(struct walkmap_file_border));
+    assert(borders);
+    for (uint32_t i = 0; i < border_count; i++)
+    {
+        borders[i].group = source_borders[i].group;
+        borders[i].group_interaction_mask = source_borders[i].group_interaction_mask;
+        borders[i].first_vertex = h.border_vertex_count;
+        borders[i].length = source_borders[i].length;
+        h.border_vertex_count += source_borders[i].length;
+    }
+
+    struct walkmap_grid grid;
+    walkmap_grid_build(triangles, triangle_count, &grid);
+    uint32_t cell_count = grid.columns*grid.rows;
+    uint32_t *cells = grid.cells, *cell_triangles = grid.triangles;
+    h.grid_columns = grid.columns;
+    h.grid_rows = grid.rows;
+    h.grid_origin[0] = grid.origin[0];
+    h.grid_origin[1] = grid.origin[1];
+    h.grid_cell_size = grid.cell_size;
+    h.grid_triangle_count = cells[cell_count];
+
+    FILE *map = fopen(output, "wb");
+    assert(map);
+
+    // The header is rewritten once the offsets are known
+    fwrite(&h, sizeof(struct walkmap_header_v2), 1, map);
+
+    h.triangle_offset = write_alignment(map);
+    fwrite(triangles, sizeof(struct walkmap_triangle), triangle_count, map);
+
+    h.border_offset = write_alignment(map);
+    fwrite(borders, sizeof(struct walkmap_file_border), border_count, map);
+
+    h.border_vertex_offset = write_alignment(map);
+    for (uint32_t i = 0; i < border_count; i++)
+        for (uint32_t j = 0; j < source_borders[i].length; j++)
+            fwrite(&vertices[3*source_borders[i].indices[j]], sizeof(GLfloat), 3, map);
+
+    h.grid_cell_offset = write_alignment(map);
+    fwrite(cells, sizeof(uint32_t), h.grid_columns*h.grid_rows + 1, map);
+
+    h.grid_triangle_offset = write_alignment(map);
+    fwrite(cell_triangles, sizeof(uint32_t), h.grid_triangle_count, map);
+
+    fseek(map, 0, SEEK_SET);
+    fwrite(&h, sizeof(struct walkmap_header_v2), 1, map);
+    fclose(map);
+
+    printf("Wrote %u triangles and %u borders to %s (%ux%u grid)\n",
+           triangle_count, border_count, output, h.grid_columns, h.grid_rows);
+    free(cell_triangles);
+    free(cells);
+    free(borders);
+    free(triangles);
+}
+
+/*
+ * Rewrite a version 1 walkmap in the current format
+ */
+void walkmap_upgrade(const char *input, const char *output)
+{
+    FILE *map = fopen(input, "rb");
+    assert(map);
+
+    struct walkmap_header h;
+    if (fread(&h, sizeof(struct walkmap_header), 1, map) != 1 || h.version != 1)
+    {
+        printf("%s is not a version 1 walkmap\n", input);
+        exit(1);
+    }
+
+    GLfloat *vertices = calloc(3*h.vertex_count, sizeof(GLfloat));
+    struct walkmap_source_triangle *triangles = calloc(h.triangle_count, sizeof(struct walkmap_source_triangle));
+    struct walkmap_source_border *borders = calloc(h.border_count + 1, sizeof(struct walkmap_source_border));
+    assert(vertices && triangles && borders);
+
+    bool valid = fread(vertices, sizeof(GLfloat), 3*h.vertex_count, map) == 3*h.vertex_count &&
+        fread(triangles, sizeof(struct walkmap_source_triangle), h.triangle_count, map) == h.triangle_count;
+
+    for (uint32_t i = 0; i < h.border_count && valid; i++)
+    {
+        struct walkmap_source_border *b = &borders[i];
+        valid = fread(&b->group, sizeof(uint16_t), 1, map) == 1 &&
+            fread(&b->group_interaction_mask, sizeof(uint16_t), 1, map) == 1 &&
+            fread(&b->length, sizeof(uint32_t), 1, map) == 1;
+
+        if (valid)
+        {
+            b->indices = calloc(b->length, sizeof(uint32_t));
+            assert(b->indices);
+            valid = fread(b->indices, sizeof(uint32_t), b->length, map) == b->length;
+        }
+    }
+    fclose(map);
+
+    for (uint32_t i = 0; i < h.triangle_count && valid; i++)
+        for (uint8_t j = 0; j < 3; j++)
+            valid &= triangles[i].indices[j] < h.vertex_count;
+
+    for (uint32_t i = 0; i < h.border_count && valid; i++)
+        for (uint32_t j = 0; j < borders[i].length; j++)
+            valid &= borders[i].indices[j] < h.vertex_count;
+
+    if (!valid)
+    {
+        printf("%s is truncated or invalid\n", input);
+        exit(1);
+    }
+
+    walkmap_write(output, vertices, triangles, h.triangle_count, borders, h.border_count);
+
+    for (uint32_t i = 0; i < h.border_count; i++)
+        free(borders[i].indices);
+    free(borders);
+    free(triangles);
+    free(vertices);
+}
+
 void walkmap_convert_obj(const char *input_filename, const char *output_filename)
 {
     // Define model from first frame
@@ -862,61 +1130,866 @@ void walkmap_convert_obj(const char *input_filename, const char *output_filename
     uint32_t **border_vertex_indices;
     uint32_t border_count = calculate_mesh_borders(faces, face_count, group_masks, &border_lengths, &border_groups, &border_vertex_indices);
 
-    FILE *output = fopen(output_filename, "wb");
-    assert(output);
+    struct walkmap_source_triangle *triangles = calloc(face_count, sizeof(struct walkmap_source_triangle));
+    struct walkmap_source_border *borders = calloc(border_count + 1, sizeof(struct walkmap_source_border));
+    assert(triangles && borders);
+
+    for (size_t i = 0; i < face_count; i++)
+    {
+        triangles[i].group = faces[i].group;
+        triangles[i].group_interaction_mask = group_masks[faces[i].group];
+        memcpy(triangles[i].indices, faces[i].vertex_index, 3*sizeof(uint32_t));
+    }
+
+    for (size_t i = 0; i < border_count; i++)
+    {
+        borders[i].group = border_groups[i];
+        borders[i].group_interaction_mask = group_masks[border_groups[i]];
+        borders[i].length = border_lengths[i];
+        borders[i].indices = border_vertex_indices[i];
+    }
+
+    walkmap_write(output_filename, (const GLfloat *)vertices, triangles, face_count, borders, border_count);
+    free(borders);
+    free(triangles);
+}
 
-    // Write file version
-    uint32_t version = 1;
-    fwrite(&version, sizeof(uint32_t), 1, output);
+#pragma mark png -> tex conversion
+// Must match the definitions in engine/renderer/texture.c
+#define TEXTURE_FILE_MAGIC 0x58545047 // "GPTX"
+#define TEXTURE_FILE_VERSION 1
+#define TEXTURE_FORMAT_RGBA8 0
+#define TEXTURE_FORMAT_DXT5 1
+#define TEXTURE_MAX_LEVELS 16
 
-    // Number of vertices
-    fwrite(&vertex_count, sizeof(uint32_t), 1, output);
+struct texture_file_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t level_count;
+};
 
-    // Number of triangles in each collision group
-    fwrite(&face_count, sizeof(uint32_t), 1, output);
+struct texture_file_level
+{
+    uint32_t offset;
+    uint32_t size;
+};
 
-    // Number of borders in each collision group
-    fwrite(&border_count, sizeof(uint32_t), 1, output);
+/*
+ * Decode a png into RGBA8 pixels
+ * Rows are ordered bottom to top (as GL expects) if flip is set
+ */
+static uint8_t *load_png_rgba(const char *path, bool flip, uint32_t *out_width, uint32_t *out_height)
+{
+    FILE *fp = fopen(path, "rb");
+    assert(fp);
 
-    // Vertex data
-    fwrite(vertices, sizeof(vertex), vertex_count, output);
+    png_structp png_t = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info_t = png_create_info_struct(png_t);
+    assert(png_t && info_t);
 
-    // Triangle data
-    for (size_t i = 0; i < face_count; i++)
+    if (setjmp(png_jmpbuf(png_t)))
     {
-        fwrite(&faces[i].group, sizeof(uint16_t), 1, output);
-        fwrite(&group_masks[faces[i].group], sizeof(uint16_t), 1, output);
-        fwrite(faces[i].vertex_index, sizeof(uint32_t), 3, output);
+        printf("Error decoding %s\n", path);
+        exit(1);
     }
 
-    // Border data
-    for (size_t i = 0; i < border_count; i++)
+    png_init_io(png_t, fp);
+    png_read_info(png_t, info_t);
+
+    // Normalize everything to 8 bit RGBA
+    png_set_expand(png_t);
+    png_set_strip_16(png_t);
+    png_set_gray_to_rgb(png_t);
+    png_set_add_alpha(png_t, 0xFF, PNG_FILLER_AFTER);
+    png_read_update_info(png_t, info_t);
+
+    uint32_t width = png_get_image_width(png_t, info_t);
+    uint32_t height = png_get_image_height(png_t, info_t);
+    uint8_t *pixels = calloc(4*width*height, sizeof(uint8_t));
+    png_bytep *rows = calloc(height, sizeof(png_bytep));
+    assert(pixels && rows);
+
+    for (uint32_t i = 0; i < height; i++)
+        rows[flip ? height - 1 - i : i] = pixels + 4*i*width;
+    png_read_image(png_t, rows);
+
+    free(rows);
+    png_destroy_read_struct(&png_t, &info_t, NULL);
+    fclose(fp);
+
+    *out_width = width;
+    *out_height = height;
+    return pixels;
+}
+
+/*
+ * Halve an image using a 2x2 box filter
+ */
+static uint8_t *downsample_rgba(const uint8_t *src, uint32_t width, uint32_t height)
+{
+    uint32_t w = width > 1 ? width / 2 : 1;
+    uint32_t h = height > 1 ? height / 2 : 1;
+    uint8_t *dest = calloc(4*w*h, sizeof(uint8_t));
+    assert(dest);
+
+    for (uint32_t y = 0; y < h; y++)
+        for (uint32_t x = 0; x < w; x++)
+        {
+            uint32_t x0 = 2*x < width ? 2*x : width - 1;
+            uint32_t x1 = 2*x + 1 < width ? 2*x + 1 : width - 1;
+            uint32_t y0 = 2*y < height ? 2*y : height - 1;
+            uint32_t y1 = 2*y + 1 < height ? 2*y + 1 : height - 1;
+
+            for (uint8_t c = 0; c < 4; c++)
+            {
+                uint32_t sum = src[4*(y0*width + x0) + c] + src[4*(y0*width + x1) + c] +
+                               src[4*(y1*width + x0) + c] + src[4*(y1*width + x1) + c];
+                dest[4*(y*w + x) + c] = (sum + 2) / 4;
+            }
+        }
+
+    return dest;
+}
+
+static uint16_t pack_rgb565(const uint8_t *c)
+{
+    return ((c[0] >> 3) << 11) | ((c[1] >> 2) << 5) | (c[2] >> 3);
+}
+
+static void unpack_rgb565(uint16_t v, int *c)
+{
+    c[0] = ((v >> 11) & 0x1F) * 255 / 31;
+    c[1] = ((v >> 5) & 0x3F) * 255 / 63;
+    c[2] = (v & 0x1F) * 255 / 31;
+}
+
+/*
+ * Compress a 4x4 block of RGBA pixels into 16 bytes of DXT5
+ * The color and alpha endpoints are taken from the bounds of the
+ * block, which is fast and good enough for painted backgrounds
+ */
+static void compress_dxt5_block(const uint8_t block[16][4], uint8_t *out)
+{
+    // Alpha: 8 interpolated values between the min and max alpha
+    uint8_t amin = 255, amax = 0;
+    for (uint8_t i = 0; i < 16; i++)
+    {
+        if (block[i][3] < amin) amin = block[i][3];
+        if (block[i][3] > amax) amax = block[i][3];
+    }
+
+    out[0] = amax;
+    out[1] = amin;
+    uint64_t alpha_bits = 0;
+    for (uint8_t i = 0; i < 16; i++)
+    {
+        uint64_t index = 0;
+        if (amax != amin)
+        {
+            // Position along the ramp, 0 = amax, 7 = amin
+            int step = ((amax - block[i][3]) * 7 + (amax - amin) / 2) / (amax - amin);
+
+            // Palette order is amax, amin, then the 6 intermediate values
+            index = step == 0 ? 0 : step == 7 ? 1 : step + 1;
+        }
+        alpha_bits |= index << (3*i);
+    }
+    for (uint8_t i = 0; i < 6; i++)
+        out[2 + i] = (alpha_bits >> (8*i)) & 0xFF;
+
+    // Color: 4 interpolated values between the bounding box corners
+    uint8_t cmin[3] = {255, 255, 255}, cmax[3] = {0, 0, 0};
+    for (uint8_t i = 0; i < 16; i++)
+        for (uint8_t c = 0; c < 3; c++)
+        {
+            if (block[i][c] < cmin[c]) cmin[c] = block[i][c];
+            if (block[i][c] > cmax[c]) cmax[c] = block[i][c];
+        }
+
+    uint16_t c0 = pack_rgb565(cmax);
+    uint16_t c1 = pack_rgb565(cmin);
+
+    // c0 <= c1 selects the 3 color + transparent mode, which we don't want
+    if (c0 < c1)
+    {
+        uint16_t tmp = c0;
+        c0 = c1;
+        c1 = tmp;
+    }
+
+    int palette[4][3];
+    unpack_rgb565(c0, palette[0]);
+    unpack_rgb565(c1, palette[1]);
+    for (uint8_t c = 0; c < 3; c++)
+    {
+        palette[2][c] = (2*palette[0][c] + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + 2*palette[1][c]) / 3;
+    }
+
+    uint32_t color_bits = 0;
+    if (c0 != c1)
+        for (uint8_t i = 0; i < 16; i++)
+        {
+            uint32_t best = 0;
+            int best_distance = -1;
+            for (uint8_t j = 0; j < 4; j++)
+            {
+                int distance = 0;
+                for (uint8_t c = 0; c < 3; c++)
+                    distance += (block[i][c] - palette[j][c])*(block[i][c] - palette[j][c]);
+
+                if (best_distance < 0 || distance < best_distance)
+                {
+                    best = j;
+                    best_distance = distance;
+                }
+            }
+            color_bits |= best << (2*i);
+        }
+
+    out[8] = c0 & 0xFF;
+    out[9] = c0 >> 8;
+    out[10] = c1 & 0xFF;
+    out[11] = c1 >> 8;
+    for (uint8_t i = 0; i < 4; i++)
+        out[12 + i] = (color_bits >> (8*i)) & 0xFF;
+}
+
+/*
+ * Compress an RGBA image into DXT5 blocks
+ * Returns the number of bytes written to out
+ */
+static size_t compress_dxt5(const uint8_t *src, uint32_t width, uint32_t height, uint8_t *out)
+{
+    size_t written = 0;
+    for (uint32_t by = 0; by < height; by += 4)
+        for (uint32_t bx = 0; bx < width; bx += 4)
+        {
+            // Blocks that extend past the edge of small mip levels repeat the edge pixels
+            uint8_t block[16][4];
+            for (uint8_t y = 0; y < 4; y++)
+                for (uint8_t x = 0; x < 4; x++)
+                {
+                    uint32_t px = bx + x < width ? bx + x : width - 1;
+                    uint32_t py = by + y < height ? by + y : height - 1;
+                    memcpy(block[4*y + x], &src[4*(py*width + px)], 4);
+                }
+
+            compress_dxt5_block(block, out + written);
+            written += 16;
+        }
+
+    return written;
+}
+
+/*
+ * Convert a png into a cooked texture containing the full mip chain.
+ * The engine loads this in place of the png when it exists alongside it
+ */
+void texture_convert_png(const char *input, const char *output, bool dxt5)
+{
+    uint32_t width, height;
+    uint8_t *level = load_png_rgba(input, true, &width, &height);
+
+    struct texture_file_header header =
+    {
+        .magic = TEXTURE_FILE_MAGIC,
+        .version = TEXTURE_FILE_VERSION,
+        .format = dxt5 ? TEXTURE_FORMAT_DXT5 : TEXTURE_FORMAT_RGBA8,
+        .width = width,
+        .height = height,
+        .level_count = 1
+    };
+
+    uint32_t w = width, h = height;
+    while ((w > 1 || h > 1) && header.level_count < TEXTURE_MAX_LEVELS)
+    {
+        w = w > 1 ? w / 2 : 1;
+        h = h > 1 ? h / 2 : 1;
+        header.level_count++;
+    }
+
+    FILE *out = fopen(output, "wb");
+    assert(out);
+
+    // The level table is filled in as the levels are written
+    struct texture_file_level levels[TEXTURE_MAX_LEVELS];
+    uint32_t offset = sizeof(header) + header.level_count*sizeof(struct texture_file_level);
+    fseek(out, offset, SEEK_SET);
+
+    uint8_t *compressed = dxt5 ? calloc(((width + 3)/4)*((height + 3)/4), 16) : NULL;
+    w = width;
+    h = height;
+    for (uint32_t i = 0; i < header.level_count; i++)
+    {
+        // Align each level to 16 bytes
+        static const uint8_t padding[16];
+        uint32_t aligned = (offset + 15) & ~15U;
+        fwrite(padding, 1, aligned - offset, out);
+        offset = aligned;
+
+        const uint8_t *data = level;
+        size_t size = 4*w*h;
+        if (dxt5)
+        {
+            size = compress_dxt5(level, w, h, compressed);
+            data = compressed;
+        }
+
+        fwrite(data, 1, size, out);
+        levels[i].offset = offset;
+        levels[i].size = (uint32_t)size;
+        offset += size;
+
+        if (i + 1 < header.level_count)
+        {
+            uint8_t *next = downsample_rgba(level, w, h);
+            free(level);
+            level = next;
+            w = w > 1 ? w / 2 : 1;
+            h = h > 1 ? h / 2 : 1;
+        }
+    }
+
+    fseek(out, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(levels, sizeof(struct texture_file_level), header.level_count, out);
+    fclose(out);
+
+    free(compressed);
+    free(level);
+    printf("Wrote %ux%u %s texture with %u levels to %s\n", width, height,
+           dxt5 ? "DXT5" : "RGBA8", header.level_count, output);
+}
+
+#pragma mark Layer frame atlas packing
+struct atlas_frame
+{
+    const char *layer;
+    const char *path;
+    uint8_t *pixels;
+    uint32_t width;
+    uint32_t height;
+
+    // Allocated cell (including padding) within the atlas
+    uint32_t atlas;
+    uint32_t x;
+    uint32_t y;
+    uint32_t cell_width;
+    uint32_t cell_height;
+};
+
+struct atlas_layer
+{
+    const char *name;
+    struct atlas_frame **frames;
+    uint32_t frame_count;
+    uint32_t atlas;
+};
+
+/*
+ * Sort frames by decreasing cell height, for shelf packing
+ */
+static int compare_frame_height(const void *_a, const void *_b)
+{
+    const struct atlas_frame *a = *(struct atlas_frame * const *)_a;
+    const struct atlas_frame *b = *(struct atlas_frame * const *)_b;
+    if (a->cell_height != b->cell_height)
+        return a->cell_height > b->cell_height ? -1 : 1;
+    return a->cell_width > b->cell_width ? -1 : a->cell_width < b->cell_width;
+}
+
+/*
+ * Pack frames into rows of a size x size atlas
+ * Returns false if they don't fit
+ */
+static bool atlas_pack_shelves(struct atlas_frame **frames, uint32_t count, uint32_t size)
+{
+    qsort(frames, count, sizeof(struct atlas_frame *), compare_frame_height);
+
+    uint32_t x = 0, y = 0, shelf_height = 0;
+    for (uint32_t i = 0; i < count; i++)
     {
-        fwrite(&border_groups[i], sizeof(uint16_t), 1, output);
-        fwrite(&group_masks[border_groups[i]], sizeof(uint16_t), 1, output);
+        struct atlas_frame *f = frames[i];
+        if (f->cell_width > size)
+            return false;
+
+        if (x + f->cell_width > size)
+        {
+            x = 0;
+            y += shelf_height;
+            shelf_height = 0;
+        }
+
+        if (y + f->cell_height > size)
+            return false;
+
+        f->x = x;
+        f->y = y;
+        x += f->cell_width;
+        if (f->cell_height > shelf_height)
+            shelf_height = f->cell_height;
+    }
+
+    return true;
+}
+
+/*
+ * Pack the frames of the given layers into the smallest
+ * power of two square that fits, up to max_size
+ * Returns the atlas size, or 0 if they don't fit
+ */
+static uint32_t atlas_pack_layers(struct atlas_layer *layers, uint32_t layer_count, uint32_t atlas, uint32_t max_size)
+{
+    uint32_t count = 0;
+    uint64_t area = 0;
+    for (uint32_t i = 0; i < layer_count; i++)
+        if (layers[i].atlas == atlas)
+            for (uint32_t j = 0; j < layers[i].frame_count; j++)
+            {
+                count++;
+                area += (uint64_t)layers[i].frames[j]->cell_width*layers[i].frames[j]->cell_height;
+            }
+
+    struct atlas_frame **frames = calloc(count, sizeof(struct atlas_frame *));
+    assert(frames);
+
+    count = 0;
+    for (uint32_t i = 0; i < layer_count; i++)
+        if (layers[i].atlas == atlas)
+            for (uint32_t j = 0; j < layers[i].frame_count; j++)
+                frames[count++] = layers[i].frames[j];
+
+    uint32_t size = 1;
+    while ((uint64_t)size*size < area)
+        size *= 2;
+
+    for (; size <= max_size; size *= 2)
+        if (atlas_pack_shelves(frames, count, size))
+            break;
+
+    free(frames);
+    return size <= max_size ? size : 0;
+}
+
+/*
+ * Copy a frame into the atlas image, repeating its edge pixels into the
+ * surrounding padding so that filtering never samples a neighbouring frame
+ */
+static void atlas_blit_frame(uint8_t *image, uint32_t size, struct atlas_frame *f, uint32_t padding)
+{
+    for (uint32_t y = 0; y < f->cell_height && f->y + y < size; y++)
+        for (uint32_t x = 0; x < f->cell_width && f->x + x < size; x++)
+        {
+            int32_t sx = (int32_t)x - (int32_t)padding;
+            int32_t sy = (int32_t)y - (int32_t)padding;
+            sx = sx < 0 ? 0 : sx >= (int32_t)f->width ? (int32_t)f->width - 1 : sx;
+            sy = sy < 0 ? 0 : sy >= (int32_t)f->height ? (int32_t)f->height - 1 : sy;
+
+            memcpy(&image[4*((f->y + y)*size + f->x + x)], &f->pixels[4*(sy*f->width + sx)], 4);
+        }
+}
+
+static void write_png_rgba(const char *path, const uint8_t *pixels, uint32_t width, uint32_t height)
+{
+    FILE *fp = fopen(path, "wb");
+    assert(fp);
 
-        fwrite(&border_lengths[i], sizeof(uint32_t), 1, output);
-        fwrite(border_vertex_indices[i], sizeof(uint32_t), border_lengths[i], output);
+    png_structp png_t = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info_t = png_create_info_struct(png_t);
+    assert(png_t && info_t);
+
+    if (setjmp(png_jmpbuf(png_t)))
+    {
+        printf("Error encoding %s\n", path);
+        exit(1);
     }
 
-    fclose(output);
-    printf("Wrote %d triangles and %d borders to %s\n", face_count, border_count, output_filename);
+    png_init_io(png_t, fp);
+    png_set_IHDR(png_t, info_t, width, height, 8, PNG_COLOR_TYPE_RGBA,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png_t, info_t);
+    for (uint32_t i = 0; i < height; i++)
+        png_write_row(png_t, (png_bytep)&pixels[4*i*width]);
+    png_write_end(png_t, NULL);
+
+    png_destroy_write_struct(&png_t, &info_t);
+    fclose(fp);
+}
+
+/*
+ * Pack individual layer frame images into shared atlases
+ *
+ * inputs are of the form layer=frame.png, with the frames of each
+ * layer given in order. Each frame is surrounded by padding pixels
+ * (copied from its edges) and starts on a multiple of align pixels,
+ * so that mipmap levels down to 1/align scale never mix frames.
+ * All frames of a layer are kept in the same atlas, and a new atlas
+ * is started when the current one would exceed max_size.
+ *
+ * The atlases are written to output_prefix-N.png, and output_lua
+ * is written as a lua chunk returning a table of
+ *   layer = {image = "atlas.png", frames = {vec4(...), ...}}
+ * entries that can be passed directly to scene:loadLayer.
+ */
+void atlas_pack_frames(const char **inputs, uint32_t input_count, const char *output_prefix,
+                       const char *output_lua, uint32_t max_size, uint32_t padding, uint32_t align)
+{
+    struct atlas_frame *frames = calloc(input_count, sizeof(struct atlas_frame));
+    struct atlas_layer *layers = calloc(input_count, sizeof(struct atlas_layer));
+    assert(frames && layers && align > 0);
+
+    uint32_t layer_count = 0;
+    for (uint32_t i = 0; i < input_count; i++)
+    {
+        struct atlas_frame *f = &frames[i];
+        const char *split = strchr(inputs[i], '=');
+        if (!split || split == inputs[i])
+        {
+            printf("Invalid frame `%s': expected layer=frame.png\n", inputs[i]);
+            exit(1);
+        }
+
+        f->layer = strndup(inputs[i], split - inputs[i]);
+        f->path = split + 1;
+        f->pixels = load_png_rgba(f->path, false, &f->width, &f->height);
+        f->cell_width = (f->width + 2*padding + align - 1) / align * align;
+        f->cell_height = (f->height + 2*padding + align - 1) / align * align;
+
+        struct atlas_layer *l = NULL;
+        for (uint32_t j = 0; j < layer_count; j++)
+            if (!strcmp(layers[j].name, f->layer))
+                l = &layers[j];
+
+        if (!l)
+        {
+            l = &layers[layer_count++];
+            l->name = f->layer;
+            l->frames = calloc(input_count, sizeof(struct atlas_frame *));
+            assert(l->frames);
+        }
+        l->frames[l->frame_count++] = f;
+    }
+
+    // Assign layers to atlases, starting a new atlas when a layer doesn't fit
+    uint32_t atlas_count = 1;
+    for (uint32_t i = 0; i < layer_count; i++)
+    {
+        layers[i].atlas = atlas_count - 1;
+        if (atlas_pack_layers(layers, i + 1, layers[i].atlas, max_size))
+            continue;
+
+        layers[i].atlas = atlas_count++;
+        if (!atlas_pack_layers(layers, i + 1, layers[i].atlas, max_size))
+        {
+            printf("Layer `%s' doesn't fit in a %ux%u atlas\n", layers[i].name, max_size, max_size);
+            exit(1);
+        }
+    }
+
+    FILE *lua = fopen(output_lua, "w");
+    assert(lua);
+    fprintf(lua, "-- Generated by GPModelConverter atlas\n");
+    fprintf(lua, "-- Frame regions are vec4(left, right, bottom, top) in texture coordinates\n");
+    fprintf(lua, "return {\n");
+
+    uint64_t frame_area = 0, atlas_area = 0;
+    for (uint32_t a = 0; a < atlas_count; a++)
+    {
+        // Repack to fix the final frame positions
+        uint32_t size = atlas_pack_layers(layers, layer_count, a, max_size);
+        uint8_t *image = calloc(4*size*size, sizeof(uint8_t));
+        assert(image);
+
+        char *image_path = calloc(strlen(output_prefix) + 16, sizeof(char));
+        assert(image_path);
+        sprintf(image_path, "%s-%u.png", output_prefix, a);
+
+        for (uint32_t i = 0; i < layer_count; i++)
+        {
+            struct atlas_layer *l = &layers[i];
+            if (l->atlas != a)
+                continue;
+
+            fprintf(lua, "    [\"%s\"] = {\n", l->name);
+            fprintf(lua, "        image = \"%s\",\n", image_path);
+            fprintf(lua, "        frames = {\n");
+            for (uint32_t j = 0; j < l->frame_count; j++)
+            {
+                struct atlas_frame *f = l->frames[j];
+                atlas_blit_frame(image, size, f, padding);
+
+                // Images are flipped on load, so texture y runs from the bottom of the png
+                uint32_t left = f->x + padding;
+                uint32_t top = size - (f->y + padding);
+                fprintf(lua, "            vec4(%u, %u, %u, %u)/%u, -- %s\n",
+                        left, left + f->width, top - f->height, top, size, f->path);
+                frame_area += (uint64_t)f->width*f->height;
+            }
+            fprintf(lua, "        },\n");
+            fprintf(lua, "    },\n");
+        }
+
+        write_png_rgba(image_path, image, size, size);
+        printf("Wrote %ux%u atlas to %s\n", size, size, image_path);
+        atlas_area += (uint64_t)size*size;
+        free(image_path);
+        free(image);
+    }
+
+    fprintf(lua, "}\n");
+    fclose(lua);
+
+    printf("Packed %u frames from %u layers into %u atlases (%.1f%% used)\n",
+           input_count, layer_count, atlas_count, 100.0*frame_area/atlas_area);
+
+    for (uint32_t i = 0; i < layer_count; i++)
+    {
+        free(layers[i].frames);
+        free((char *)layers[i].name);
+    }
+    for (uint32_t i = 0; i < input_count; i++)
+        free(frames[i].pixels);
+    free(layers);
+    free(frames);
+}
+
+#pragma mark Asset packing
+#define PACK_MAGIC 0x4B505047 // "GPPK"
+#define PACK_VERSION 1
+#define PACK_ENTRY_ZLIB (1 << 0)
+
+// Must match the definitions in vfs.c
+struct pack_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_count;
+    uint32_t names_size;
+};
+
+struct pack_entry
+{
+    uint32_t name_offset;
+    uint32_t flags;
+    uint32_t offset;
+    uint32_t stored_size;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+static bool pack_in_place(const char *path)
+{
+    size_t len = strlen(path);
+    return len > 4 && (!strcmp(path + len - 4, ".mdl") ||
+                       !strcmp(path + len - 4, ".map") ||
+                       !strcmp(path + len - 4, ".tex"));
+}
+
+static int compare_path(const void *_a, const void *_b)
+{
+    return strcmp(*(const char **)_a, *(const char **)_b);
+}
+
+/*
+ * Read an entire file into memory
+ */
+static uint8_t *read_file(const char *path, uint32_t *size)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t *data = malloc(length + 1);
+    assert(data);
+    if (length < 0 || fread(data, 1, length, file) != (size_t)length)
+    {
+        free(data);
+        data = NULL;
+    }
+
+    fclose(file);
+    *size = (uint32_t)length;
+    return data;
+}
+
+/*
+ * Write the input files into a pack archive for the engine's virtual file layer.
+ * Entries are named by their paths relative to the working directory, which
+ * should be the same as the engine's asset directory.
+ * If compress is set, files are stored zlib compressed when it saves at least a quarter
+ * of their size. Formats that the engine uses in place (.mdl, .map, .tex) are always
+ * stored uncompressed so that they can be used directly from the mapping.
+ */
+static void pack_files(const char *output, const char **inputs, uint32_t input_count, bool compress)
+{
+    const char **paths = calloc(input_count, sizeof(const char *));
+    struct pack_entry *entries = calloc(input_count, sizeof(struct pack_entry));
+    assert(paths && entries);
+
+    memcpy(paths, inputs, input_count*sizeof(const char *));
+    qsort(paths, input_count, sizeof(const char *), compare_path);
+
+    struct pack_header header = {PACK_MAGIC, PACK_VERSION, input_count, 0};
+    for (uint32_t i = 0; i < input_count; i++)
+    {
+        if (i > 0 && !strcmp(paths[i - 1], paths[i]))
+        {
+            printf("Duplicate pack entry %s\n", paths[i]);
+            exit(1);
+        }
+
+        entries[i].name_offset = header.names_size;
+        header.names_size += strlen(paths[i]) + 1;
+    }
+
+    FILE *pack = fopen(output, "wb");
+    if (!pack)
+    {
+        printf("Unable to open %s for writing\n", output);
+        exit(1);
+    }
+
+    // The index is written after the data, once the offsets are known
+    fwrite(&header, sizeof(struct pack_header), 1, pack);
+    fwrite(entries, sizeof(struct pack_entry), input_count, pack);
+    for (uint32_t i = 0; i < input_count; i++)
+        fwrite(paths[i], 1, strlen(paths[i]) + 1, pack);
+
+    uint64_t total_size = 0, total_stored = 0;
+    for (uint32_t i = 0; i < input_count; i++)
+    {
+        struct pack_entry *pe = &entries[i];
+        uint8_t *data = read_file(paths[i], &pe->size);
+        if (!data)
+        {
+            printf("Unable to read %s\n", paths[i]);
+            exit(1);
+        }
+
+        const uint8_t *stored = data;
+        pe->stored_size = pe->size;
+
+        uLongf compressed_size = compressBound(pe->size);
+        uint8_t *compressed = compress && !pack_in_place(paths[i]) ? malloc(compressed_size) : NULL;
+        if (compressed && compress2(compressed, &compressed_size, data, pe->size, Z_BEST_COMPRESSION) == Z_OK &&
+            compressed_size <= pe->size - pe->size / 4)
+        {
+            stored = compressed;
+            pe->stored_size = (uint32_t)compressed_size;
+            pe->flags |= PACK_ENTRY_ZLIB;
+        }
+
+        pe->offset = write_alignment(pack);
+        fwrite(stored, 1, pe->stored_size, pack);
+        total_size += pe->size;
+        total_stored += pe->stored_size;
+
+        free(compressed);
+        free(data);
+    }
+
+    fseek(pack, sizeof(struct pack_header), SEEK_SET);
+    fwrite(entries, sizeof(struct pack_entry), input_count, pack);
+    fclose(pack);
+
+    printf("Packed %u files (%llu bytes, %llu stored) into %s\n", input_count,
+           (unsigned long long)total_size, (unsigned long long)total_stored, output);
+
+    free(entries);
+    free(paths);
 }
 
 #pragma mark Main
+static void print_usage()
+{
+    printf("Usage:\n");
+    printf("  GPModelConverter walkmap input.obj output.map\n");
+    printf("  GPModelConverter upgrade-walkmap input.map output.map\n");
+    printf("  GPModelConverter model frame1.obj [frame2.obj [...]] output.mdl\n");
+    printf("  GPModelConverter upgrade-model input.mdl output.mdl\n");
+    printf("  GPModelConverter texture [--dxt5] input.png output.tex\n");
+    printf("  GPModelConverter pack [--compress] output.pack file [...]\n");
+    printf("  GPModelConverter atlas [--max-size 2048] [--padding 4] [--align 4] output_prefix output.lua layer=frame.png [...]\n");
+}
+
+/*
+ * Parse the options and inputs for the atlas subcommand
+ */
+static int atlas_main(int argc, const char *argv[])
+{
+    uint32_t max_size = 2048, padding = 4, align = 4;
+    int i = 2;
+    for (; i + 1 < argc && !strncmp(argv[i], "--", 2); i += 2)
+    {
+        uint32_t value = (uint32_t)strtoul(argv[i + 1], NULL, 10);
+        if (!strcmp(argv[i], "--max-size"))
+            max_size = value;
+        else if (!strcmp(argv[i], "--padding"))
+            padding = value;
+        else if (!strcmp(argv[i], "--align") && value > 0)
+            align = value;
+        else
+        {
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (argc - i < 3)
+    {
+        print_usage();
+        return 1;
+    }
+
+    atlas_pack_frames(&argv[i + 2], argc - i - 2, argv[i], argv[i + 1], max_size, padding, align);
+    return 0;
+}
+
 int main(int argc, const char * argv[])
 {
     if (argc < 3)
+    {
+        print_usage();
         return 1;
+    }
 
-    walkmap_convert_obj(argv[1], argv[2]);
+    if (!strcmp(argv[1], "atlas"))
+        return atlas_main(argc, argv);
+    else if (!strcmp(argv[1], "model") && argc >= 4)
+        model_convert_obj(&argv[2], argc - 3, argv[argc - 1]);
+    else if (!strcmp(argv[1], "upgrade-model") && argc == 4)
+        model_upgrade(argv[2], argv[3]);
+    else if (!strcmp(argv[1], "upgrade-walkmap") && argc == 4)
+        walkmap_upgrade(argv[2], argv[3]);
+    else if (!strcmp(argv[1], "walkmap") && argc == 4)
+        walkmap_convert_obj(argv[2], argv[3]);
+    else if (!strcmp(argv[1], "pack") && argc >= 5 && !strcmp(argv[2], "--compress"))
+        pack_files(argv[3], &argv[4], argc - 4, true);
+    else if (!strcmp(argv[1], "pack") && argc >= 4 && strcmp(argv[2], "--compress"))
+        pack_files(argv[2], &argv[3], argc - 3, false);
+    else if (!strcmp(argv[1], "texture") && argc == 4)
+        texture_convert_png(argv[2], argv[3], false);
+    else if (!strcmp(argv[1], "texture") && argc == 5 && !strcmp(argv[2], "--dxt5"))
+        texture_convert_png(argv[3], argv[4], true);
+    else if (argc == 3)
+    {
+        // Original usage: GPModelConverter input.obj output.map
+        walkmap_convert_obj(argv[1], argv[2]);
+    }
+    else
+    {
+        print_usage();
+        return 1;
+    }
 
-//    if (argc < 3)
-//    {
-//        printf("Usage: GPModelConverter frame1.obj [frame2.obj [...]] output.mdl");
-//        return 0;
-//    }
-//
-//    model_convert_obj(&argv[1], argc - 2, argv[argc - 1]);
     return 0;
 }
@@ -32,6 +32,7 @@ typedef enum
 {
     CVDisplayLinkRef displayLink;
     engine_ptr gameEngine;
+    NSOpenGLContext *uploadContext;
     uint64_t lastTick;
 }
 
@@ -53,6 +53,17 @@
 	return kCVReturnSuccess;
 }
 
+// Makes the texture upload context current on the engine's upload thread
+static bool SetUploadContext(void *context, bool current)
+{
+    if (current)
+        [(NSOpenGLContext *)context makeCurrentContext];
+    else
+        [NSOpenGLContext clearCurrentContext];
+
+    return context != nil;
+}
+
 // This is the renderer output callback function
 static CVReturn MyDisplayLinkCallback(CVDisplayLinkRef displayLink, const CVTimeStamp* now,
     const CVTimeStamp* outputTime, CVOptionFlags flagsIn, CVOptionFlags* flagsOut, void* displayLinkContext)
@@ -116,7 +127,11 @@ static CVReturn MyDisplayLinkCallback(CVDisplayLinkRef displayLink, const CVTime
 	[[self openGLContext] setValues:&(GLint){1} forParameter:NSOpenGLCPSwapInterval];
 
     NSRect rect = [self bounds];
-    gameEngine = engine_create([[[[NSBundle mainBundle] resourcePath] stringByAppendingPathComponent:@"assets"] UTF8String], rect.size.width, rect.size.height);
+    gameEngine = engine_create([[[[NSBundle mainBundle] resourcePath] stringByAppendingPathComponent:@"assets"] UTF8String], NULL, rect.size.width, rect.size.height);
+
+    // Upload textures from a separate thread, using a context that shares our objects
+    uploadContext = [[NSOpenGLContext alloc] initWithFormat:[self pixelFormat] shareContext:[self openGLContext]];
+    engine_start_upload_thread(gameEngine, SetUploadContext, uploadContext);
     lastTick = CVGetCurrentHostTime();
 }
 
@@ -145,6 +160,7 @@ static CVReturn MyDisplayLinkCallback(CVDisplayLinkRef displayLink, const CVTime
 
 	// Release the display link AFTER display link has been released
     engine_destroy(gameEngine);
+    [uploadContext release];
 
 	[super dealloc];
 }
@@ -243,6 +259,10 @@ static CVReturn MyDisplayLinkCallback(CVDisplayLinkRef displayLink, const CVTime
                     config->debug_text_triangles ^= true;
                 engine_update_overlay_display(gameEngine);
                 break;
+            case 't':
+                if (down)
+                    config->trace_dump = true;
+                break;
             case 'u': flags |= INPUT_RESET_CAMERA; break;
         }
     }